@@ -2,15 +2,18 @@
 #include "./ProvMetadata.h"
 
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include <cctype>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <sstream>
 
 using namespace llvm;
@@ -25,17 +28,125 @@ static cl::opt<std::string>
 
 namespace clam_prov {
 
+// A predicate of 'log_if' on the return value of the calls to a function
+struct LogPredicate {
+  enum Kind { Negative, NotSize, Range } kind;
+  long long min; // Of 'Range' (inclusive)
+  long long max;
+};
+
 static llvm::StringMap<Value *> functionNameToGlobal;
+static llvm::StringMap<GlobalVariable *> functionNameToIdCache;
+static std::map<long long, GlobalVariable *> callSiteIdToSwitch;
+static llvm::StringMap<std::vector<LogPredicate>> functionNameToPredicates;
 
 static int outputMode = -1;
 static int maxRecords = -1;
+static int logFormat = 1;
+static int flushMode = 0;
+static int flushIntervalMs = 0;
+static int durability = 1;
+static int durabilityIntervalMs = 1000;
+static int ioEngine = 0;
+static int perProcessFiles = 0;
+static int sampling = 0;
+static int samplingParameter = 1;
+static int statsDump = 0;
+static int statsSignal = 0;
+static int pipePolicy = 0;
+static int rotateSizeMb = 0;
+static int recordClock = 0;
+static int crashFlush = 0;
+static int inlineLogging = 0;
+static int siteSwitches = 0;
+static int siteSignal = 0;
+static int latency = 0;
+static int logSize = 0;
 static const StringRef functionNameInit("clam_prov_logging_init");
 static const StringRef functionNameShutdown("clam_prov_logging_shutdown");
 static const StringRef functionNameBuffer("clam_prov_logging_buffer");
+static const StringRef functionNameLogI64("clam_prov_log_i64");
+static const StringRef functionNameLogPtr("clam_prov_log_ptr");
+static const StringRef functionNameLogVoid("clam_prov_log_void");
+static const StringRef functionNameLogSize("clam_prov_log_size");
+static const StringRef functionNameLogSlow("clam_prov_log_slow");
+static const StringRef functionNameCheckAndFlush("clam_prov_logging_check_and_flush");
+static const StringRef functionNameRegisterSites("clam_prov_logging_register_sites");
+static const StringRef functionNameLogLatency("clam_prov_log_latency");
+static const StringRef variableNameIsInited("clam_prov_logging_is_inited");
+static const StringRef variableNameThreadBuffer("clam_prov_inline_thread_buffer");
+
+// The logger functions that insert a record, one per kind of return value of a call-site
+struct BufferLoggerFunctions {
+  Function *i64;  // Integers, and the bits of floating point values
+  Function *ptr;  // Pointers
+  Function *none; // void, and values of any other type (not logged)
+  Function *size; // Call-sites with a size (the 'log_size' key), with the value as for 'i64'
+};
+
+// What inline logging uses from the logger. The layouts match 'clam_prov_record' and 'clam_prov_inline_buffer'
+struct InlineLogger {
+  StructType *recordType;
+  StructType *bufferType;
+  StructType *timeSpecType;
+  GlobalVariable *isInited;
+  GlobalVariable *threadBuffer;
+  FunctionCallee clockGetTime;
+  Function *readCycleCounter;
+  Function *slowPath;
+  Function *checkAndFlush;
+  AllocaInst *timeSpec; // Per instrumented function
+};
+
+// What timing the call-sites uses (the 'latency' key)
+struct LatencyTimer {
+  StructType *timeSpecType;
+  FunctionCallee clockGetTime;
+  Function *logLatency;
+  AllocaInst *timeSpec; // Per instrumented function
+};
 
 static bool loadConfiguration(Module &M, std::string filePath);
 
+static bool getIntegerValue(const std::string &line, StringRef key, StringRef value, int &result) {
+  APInt valueInt;
+  if (value.getAsInteger(10, valueInt)) {
+    errs() << "Skipped line '" << line << "' with non-numeric " << key << " value\n";
+    return false;
+  }
+  result = valueInt.getSExtValue();
+  return true;
+}
+
+// Parses '<function>, negative', '<function>, not_size' or '<function>, range <min> <max>'
+static bool addLogPredicate(StringRef value) {
+  std::pair<StringRef, StringRef> functionAndPredicate = value.split(',');
+  StringRef functionName = functionAndPredicate.first.trim();
+  SmallVector<StringRef, 3> tokens;
+  functionAndPredicate.second.split(tokens, ' ', -1, false);
+  if (functionName.empty() || tokens.empty()) {
+    return false;
+  }
+  LogPredicate predicate = {LogPredicate::Negative, 0, 0};
+  if (tokens[0] == "negative" && tokens.size() == 1) {
+    predicate.kind = LogPredicate::Negative;
+  } else if (tokens[0] == "not_size" && tokens.size() == 1) {
+    predicate.kind = LogPredicate::NotSize;
+  } else if (tokens[0] == "range" && tokens.size() == 3) {
+    predicate.kind = LogPredicate::Range;
+    if (tokens[1].getAsInteger(10, predicate.min) || tokens[2].getAsInteger(10, predicate.max) ||
+        predicate.min > predicate.max) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+  functionNameToPredicates[functionName].push_back(predicate);
+  return true;
+}
+
 static bool loadConfiguration(Module &M, std::string filePath) {
+  functionNameToPredicates.clear();
   if (filePath.empty()) {
     //errs() << "Empty configuration file path\n";
     return false;
@@ -57,24 +168,56 @@ static bool loadConfiguration(Module &M, std::string filePath) {
     if (tokens.size() == 2) {
       StringRef key;
       key = tokens[0].trim();
+      StringRef value = tokens[1].trim();
       if (key == "output_mode") {
-        APInt valueInt;
-        StringRef value;
-        value = tokens[1].trim();
-        if (value.getAsInteger(10, valueInt)) {
-          errs() << "Skipped line '" << line << "' with non-numeric output_mode value\n";
-          continue;
-        }
-        outputMode = valueInt.getSExtValue();
-      }else if (key == "max_records") {
-        APInt valueInt;
-        StringRef value;
-        value = tokens[1].trim();
-        if (value.getAsInteger(10, valueInt)) {
-          errs() << "Skipped line '" << line << "' with non-numeric max_records value\n";
-          continue;
+        getIntegerValue(line, key, value, outputMode);
+      } else if (key == "max_records") {
+        getIntegerValue(line, key, value, maxRecords);
+      } else if (key == "log_format") {
+        getIntegerValue(line, key, value, logFormat);
+      } else if (key == "flush_mode") {
+        getIntegerValue(line, key, value, flushMode);
+      } else if (key == "flush_interval_ms") {
+        getIntegerValue(line, key, value, flushIntervalMs);
+      } else if (key == "durability") {
+        getIntegerValue(line, key, value, durability);
+      } else if (key == "durability_interval_ms") {
+        getIntegerValue(line, key, value, durabilityIntervalMs);
+      } else if (key == "io_engine") {
+        getIntegerValue(line, key, value, ioEngine);
+      } else if (key == "per_process_files") {
+        getIntegerValue(line, key, value, perProcessFiles);
+      } else if (key == "sampling") {
+        getIntegerValue(line, key, value, sampling);
+      } else if (key == "sampling_parameter") {
+        getIntegerValue(line, key, value, samplingParameter);
+      } else if (key == "stats_dump") {
+        getIntegerValue(line, key, value, statsDump);
+      } else if (key == "stats_signal") {
+        getIntegerValue(line, key, value, statsSignal);
+      } else if (key == "pipe_policy") {
+        getIntegerValue(line, key, value, pipePolicy);
+      } else if (key == "rotate_size_mb") {
+        getIntegerValue(line, key, value, rotateSizeMb);
+      } else if (key == "clock") {
+        getIntegerValue(line, key, value, recordClock);
+      } else if (key == "crash_flush") {
+        getIntegerValue(line, key, value, crashFlush);
+      } else if (key == "inline_logging") {
+        getIntegerValue(line, key, value, inlineLogging);
+      } else if (key == "site_switches") {
+        getIntegerValue(line, key, value, siteSwitches);
+      } else if (key == "site_signal") {
+        getIntegerValue(line, key, value, siteSignal);
+      } else if (key == "latency") {
+        getIntegerValue(line, key, value, latency);
+      } else if (key == "log_size") {
+        getIntegerValue(line, key, value, logSize);
+      } else if (key == "log_if") {
+        if (!addLogPredicate(value)) {
+          errs() << "Invalid value for log_if '" << value << "'\n";
+          return false;
         }
-        maxRecords = valueInt.getSExtValue();
       }
     }
   }
@@ -87,6 +230,87 @@ static bool loadConfiguration(Module &M, std::string filePath) {
     errs() << "Invalid value for max_records '" << maxRecords << "'\n";
     return false;
   }
+  // The shared file output has no v1 (see the fourth argument of 'clam_prov_logging_init')
+  if (logFormat < 1 || logFormat > 3 || (outputMode == 4 && logFormat == 1)) {
+    errs() << "Invalid value for log_format '" << logFormat << "'\n";
+    return false;
+  }
+  if (flushMode != 0 && flushMode != 1) {
+    errs() << "Invalid value for flush_mode '" << flushMode << "'\n";
+    return false;
+  }
+  if (flushIntervalMs < 0) {
+    errs() << "Invalid value for flush_interval_ms '" << flushIntervalMs << "'\n";
+    return false;
+  }
+  if (durability < 0 || durability > 3) {
+    errs() << "Invalid value for durability '" << durability << "'\n";
+    return false;
+  }
+  if (durabilityIntervalMs < 1) {
+    errs() << "Invalid value for durability_interval_ms '" << durabilityIntervalMs << "'\n";
+    return false;
+  }
+  if (ioEngine != 0 && ioEngine != 1) {
+    errs() << "Invalid value for io_engine '" << ioEngine << "'\n";
+    return false;
+  }
+  if (perProcessFiles != 0 && perProcessFiles != 1) {
+    errs() << "Invalid value for per_process_files '" << perProcessFiles << "'\n";
+    return false;
+  }
+  if (sampling < 0 || sampling > 3) {
+    errs() << "Invalid value for sampling '" << sampling << "'\n";
+    return false;
+  }
+  if (samplingParameter < 1) {
+    errs() << "Invalid value for sampling_parameter '" << samplingParameter << "'\n";
+    return false;
+  }
+  if (statsDump != 0 && statsDump != 1) {
+    errs() << "Invalid value for stats_dump '" << statsDump << "'\n";
+    return false;
+  }
+  if (statsSignal < 0) {
+    errs() << "Invalid value for stats_signal '" << statsSignal << "'\n";
+    return false;
+  }
+  if (pipePolicy < 0 || pipePolicy > 2) {
+    errs() << "Invalid value for pipe_policy '" << pipePolicy << "'\n";
+    return false;
+  }
+  if (rotateSizeMb < 0) {
+    errs() << "Invalid value for rotate_size_mb '" << rotateSizeMb << "'\n";
+    return false;
+  }
+  if (recordClock < 0 || recordClock > 2) {
+    errs() << "Invalid value for clock '" << recordClock << "'\n";
+    return false;
+  }
+  if (crashFlush != 0 && crashFlush != 1) {
+    errs() << "Invalid value for crash_flush '" << crashFlush << "'\n";
+    return false;
+  }
+  if (inlineLogging != 0 && inlineLogging != 1) {
+    errs() << "Invalid value for inline_logging '" << inlineLogging << "'\n";
+    return false;
+  }
+  if (latency != 0 && latency != 1) {
+    errs() << "Invalid value for latency '" << latency << "'\n";
+    return false;
+  }
+  if (logSize != 0 && logSize != 1) {
+    errs() << "Invalid value for log_size '" << logSize << "'\n";
+    return false;
+  }
+  if (siteSwitches < 0 || siteSwitches > 2) {
+    errs() << "Invalid value for site_switches '" << siteSwitches << "'\n";
+    return false;
+  }
+  if (siteSignal < 0 || (siteSignal > 0 && siteSignal == statsSignal)) {
+    errs() << "Invalid value for site_signal '" << siteSignal << "'\n";
+    return false;
+  }
 
   return true;
 }
@@ -110,16 +334,34 @@ static bool insertLoggerInitInMain(Module &module, Function &function){
 
   IRBuilder<> instructionBuilder(instruction);
 
-  ConstantInt *constantArg0 = instructionBuilder.getInt64(0);
-  ConstantInt *constantArg1 = instructionBuilder.getInt64(maxRecords);
-  ConstantInt *constantArg2 = instructionBuilder.getInt64(outputMode);
-
-  CallInst *loggerInitCall = instructionBuilder.CreateCall(loggerInitFunction, {constantArg0, constantArg1, constantArg2});
+  SmallVector<Value *, 4> loggerInitArgs;
+  loggerInitArgs.push_back(instructionBuilder.getInt64(maxRecords));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(outputMode));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(logFormat));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(flushMode));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(flushIntervalMs));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(durability));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(durabilityIntervalMs));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(ioEngine));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(perProcessFiles));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(sampling));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(samplingParameter));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(statsDump));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(statsSignal));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(pipePolicy));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(rotateSizeMb));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(recordClock));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(crashFlush));
+  loggerInitArgs.push_back(instructionBuilder.getInt64(siteSignal));
+  // The first argument is the number of arguments that follow
+  loggerInitArgs.insert(loggerInitArgs.begin(), instructionBuilder.getInt64(loggerInitArgs.size()));
+
+  CallInst *loggerInitCall = instructionBuilder.CreateCall(loggerInitFunction, loggerInitArgs);
   updated = true;
   return updated;
 }
 
-static bool insertLoggerShutdownInMain(Instruction *current, Module &module){
+static bool insertLoggerShutdown(Instruction *current, Module &module){
   //int clam_prov_logger_shutdown(int control, ...)
   bool updated = false;
   LLVMContext &llvmContext = module.getContext();
@@ -141,6 +383,16 @@ static bool insertLoggerShutdownInMain(Instruction *current, Module &module){
   return updated;
 }
 
+// A call that ends the process without running the exit handlers
+static bool isProcessExit(Instruction *instruction) {
+  CallBase *call = dyn_cast<CallBase>(instruction);
+  if (call == nullptr || call->getCalledFunction() == nullptr) {
+    return false;
+  }
+  StringRef name = call->getCalledFunction()->getName();
+  return name == "_exit" || name == "_Exit";
+}
+
 static Value* getFunctionNameVariable(StringRef functionName,
     IRBuilder<> &instructionBuilder, LLVMContext &llvmContext, Module &module) {
   if (functionNameToGlobal.find(functionName) == functionNameToGlobal.end()) {
@@ -154,7 +406,233 @@ static Value* getFunctionNameVariable(StringRef functionName,
   return functionNameToGlobal[functionName];
 }
 
-static bool insertBufferLoggerCall(Instruction *previous, Instruction *current, Function *bufferLoggerFunction, Module &module){
+static GlobalVariable* getFunctionIdCache(StringRef functionName, Module &module) {
+  if (functionNameToIdCache.find(functionName) == functionNameToIdCache.end()) {
+    IntegerType *typeInt32 = Type::getInt32Ty(module.getContext());
+    functionNameToIdCache[functionName] = new GlobalVariable(module, typeInt32, false, GlobalValue::InternalLinkage,
+        ConstantInt::get(typeInt32, 0), "clam_prov.function_id." + functionName);
+  }
+  return functionNameToIdCache[functionName];
+}
+
+static GlobalVariable* getSiteSwitch(long long callSiteId, Module &module) {
+  if (callSiteIdToSwitch.find(callSiteId) == callSiteIdToSwitch.end()) {
+    IntegerType *typeInt8 = Type::getInt8Ty(module.getContext());
+    callSiteIdToSwitch[callSiteId] = new GlobalVariable(module, typeInt8, false, GlobalValue::InternalLinkage,
+        ConstantInt::get(typeInt8, siteSwitches == 1 ? 1 : 0), "clam_prov.site." + std::to_string(callSiteId));
+  }
+  return callSiteIdToSwitch[callSiteId];
+}
+
+// The return value of a call-site as the 'long' that is logged
+static Value* getExitValue(Value *returnValue, IRBuilder<> &instructionBuilder) {
+  Type *returnType = returnValue->getType();
+  if (returnType->isIntegerTy()) {
+    bool isSigned = returnType->getIntegerBitWidth() > 1; // Log 'true' as '1'
+    return instructionBuilder.CreateIntCast(returnValue, instructionBuilder.getInt64Ty(), isSigned);
+  } else if (returnType->isFloatingPointTy() && returnType->getPrimitiveSizeInBits() <= 64) {
+    Type *bitsType = instructionBuilder.getIntNTy(returnType->getPrimitiveSizeInBits());
+    Value *bits = instructionBuilder.CreateBitCast(returnValue, bitsType);
+    return instructionBuilder.CreateZExt(bits, instructionBuilder.getInt64Ty());
+  } else if (returnType->isPointerTy()) {
+    return instructionBuilder.CreatePtrToInt(returnValue, instructionBuilder.getInt64Ty());
+  }
+  return instructionBuilder.getInt64(0);
+}
+
+/*
+  Append the record to the buffer of the thread without a call, as documented for 'clam_prov_inline_buffer' in
+  clam-prov-logger.h. Splits the basic block at 'current':
+    head -> check -> append -> published (-> flush) -> done
+    with 'slow' (a call to 'clam_prov_log_slow') instead when the record can't be appended inline.
+*/
+static void insertInlineLogger(Instruction *current, Value *callSiteId, Value *exitValue, Value *size, Value *functionName,
+                               GlobalVariable *functionIdCache, InlineLogger &inlineLogger) {
+  LLVMContext &llvmContext = current->getContext();
+  BasicBlock *head = current->getParent();
+  Function *function = head->getParent();
+  IntegerType *typeInt32 = Type::getInt32Ty(llvmContext);
+  IntegerType *typeInt64 = Type::getInt64Ty(llvmContext);
+
+  if (inlineLogger.timeSpec == nullptr) {
+    IRBuilder<> entryBuilder(&*function->getEntryBlock().getFirstInsertionPt());
+    inlineLogger.timeSpec = entryBuilder.CreateAlloca(inlineLogger.timeSpecType, nullptr, "clam_prov.time");
+  }
+
+  BasicBlock *done = head->splitBasicBlock(current->getIterator(), "clam_prov.done");
+  BasicBlock *check = BasicBlock::Create(llvmContext, "clam_prov.check", function, done);
+  BasicBlock *append = BasicBlock::Create(llvmContext, "clam_prov.append", function, done);
+  BasicBlock *published = BasicBlock::Create(llvmContext, "clam_prov.published", function, done);
+  BasicBlock *flush = BasicBlock::Create(llvmContext, "clam_prov.flush", function, done);
+  BasicBlock *slow = BasicBlock::Create(llvmContext, "clam_prov.slow", function, done);
+  head->getTerminator()->eraseFromParent();
+
+  IRBuilder<> instructionBuilder(head);
+  LoadInst *isInited = instructionBuilder.CreateAlignedLoad(typeInt32, inlineLogger.isInited, Align(4));
+  isInited->setAtomic(AtomicOrdering::Acquire);
+  Value *buffer = instructionBuilder.CreateLoad(inlineLogger.bufferType->getPointerTo(), inlineLogger.threadBuffer);
+  LoadInst *functionIdPlusOne = instructionBuilder.CreateAlignedLoad(typeInt32, functionIdCache, Align(4));
+  functionIdPlusOne->setAtomic(AtomicOrdering::Monotonic);
+  Value *isFast = instructionBuilder.CreateAnd(instructionBuilder.CreateICmpNE(isInited, instructionBuilder.getInt32(0)),
+      instructionBuilder.CreateAnd(instructionBuilder.CreateIsNotNull(buffer),
+                                   instructionBuilder.CreateICmpNE(functionIdPlusOne, instructionBuilder.getInt32(0))));
+  instructionBuilder.CreateCondBr(isFast, check, slow);
+
+  // A sealed buffer has a negative count, which is not below 'max_records' when unsigned
+  instructionBuilder.SetInsertPoint(check);
+  Value *recordCountPointer = instructionBuilder.CreateStructGEP(inlineLogger.bufferType, buffer, 0);
+  LoadInst *recordCount = instructionBuilder.CreateAlignedLoad(typeInt32, recordCountPointer, Align(4));
+  recordCount->setAtomic(AtomicOrdering::Monotonic);
+  Value *maxRecords = instructionBuilder.CreateLoad(typeInt32, instructionBuilder.CreateStructGEP(inlineLogger.bufferType, buffer, 1));
+  instructionBuilder.CreateCondBr(instructionBuilder.CreateICmpULT(recordCount, maxRecords), append, slow);
+
+  instructionBuilder.SetInsertPoint(append);
+  Value *records = instructionBuilder.CreateLoad(inlineLogger.recordType->getPointerTo(),
+                                                 instructionBuilder.CreateStructGEP(inlineLogger.bufferType, buffer, 2));
+  Value *tid = instructionBuilder.CreateLoad(typeInt32, instructionBuilder.CreateStructGEP(inlineLogger.bufferType, buffer, 3));
+  Value *record = instructionBuilder.CreateInBoundsGEP(inlineLogger.recordType, records,
+                                                       instructionBuilder.CreateZExt(recordCount, typeInt64));
+  instructionBuilder.CreateStore(tid, instructionBuilder.CreateStructGEP(inlineLogger.recordType, record, 1));
+  instructionBuilder.CreateStore(instructionBuilder.CreateSub(functionIdPlusOne, instructionBuilder.getInt32(1)),
+                                 instructionBuilder.CreateStructGEP(inlineLogger.recordType, record, 2));
+  instructionBuilder.CreateStore(callSiteId, instructionBuilder.CreateStructGEP(inlineLogger.recordType, record, 3));
+  instructionBuilder.CreateStore(exitValue, instructionBuilder.CreateStructGEP(inlineLogger.recordType, record, 4));
+  instructionBuilder.CreateStore(instructionBuilder.getInt64(1), instructionBuilder.CreateStructGEP(inlineLogger.recordType, record, 5));
+  instructionBuilder.CreateStore(size, instructionBuilder.CreateStructGEP(inlineLogger.recordType, record, 6));
+  // The same reading of the clock as the logger (see CLAM_PROV_CLOCK_*). The memory-mapped output always uses CLOCK_REALTIME
+  int clock = outputMode == 2 ? 0 : recordClock;
+  Value *time;
+  if (clock == 2) {
+    time = instructionBuilder.CreateCall(inlineLogger.readCycleCounter);
+  } else {
+    instructionBuilder.CreateCall(inlineLogger.clockGetTime,
+                                  {instructionBuilder.getInt32(clock == 1 ? 6 : 0), inlineLogger.timeSpec}); // CLOCK_MONOTONIC_COARSE or CLOCK_REALTIME
+    Value *seconds = instructionBuilder.CreateLoad(typeInt64, instructionBuilder.CreateStructGEP(inlineLogger.timeSpecType, inlineLogger.timeSpec, 0));
+    Value *nanoseconds = instructionBuilder.CreateLoad(typeInt64, instructionBuilder.CreateStructGEP(inlineLogger.timeSpecType, inlineLogger.timeSpec, 1));
+    if (clock == 1) {
+      time = instructionBuilder.CreateAdd(instructionBuilder.CreateMul(seconds, instructionBuilder.getInt64(1000 * 1000 * 1000)), nanoseconds);
+    } else {
+      time = instructionBuilder.CreateAdd(instructionBuilder.CreateMul(seconds, instructionBuilder.getInt64(1000)),
+                                          instructionBuilder.CreateSDiv(nanoseconds, instructionBuilder.getInt64(1000 * 1000)));
+    }
+  }
+  // In the memory-mapped output, a record with a time is complete
+  instructionBuilder.CreateFence(AtomicOrdering::Release, SyncScope::SingleThread);
+  instructionBuilder.CreateStore(time, instructionBuilder.CreateStructGEP(inlineLogger.recordType, record, 0));
+  Value *nextRecordCount = instructionBuilder.CreateAdd(recordCount, instructionBuilder.getInt32(1));
+  AtomicCmpXchgInst *publish = new AtomicCmpXchgInst(recordCountPointer, recordCount, nextRecordCount, Align(4),
+      AtomicOrdering::Release, AtomicOrdering::Monotonic, SyncScope::System);
+  instructionBuilder.Insert(publish);
+  // Fails only if the buffer got sealed by a flush since it was read. Then the slow path writes the record again.
+  instructionBuilder.CreateCondBr(instructionBuilder.CreateExtractValue(publish, 1), published, slow);
+
+  instructionBuilder.SetInsertPoint(published);
+  instructionBuilder.CreateCondBr(instructionBuilder.CreateICmpEQ(nextRecordCount, maxRecords), flush, done);
+
+  instructionBuilder.SetInsertPoint(flush);
+  instructionBuilder.CreateCall(inlineLogger.checkAndFlush, {instructionBuilder.getInt32(0)});
+  instructionBuilder.CreateBr(done);
+
+  instructionBuilder.SetInsertPoint(slow);
+  instructionBuilder.CreateCall(inlineLogger.slowPath, {callSiteId, exitValue, size, functionName, functionIdCache});
+  instructionBuilder.CreateBr(done);
+}
+
+// Whether the switch of the call-site is on (see 'clam_prov_site' in clam-prov-logger.h)
+static Value* getSiteSwitchCondition(long long callSiteId, IRBuilder<> &instructionBuilder, Module &module) {
+  LoadInst *isEnabled = instructionBuilder.CreateAlignedLoad(instructionBuilder.getInt8Ty(),
+                                                             getSiteSwitch(callSiteId, module), Align(1));
+  isEnabled->setAtomic(AtomicOrdering::Monotonic);
+  return instructionBuilder.CreateICmpNE(isEnabled, instructionBuilder.getInt8(0));
+}
+
+// The argument given by the 'clam-prov-size' label of the call-site, or nullptr if there is none
+static Value* getSizeOperand(CallBase &callBase, IRBuilder<> &instructionBuilder) {
+  unsigned int argumentMetadataCount = getCallSiteArgumentMetadataCount(callBase);
+  for (unsigned int i = 0; i < argumentMetadataCount; i++) {
+    long long callSiteId;
+    unsigned long long argumentIndex;
+    MDTuple *argumentMetadata = nullptr;
+    bool isInput;
+    int sizeOperandValue = 0;
+    if (!getCallSiteArgumentMetadata(i, callBase, callSiteId, argumentIndex, argumentMetadata)) {
+      continue;
+    }
+    getArgumentMetadataType(argumentMetadata, isInput, sizeOperandValue);
+    if (sizeOperandValue < 1 || (unsigned int)sizeOperandValue > callBase.arg_size()) {
+      continue;
+    }
+    Value *size = callBase.getArgOperand(sizeOperandValue - 1); // Starts at 1
+    if (size->getType()->isIntegerTy()) {
+      return instructionBuilder.CreateZExtOrTrunc(size, instructionBuilder.getInt64Ty());
+    }
+  }
+  return nullptr;
+}
+
+// Whether the return value of the call-site ('exitValue') satisfies one of the 'log_if' predicates of its function
+static Value* getPredicateCondition(CallBase &callBase, Value *exitValue, const std::vector<LogPredicate> &predicates,
+                                    IRBuilder<> &instructionBuilder) {
+  Value *condition = nullptr;
+  for (const LogPredicate &predicate : predicates) {
+    Value *holds;
+    if (predicate.kind == LogPredicate::Negative) {
+      holds = instructionBuilder.CreateICmpSLT(exitValue, instructionBuilder.getInt64(0));
+    } else if (predicate.kind == LogPredicate::NotSize) {
+      Value *size = getSizeOperand(callBase, instructionBuilder);
+      // Without a size, the predicate can't tell a short call-site, so it is logged
+      holds = size == nullptr ? instructionBuilder.getTrue() : instructionBuilder.CreateICmpNE(exitValue, size);
+    } else {
+      holds = instructionBuilder.CreateAnd(instructionBuilder.CreateICmpSGE(exitValue, instructionBuilder.getInt64(predicate.min)),
+                                           instructionBuilder.CreateICmpSLE(exitValue, instructionBuilder.getInt64(predicate.max)));
+    }
+    condition = condition == nullptr ? holds : instructionBuilder.CreateOr(condition, holds);
+  }
+  return condition;
+}
+
+// Nanoseconds of CLOCK_MONOTONIC, read inline (clock_gettime is in the vDSO) at the insert point of 'instructionBuilder'
+static Value* readMonotonicNanoseconds(IRBuilder<> &instructionBuilder, LatencyTimer &latencyTimer) {
+  IntegerType *typeInt64 = instructionBuilder.getInt64Ty();
+  if (latencyTimer.timeSpec == nullptr) {
+    Function *function = instructionBuilder.GetInsertBlock()->getParent();
+    IRBuilder<> entryBuilder(&*function->getEntryBlock().getFirstInsertionPt());
+    latencyTimer.timeSpec = entryBuilder.CreateAlloca(latencyTimer.timeSpecType, nullptr, "clam_prov.latency");
+  }
+  instructionBuilder.CreateCall(latencyTimer.clockGetTime,
+                                {instructionBuilder.getInt32(1), latencyTimer.timeSpec}); // CLOCK_MONOTONIC
+  Value *seconds = instructionBuilder.CreateLoad(typeInt64, instructionBuilder.CreateStructGEP(latencyTimer.timeSpecType, latencyTimer.timeSpec, 0));
+  Value *nanoseconds = instructionBuilder.CreateLoad(typeInt64, instructionBuilder.CreateStructGEP(latencyTimer.timeSpecType, latencyTimer.timeSpec, 1));
+  return instructionBuilder.CreateAdd(instructionBuilder.CreateMul(seconds, instructionBuilder.getInt64(1000 * 1000 * 1000)), nanoseconds);
+}
+
+/*
+  Log the call-site only if 'condition' holds (its switch is on, or its return value satisfies a predicate). Splits
+  the basic block at 'current':
+    head -> enabled -> done
+    with 'done' directly when 'condition' doesn't hold.
+  Returns the instruction to insert the logging before, in 'enabled'.
+*/
+static Instruction* insertLoggingCondition(Instruction *current, Value *condition, bool isUnlikely) {
+  LLVMContext &llvmContext = current->getContext();
+  BasicBlock *head = current->getParent();
+  Function *function = head->getParent();
+
+  BasicBlock *done = head->splitBasicBlock(current->getIterator(), "clam_prov.condition.done");
+  BasicBlock *enabled = BasicBlock::Create(llvmContext, "clam_prov.condition.enabled", function, done);
+  head->getTerminator()->eraseFromParent();
+
+  IRBuilder<> instructionBuilder(head);
+  // As '__builtin_expect', for predicates that only pass the failed calls
+  MDNode *weights = isUnlikely ? MDBuilder(llvmContext).createBranchWeights(1, 2000) : nullptr;
+  instructionBuilder.CreateCondBr(condition, enabled, done, weights);
+
+  instructionBuilder.SetInsertPoint(enabled);
+  return instructionBuilder.CreateBr(done);
+}
+
+static bool insertBufferLoggerCall(Instruction *previous, Instruction *current, const BufferLoggerFunctions &bufferLoggerFunctions,
+                                   InlineLogger *inlineLogger, LatencyTimer *latencyTimer, Module &module){
   bool updated = false;
   if (previous == nullptr || current == nullptr) {
     return updated;
@@ -165,7 +643,11 @@ static bool insertBufferLoggerCall(Instruction *previous, Instruction *current,
       return updated;
     }
     StringRef functionName = function->getName();
-    if (functionName == functionNameInit || functionName == functionNameBuffer) {
+    if (functionName == functionNameInit || functionName == functionNameBuffer ||
+        functionName == functionNameLogI64 || functionName == functionNameLogPtr ||
+        functionName == functionNameLogVoid || functionName == functionNameLogSize ||
+        functionName == functionNameLogSlow || functionName == functionNameCheckAndFlush ||
+        functionName == functionNameLogLatency) {
       return updated;
     }
 
@@ -174,18 +656,162 @@ static bool insertBufferLoggerCall(Instruction *previous, Instruction *current,
     if (!getCallSiteMetadata(*callBase, callSiteNode, callSiteId)) {
       return updated;
     }
+    // The call-site is timed from right before the call to right after it, if its switch is on. Then the predicates
+    // only filter the records. The switch is loaded once before the call, so a switched-off call-site reads no clock
+    Value *switchCondition = nullptr;
+    if (siteSwitches != 0) {
+      IRBuilder<> switchBuilder(previous);
+      switchCondition = getSiteSwitchCondition(callSiteId, switchBuilder, module);
+    }
+    Value *start = nullptr;
+    if (latencyTimer != nullptr && switchCondition != nullptr) {
+      IRBuilder<> startBuilder(insertLoggingCondition(previous, switchCondition, false));
+      Value *enabledStart = readMonotonicNanoseconds(startBuilder, *latencyTimer);
+      BasicBlock *enabled = startBuilder.GetInsertBlock();
+      IRBuilder<> phiBuilder(previous);
+      PHINode *startPhi = phiBuilder.CreatePHI(phiBuilder.getInt64Ty(), 2, "clam_prov.latency.start");
+      startPhi->addIncoming(enabledStart, enabled);
+      startPhi->addIncoming(phiBuilder.getInt64(0), enabled->getSinglePredecessor());
+      start = startPhi;
+    } else if (latencyTimer != nullptr) {
+      IRBuilder<> startBuilder(previous);
+      start = readMonotonicNanoseconds(startBuilder, *latencyTimer);
+    }
+    if (switchCondition != nullptr) {
+      current = insertLoggingCondition(current, switchCondition, false);
+    }
+    if (start != nullptr) {
+      IRBuilder<> latencyBuilder(current);
+      Value *end = readMonotonicNanoseconds(latencyBuilder, *latencyTimer);
+      latencyBuilder.CreateCall(latencyTimer->logLatency, {latencyBuilder.getInt64(callSiteId), latencyBuilder.CreateSub(end, start)});
+    }
+    auto predicates = functionNameToPredicates.find(functionName);
+    if (predicates != functionNameToPredicates.end()) {
+      IRBuilder<> predicateBuilder(current);
+      Value *predicateCondition = getPredicateCondition(*callBase, getExitValue(previous, predicateBuilder),
+                                                        predicates->second, predicateBuilder);
+      current = insertLoggingCondition(current, predicateCondition, true);
+    }
     LLVMContext &llvmContext = module.getContext();
     IRBuilder<> instructionBuilder(current);
 
-    ConstantInt *controlConstant = instructionBuilder.getInt32(0); // unused
     ConstantInt *callSiteIdConstant = instructionBuilder.getInt64(callSiteId);
     Value *functionNameConstant = getFunctionNameVariable(functionName, instructionBuilder, llvmContext, module);
-    CallInst *bufferLoggerCall = instructionBuilder.CreateCall(bufferLoggerFunction, {controlConstant, callSiteIdConstant, previous, functionNameConstant});
+    Type *returnType = callBase->getType();
+    // The size requested from the call-site, next to what it returns
+    Value *size = logSize == 1 ? getSizeOperand(*callBase, instructionBuilder) : nullptr;
+    if (inlineLogger != nullptr) {
+      Value *exitValue = getExitValue(previous, instructionBuilder);
+      insertInlineLogger(current, callSiteIdConstant, exitValue, size == nullptr ? instructionBuilder.getInt64(-1) : size,
+                         functionNameConstant, getFunctionIdCache(functionName, module), *inlineLogger);
+    // Call the typed logger functions directly, so the logger doesn't decode variable arguments per call
+    } else if (size != nullptr) {
+      Value *exitValue = getExitValue(previous, instructionBuilder);
+      instructionBuilder.CreateCall(bufferLoggerFunctions.size, {callSiteIdConstant, exitValue, size, functionNameConstant});
+    } else if (returnType->isPointerTy()) {
+      Value *exitValue = instructionBuilder.CreatePointerCast(previous, instructionBuilder.getInt8PtrTy());
+      instructionBuilder.CreateCall(bufferLoggerFunctions.ptr, {callSiteIdConstant, exitValue, functionNameConstant});
+    } else if (returnType->isIntegerTy() || returnType->isFloatingPointTy()) {
+      Value *exitValue = getExitValue(previous, instructionBuilder);
+      instructionBuilder.CreateCall(bufferLoggerFunctions.i64, {callSiteIdConstant, exitValue, functionNameConstant});
+    } else {
+      instructionBuilder.CreateCall(bufferLoggerFunctions.none, {callSiteIdConstant, functionNameConstant});
+    }
     updated = true;
   }
   return updated;
 }
 
+static Function* getBufferLoggerFunction(Module &module, StringRef functionName, ArrayRef<Type *> argTypes) {
+  LLVMContext &llvmContext = module.getContext();
+  IntegerType *resultType = IntegerType::getInt32Ty(llvmContext);
+  FunctionType *functionType = FunctionType::get(resultType, argTypes, false);
+  FunctionCallee functionCallee = module.getOrInsertFunction(functionName, functionType);
+  Function *function = dyn_cast<Function>(functionCallee.getCallee());
+  function->setDoesNotThrow();
+  return function;
+}
+
+static GlobalVariable* getLoggerVariable(Module &module, StringRef variableName, Type *type,
+                                         GlobalValue::ThreadLocalMode threadLocalMode) {
+  GlobalVariable *variable = module.getNamedGlobal(variableName);
+  if (variable == nullptr) {
+    variable = new GlobalVariable(module, type, false, GlobalValue::ExternalLinkage, nullptr, variableName,
+                                  nullptr, threadLocalMode);
+  }
+  return variable;
+}
+
+// Register the switches of the call-sites of the module from a constructor (see 'clam_prov_logging_register_sites')
+static void insertSiteTable(Module &module) {
+  LLVMContext &llvmContext = module.getContext();
+  IntegerType *typeInt32 = IntegerType::getInt32Ty(llvmContext);
+  IntegerType *typeInt64 = IntegerType::getInt64Ty(llvmContext);
+  PointerType *typeCharPointer = PointerType::getUnqual(Type::getInt8Ty(llvmContext));
+
+  StructType *siteType = StructType::create(llvmContext, {typeInt64, typeCharPointer}, "clam_prov_site");
+  std::vector<Constant *> sites;
+  for (auto &callSiteSwitch : callSiteIdToSwitch) {
+    sites.push_back(ConstantStruct::get(siteType, {ConstantInt::get(typeInt64, callSiteSwitch.first), callSiteSwitch.second}));
+  }
+  ArrayType *tableType = ArrayType::get(siteType, sites.size());
+  GlobalVariable *table = new GlobalVariable(module, tableType, true, GlobalValue::InternalLinkage,
+                                             ConstantArray::get(tableType, sites), "clam_prov.sites");
+
+  Function *registerSites = getBufferLoggerFunction(module, functionNameRegisterSites, {siteType->getPointerTo(), typeInt32});
+  Function *constructor = Function::Create(FunctionType::get(Type::getVoidTy(llvmContext), false),
+                                           GlobalValue::InternalLinkage, "clam_prov.register_sites", module);
+  IRBuilder<> instructionBuilder(BasicBlock::Create(llvmContext, "entry", constructor));
+  instructionBuilder.CreateCall(registerSites, {instructionBuilder.CreateConstInBoundsGEP2_32(tableType, table, 0, 0),
+                                                instructionBuilder.getInt32(sites.size())});
+  instructionBuilder.CreateRetVoid();
+  // Before the constructors of the program (65535 by default), which can run instrumented call-sites. The priorities
+  // up to 100 are reserved for the implementation
+  appendToGlobalCtors(module, constructor, 101);
+}
+
+// Shares the declaration of 'clock_gettime' with inline logging, if there is one
+static void getLatencyTimer(Module &module, LatencyTimer &latencyTimer, InlineLogger *inlineLogger) {
+  LLVMContext &llvmContext = module.getContext();
+  IntegerType *typeInt32 = IntegerType::getInt32Ty(llvmContext);
+  IntegerType *typeInt64 = IntegerType::getInt64Ty(llvmContext);
+
+  if (inlineLogger != nullptr) {
+    latencyTimer.timeSpecType = inlineLogger->timeSpecType;
+    latencyTimer.clockGetTime = inlineLogger->clockGetTime;
+  } else {
+    latencyTimer.timeSpecType = StructType::create(llvmContext, {typeInt64, typeInt64}, "clam_prov_timespec");
+    latencyTimer.clockGetTime = module.getOrInsertFunction("clock_gettime",
+        FunctionType::get(typeInt32, {typeInt32, latencyTimer.timeSpecType->getPointerTo()}, false));
+  }
+  latencyTimer.logLatency = getBufferLoggerFunction(module, functionNameLogLatency, {typeInt64, typeInt64});
+  latencyTimer.timeSpec = nullptr;
+}
+
+static void getInlineLogger(Module &module, InlineLogger &inlineLogger) {
+  LLVMContext &llvmContext = module.getContext();
+  IntegerType *typeInt32 = IntegerType::getInt32Ty(llvmContext);
+  IntegerType *typeInt64 = IntegerType::getInt64Ty(llvmContext);
+  PointerType *typeCharPointer = PointerType::getUnqual(Type::getInt8Ty(llvmContext));
+
+  inlineLogger.recordType = StructType::create(llvmContext,
+      {typeInt64, typeInt32, typeInt32, typeInt64, typeInt64, typeInt64, typeInt64}, "clam_prov_record");
+  inlineLogger.bufferType = StructType::create(llvmContext,
+      {typeInt32, typeInt32, inlineLogger.recordType->getPointerTo(), typeInt32}, "clam_prov_inline_buffer");
+  inlineLogger.timeSpecType = StructType::create(llvmContext, {typeInt64, typeInt64}, "clam_prov_timespec");
+  inlineLogger.isInited = getLoggerVariable(module, variableNameIsInited, typeInt32, GlobalValue::NotThreadLocal);
+  // Initial-exec, as the logger is linked and not loaded with dlopen. Then the address is an offset from the thread pointer
+  inlineLogger.threadBuffer = getLoggerVariable(module, variableNameThreadBuffer, inlineLogger.bufferType->getPointerTo(),
+                                                GlobalValue::InitialExecTLSModel);
+  inlineLogger.clockGetTime = module.getOrInsertFunction("clock_gettime",
+      FunctionType::get(typeInt32, {typeInt32, inlineLogger.timeSpecType->getPointerTo()}, false));
+  inlineLogger.readCycleCounter = recordClock == 2 ? Intrinsic::getDeclaration(&module, Intrinsic::readcyclecounter) : nullptr;
+  inlineLogger.slowPath = getBufferLoggerFunction(module, functionNameLogSlow,
+                                                  {typeInt64, typeInt64, typeInt64, typeCharPointer, typeInt32->getPointerTo()});
+  inlineLogger.checkAndFlush = getBufferLoggerFunction(module, functionNameCheckAndFlush, {typeInt32});
+  inlineLogger.timeSpec = nullptr;
+}
+
 bool AddLogging::runOnModule(Module &module) {
   bool updated = false;
 
@@ -193,44 +819,72 @@ bool AddLogging::runOnModule(Module &module) {
   if (!loadConfiguration(module, inputFilePath)) {
     return updated;
   }
+  functionNameToGlobal.clear();
+  functionNameToIdCache.clear();
+  callSiteIdToSwitch.clear();
 
   LLVMContext &llvmContext = module.getContext();
 
-  IntegerType *bufferLoggerArg0Type = IntegerType::getInt32Ty(llvmContext);
-  IntegerType *bufferLoggerResultType = IntegerType::getInt32Ty(llvmContext);
-  bool bufferLoggerIsVarArg = true;
-  FunctionType *bufferLoggerFunctionType = FunctionType::get(bufferLoggerResultType, bufferLoggerArg0Type, bufferLoggerIsVarArg);
-  FunctionCallee bufferLoggerFunctionCallee = module.getOrInsertFunction(functionNameBuffer, bufferLoggerFunctionType);
-  Function *bufferLoggerFunction = dyn_cast<Function>(bufferLoggerFunctionCallee.getCallee());
-  bufferLoggerFunction->setDoesNotThrow();
-
-  bool isMainFunction = false;;
+  IntegerType *typeInt64 = IntegerType::getInt64Ty(llvmContext);
+  PointerType *typeCharPointer = PointerType::getUnqual(Type::getInt8Ty(llvmContext));
+  BufferLoggerFunctions bufferLoggerFunctions;
+  bufferLoggerFunctions.i64 = getBufferLoggerFunction(module, functionNameLogI64, {typeInt64, typeInt64, typeCharPointer});
+  bufferLoggerFunctions.ptr = getBufferLoggerFunction(module, functionNameLogPtr, {typeInt64, typeCharPointer, typeCharPointer});
+  bufferLoggerFunctions.none = getBufferLoggerFunction(module, functionNameLogVoid, {typeInt64, typeCharPointer});
+  bufferLoggerFunctions.size = getBufferLoggerFunction(module, functionNameLogSize, {typeInt64, typeInt64, typeInt64, typeCharPointer});
+
+  InlineLogger inlineLogger;
+  if (inlineLogging == 1) {
+    getInlineLogger(module, inlineLogger);
+  }
+  LatencyTimer latencyTimer;
+  if (latency == 1) {
+    getLatencyTimer(module, latencyTimer, inlineLogging == 1 ? &inlineLogger : nullptr);
+  }
 
   for (Function &function : module) {
+    if (function.isDeclaration()) {
+      continue;
+    }
 
-    if(function.hasName() && function.getName() == "main"){
-      isMainFunction = true;
+    bool isMainFunction = function.hasName() && function.getName() == "main";
+    if (isMainFunction) {
       updated = insertLoggerInitInMain(module, function);
-    }else{
-      isMainFunction = false;
     }
 
+    // Collect first because inline logging splits the basic blocks
+    std::vector<std::pair<Instruction *, Instruction *>> callSites;
+    std::vector<Instruction *> exits;
     for (BasicBlock &basicBlock : function) {
       Instruction *previous = nullptr;
       for (Instruction &current : basicBlock) {
-        // Insert buffer calls conditionally
-        bool inserted = insertBufferLoggerCall(previous, &current, bufferLoggerFunction, module);
-        updated = updated || inserted;
+        callSites.push_back(std::make_pair(previous, &current));
         previous = &current;
-
-        // Insert shutdown call before all return instructions in the main function.
-        if (isMainFunction) {
-          if (ReturnInst *returnInst = dyn_cast<ReturnInst>(&current)) {
-            updated = insertLoggerShutdownInMain(&current, module);
-          }
+        if (isProcessExit(&current)) {
+          exits.push_back(&current);
         }
       }
     }
+
+    inlineLogger.timeSpec = nullptr;
+    latencyTimer.timeSpec = nullptr;
+    for (auto &callSite : callSites) {
+      // Insert buffer calls conditionally
+      bool inserted = insertBufferLoggerCall(callSite.first, callSite.second, bufferLoggerFunctions,
+                                             inlineLogging == 1 ? &inlineLogger : nullptr,
+                                             latency == 1 ? &latencyTimer : nullptr, module);
+      updated = updated || inserted;
+    }
+
+    // The logger shuts down by itself at exit (including when main returns), but not when the process ends with
+    // '_exit', so insert a shutdown call before it.
+    for (Instruction *exitCall : exits) {
+      updated = insertLoggerShutdown(exitCall, module);
+    }
+  }
+
+  if (!callSiteIdToSwitch.empty()) {
+    insertSiteTable(module);
   }
 
   return updated;
@@ -1,42 +1,416 @@
 #include "clam-prov-logger.h"
 
+#include <sched.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
 // Per thread state
 static __thread int clam_prov_thread_tid = -1;
+static __thread int clam_prov_thread_crashed = 0; // Flushing from a fatal signal handler (see crash mode)
+static __thread volatile sig_atomic_t clam_prov_thread_holds_lock = 0; // Owns 'clam_prov_lock' (see crash mode)
 
 // Global variable set by the user (from API)
 static int clam_prov_max_records;
 static int clam_prov_logger_output_mode = -1;
+static int clam_prov_logger_log_format = CLAM_PROV_LOG_FORMAT_V1;
+static int clam_prov_logger_flush_mode = CLAM_PROV_FLUSH_SYNC;
+static int clam_prov_logger_flush_interval_ms = 0;
+static int clam_prov_logger_durability = CLAM_PROV_DURABILITY_FLUSH;
+static int clam_prov_logger_durability_interval_ms = 0;
+static int clam_prov_logger_per_process = 0;
+static int clam_prov_logger_sampling = CLAM_PROV_SAMPLING_NONE;
+static long clam_prov_logger_sampling_parameter = 0;
+static int clam_prov_logger_pipe_policy = CLAM_PROV_PIPE_BLOCK;
+static int clam_prov_logger_rotate_size_mb = 0;
+static int clam_prov_logger_clock = CLAM_PROV_CLOCK_REALTIME;
+static int clam_prov_inline_clock = CLAM_PROV_CLOCK_REALTIME; // The clock of the records appended inline
+static int clam_prov_logger_crash_flush = 0;
+static pid_t clam_prov_logger_pid = 0; // The process that initialized, or a child of it (not of 'vfork')
 static char clam_prov_logger_output_path[CLAM_PROV_PATH_LENGTH];
+static char clam_prov_logger_path_setting[CLAM_PROV_PATH_LENGTH]; // The 'output_path' override, or empty for the home
+
+/*
+  Self-profiling (clam_prov_stats).
+  Records are counted per buffer when they are taken from it (by a flush, or when a block of the memory-mapped output
+  is full), so inserting a record (or appending one inline) doesn't touch the counters. The other counters are updated
+  once per write. The time waited for the lock is only measured when it is contended.
+*/
+static int clam_prov_logger_profile_dump = 0;
+static int clam_prov_logger_profile_signal = 0;
+static struct sigaction clam_prov_logger_profile_old_action;
+static atomic_ulong clam_prov_logger_profile_records_dropped = 0;
+static atomic_ulong clam_prov_logger_profile_total_bytes = 0;
+static atomic_ulong clam_prov_logger_profile_total_writes = 0;
+static atomic_ulong clam_prov_logger_profile_flush_latency[CLAM_PROV_STATS_BUCKETS];
+static atomic_ulong clam_prov_logger_profile_lock_wait[CLAM_PROV_STATS_BUCKETS];
+
+/*
+  Crash mode. A thread that gets a fatal signal flushes the buffers with the usual writers before the signal takes its
+  default action, unless the signal interrupted it while it held 'clam_prov_lock'. Then memory comes from
+  'clam_prov_crash_buffer' instead of the heap, locks of other threads are only waited for CLAM_PROV_CRASH_LOCK_MS,
+  'flock' is not waited for, the pipe is written without waiting for the consumer (as with CLAM_PROV_PIPE_DROP), and the
+  steps that allocate or that can wait on a lock without a bound (rotating, io_uring, group sync, recycling the buffers
+  of exited threads) are left out.
+*/
+#define CLAM_PROV_CRASH_BUFFER_SIZE (CLAM_PROV_SIZE_BLOCK_HEADER + (2 * CLAM_PROV_SIZE_VARINT) + \
+  (CLAM_PROV_MAX_FUNCTIONS * (CLAM_PROV_SIZE_FUNCTION_V2 + CLAM_PROV_SIZE_INT)) + \
+  (CLAM_PROV_CRASH_RECORDS * CLAM_PROV_SIZE_RECORD)) // Fits a v1 or v2 write of CLAM_PROV_CRASH_RECORDS records
+static const int clam_prov_crash_signals[] = {SIGHUP, SIGINT, SIGQUIT, SIGILL, SIGTRAP, SIGABRT, SIGBUS, SIGFPE,
+                                              SIGSEGV, SIGTERM, SIGXCPU, SIGXFSZ, SIGSYS};
+#define CLAM_PROV_CRASH_SIGNALS ((int)(sizeof(clam_prov_crash_signals) / sizeof(clam_prov_crash_signals[0])))
+static int clam_prov_crash_handled[CLAM_PROV_CRASH_SIGNALS]; // The signals whose handler was set at init
+static atomic_int clam_prov_crash_state = 0; // '1' while a handler flushes, '2' once it is done
+static int clam_prov_crash_lock_failed = 0; // Set once the handler gave up on a lock, so it doesn't wait again
+static _Alignas(long) char clam_prov_crash_buffer[CLAM_PROV_CRASH_BUFFER_SIZE]; // Aligned like 'malloc' for the v2 ids
+
+// Site switches (see 'clam_prov_site'). Registered by the instrumented modules before 'main', and only appended to
+static clam_prov_site *clam_prov_site_tables[CLAM_PROV_MAX_SITE_TABLES];
+static int clam_prov_site_table_sizes[CLAM_PROV_MAX_SITE_TABLES];
+static atomic_int clam_prov_site_table_count = 0;
+static char clam_prov_sites_path[CLAM_PROV_PATH_LENGTH]; // Empty without a home directory
+static int clam_prov_logger_site_signal = 0;
+static struct sigaction clam_prov_logger_site_old_action;
+
+static int clam_prov_logger_output_fd = -1;
+atomic_int clam_prov_logging_is_inited = 0; // Read by inline logging
+
+/*
+  Records buffers.
+  Each thread appends to its own buffer without taking any lock. The only shared word is 'record_count' which the
+  owner publishes with a compare-and-swap after filling in a record. A flush (by the owner, or by any other thread
+  when forcing) takes exclusive ownership of the records by swapping 'record_count' to CLAM_PROV_BUFFER_SEALED, writes
+  them out, and hands the buffer back by resetting 'record_count' to '0'.
+  Buffers are never freed so that a flushing thread never touches released memory. A buffer of an exited thread is put
+  in the free list for the next new thread, by the thread that unseals it if it was sealed when its thread exited.
+*/
+#define CLAM_PROV_BUFFER_SEALED -1
+typedef struct clam_prov_buffer{
+  atomic_int record_count;                // Number of records in the buffer, or CLAM_PROV_BUFFER_SEALED when being flushed
+  int max_records;                        // Capacity of 'records'
+  clam_prov_record *records;
+  int tid;                                // The thread that owns the buffer
+  struct clam_prov_buffer *next;          // Next in the list of all buffers
+  struct clam_prov_buffer *next_free;     // Next in the list of free buffers
+  struct clam_prov_buffer *next_full;     // Next in the queue of the flusher thread
+  int sealed_records;                     // Number of records when queued for the flusher thread
+  atomic_ulong records_taken;             // Records taken from the buffer to the output (for the stats)
+  atomic_int is_released;                 // Set when its thread exited, until the buffer is in the free list
+} clam_prov_buffer;
+
+// Inline logging appends to the buffers through the public prefix
+_Static_assert(offsetof(clam_prov_buffer, record_count) == offsetof(clam_prov_inline_buffer, record_count) &&
+               offsetof(clam_prov_buffer, max_records) == offsetof(clam_prov_inline_buffer, max_records) &&
+               offsetof(clam_prov_buffer, records) == offsetof(clam_prov_inline_buffer, records) &&
+               offsetof(clam_prov_buffer, tid) == offsetof(clam_prov_inline_buffer, tid),
+               "clam_prov_inline_buffer must be a prefix of clam_prov_buffer");
+
+/*
+  Function names.
+  Interned by the address of the name into dense ids. The hash table is insert-only and lock-free. An entry's 'id'
+  is '0' until the name has been copied into 'clam_prov_function_names', and the id plus one after.
+*/
+typedef struct clam_prov_function{
+  _Atomic(const char *) key;              // Address of the function name passed by the caller
+  atomic_int id;                          // Id plus one
+} clam_prov_function;
+
+static clam_prov_function clam_prov_functions[CLAM_PROV_MAX_FUNCTIONS];
+static char clam_prov_function_names[CLAM_PROV_MAX_FUNCTIONS][CLAM_PROV_FUNCTION_NAME_LENGTH];
+static atomic_int clam_prov_function_count = 0;
+// Whether the v2 function table entry is in the output. Guarded by 'clam_prov_lock', except in the memory-mapped output
+// where the thread that sets it writes the entry
+static atomic_char clam_prov_function_written[CLAM_PROV_MAX_FUNCTIONS];
+// The v2 block with the function names written before v3 blocks. Guarded by 'clam_prov_lock'
+static char clam_prov_functions_block[CLAM_PROV_SIZE_BLOCK_HEADER + (2 * CLAM_PROV_SIZE_VARINT) +
+                                      (CLAM_PROV_MAX_FUNCTIONS * CLAM_PROV_SIZE_FUNCTION_V2)];
+static int clam_prov_new_function_ids[CLAM_PROV_MAX_FUNCTIONS];
+
+static __thread clam_prov_buffer *clam_prov_thread_buffer = NULL;
+static __thread clam_prov_buffer *clam_prov_thread_spare_buffer = NULL;
+// 'clam_prov_thread_buffer' if records can be appended inline (see 'clam_prov_set_thread_buffer')
+__thread clam_prov_inline_buffer *clam_prov_inline_thread_buffer __attribute__((tls_model("initial-exec"))) = NULL;
+static _Atomic(clam_prov_buffer *) clam_prov_buffers = NULL;
+static clam_prov_buffer *clam_prov_free_buffers = NULL;
+static pthread_key_t clam_prov_thread_key;
+static pthread_once_t clam_prov_thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_once_t clam_prov_atfork_once = PTHREAD_ONCE_INIT;
+
+/*
+  Flusher thread (CLAM_PROV_FLUSH_ASYNC, or a flush interval).
+  Threads queue their full buffers in 'clam_prov_full_buffers' (a lock-free stack), continue in their spare buffer,
+  and post 'clam_prov_flusher_signal'. The flusher thread writes the queued buffers and hands them back by resetting
+  'record_count' to '0'.
+  With a flush interval, the flusher thread also flushes all the buffers that are not empty once every interval.
+  With CLAM_PROV_DURABILITY_PERIODIC, the flusher thread syncs the output once every durability interval.
+*/
+static _Atomic(clam_prov_buffer *) clam_prov_full_buffers = NULL;
+static pthread_t clam_prov_flusher_thread;
+static sem_t clam_prov_flusher_signal;
+static atomic_int clam_prov_flusher_is_running = 0;
+
+/*
+  Memory-mapped output (CLAM_PROV_OUTPUT_MMAP).
+  The output file is extended by a segment at a time (under 'flock', like the appends of the other processes), and
+  the segment is mapped. The records of each buffer are a v3 block in a segment, reserved with an atomic fetch-add on
+  'used', so threads write their records in place and there is nothing to write on a flush. Records that are in place
+  are in the page cache, so they outlive a crash of the process.
+  Segments are never unmapped so that a thread never writes to released memory.
+*/
+typedef struct clam_prov_segment{
+  char *mapping;                          // Page aligned start of the mapping
+  size_t mapping_length;
+  char *data;                             // Start of the segment in the mapping
+  off_t file_offset;                      // Start of the segment in the output file
+  size_t size;                            // Size of the segment including its header
+  atomic_size_t used;                     // Bytes reserved. Exceeds 'size' once the segment is full
+  struct clam_prov_segment *next;         // Next older segment
+} clam_prov_segment;
+
+static _Atomic(clam_prov_segment *) clam_prov_segments = NULL; // The current segment, followed by the older ones
+
+/*
+  Sampling (CLAM_PROV_SAMPLING_*).
+  Each call-site id has its own state, in its own cache line. An execution that is not sampled is counted in 'skipped',
+  and the next record of the call-site takes the count (plus one) as its weight. So the weights of the records of a
+  call-site add up to its executions, but for the ones after its last record.
+  The adaptive sampling logs one in every 'clam_prov_adaptive_rate' executions of each call-site. The rate is adapted
+  once per CLAM_PROV_SAMPLING_INTERVAL_MS from the executions in the interval, which each thread counts on its own and
+  adds up every CLAM_PROV_SAMPLING_BATCH executions.
+*/
+#define CLAM_PROV_SAMPLING_BATCH 1024
+typedef struct clam_prov_call_site{
+  _Alignas(64) atomic_int sampling;       // CLAM_PROV_SAMPLING_* plus one if set for the call-site, otherwise 0
+  atomic_long parameter;                  // Set with 'sampling'
+  atomic_ulong calls;                     // Executions, for the fixed and adaptive sampling
+  atomic_ulong skipped;                   // Executions not sampled since the last record
+  atomic_ulong next_us;                   // Token bucket: the time at which the bucket is full (cell rate algorithm)
+} clam_prov_call_site;
+
+static clam_prov_call_site clam_prov_call_sites[CLAM_PROV_MAX_CALL_SITES];
+static atomic_ulong clam_prov_adaptive_rate = 1;
+static atomic_ulong clam_prov_adaptive_calls = 0; // In the current interval
+static atomic_ulong clam_prov_adaptive_interval_start = 0;
+static __thread unsigned long clam_prov_thread_adaptive_calls = 0;
+
+/*
+  Aggregation output (CLAM_PROV_OUTPUT_AGGREGATE).
+  Instead of inserting a record, an execution adds one to the bucket of its return value in the histogram of its
+  call-site. Histograms are indexed by call-site id, and allocated on the first execution of their call-site. A summary
+  takes the counts with an atomic exchange, so each execution is in exactly one summary, and it only has the call-sites
+  executed since the previous summary.
+*/
+typedef struct clam_prov_histogram{
+  _Alignas(64) atomic_int function_id;
+  atomic_ulong buckets[CLAM_PROV_AGGREGATE_BUCKETS];
+} clam_prov_histogram;
+
+static _Atomic(clam_prov_histogram *) clam_prov_histograms[CLAM_PROV_MAX_CALL_SITES];
+static atomic_long clam_prov_histograms_end = 0; // One past the biggest call-site id with a histogram
+static atomic_ulong clam_prov_not_aggregated = 0; // Executions of the call-sites with an id out of range
+static unsigned long clam_prov_summary_start = 0; // Guarded by 'clam_prov_lock'
+
+/*
+  Latency of the call-sites. Histograms are indexed by call-site id, and allocated on the first timed execution of their
+  call-site, as for the aggregation output. The last one is shared by the call-sites with an id out of range. The
+  executions are the sum of the buckets.
+*/
+typedef struct clam_prov_latency_histogram{
+  _Alignas(64) atomic_ulong total_nanos;
+  atomic_ulong buckets[CLAM_PROV_LATENCY_BUCKETS];
+} clam_prov_latency_histogram;
+
+static _Atomic(clam_prov_latency_histogram *) clam_prov_latencies[CLAM_PROV_MAX_CALL_SITES + 1];
+static atomic_long clam_prov_latencies_end = 0; // One past the biggest call-site id with a histogram
+
+/*
+  Shared file output (CLAM_PROV_OUTPUT_SHARED).
+  The processes append to the same file without 'flock'. Each process maps the header at the start of the file, and a
+  flush reserves the space of its blocks with an atomic fetch-add on the tail in the header. The blocks are written in
+  the reserved space as a batch, and the magic of the batch is written last, so readers skip the batches that are not
+  completely written.
+*/
+typedef struct clam_prov_shared_header{
+  char block_header[CLAM_PROV_SIZE_BLOCK_HEADER];
+  atomic_ulong tail;                      // Offset in the file where the next batch is reserved
+} clam_prov_shared_header;
+
+static clam_prov_shared_header *clam_prov_shared_output = NULL;
+
+/*
+  Pipe output without waiting for the consumer (CLAM_PROV_PIPE_DROP and CLAM_PROV_PIPE_SPILL).
+  The pipe is opened for reading and writing without blocking, so opening it doesn't wait for a consumer and writing
+  to it never raises SIGPIPE. A block is only written if there is room for all of it in the pipe (the writers of all
+  processes hold 'flock'), so the stream is never cut in the middle of a block. Otherwise the block is dropped, or
+  appended to the spill file. The spill file is replayed in order, a block at a time, before anything new is written to
+  the pipe. Nothing waits for the consumer: v1 records stand alone, so a v1 write bigger than the pipe is written in
+  pieces of whole records, as long as they fit, and a v2 or v3 block bigger than the pipe is dropped. If the pipe takes
+  less of a write than it was checked for, the rest is spilled and replayed before anything else. When dropping, the
+  rest of the cut block (or record) is waited for a little, then kept to be written before anything else, and the
+  records after it are dropped, so the stream is never left cut.
+  The pipe is a ring of pages. A write takes at most one page more than its size, and two pages next to each other hold
+  more than a page (a write only starts a new page if it doesn't fit in the last one), so the pages in use are bounded
+  by twice the bytes in the pipe.
+  All of it is guarded by 'clam_prov_lock'.
+*/
+#define CLAM_PROV_PIPE_REPLAY_SIZE (64 * 1024) // Most bytes of v1 records replayed in one write
+#define CLAM_PROV_PIPE_CUT_WAIT_MS 100 // Most time waited for the consumer to take the rest of a cut block
+static int clam_prov_pipe_capacity = 0;
+static size_t clam_prov_pipe_page_size = 4096;
+static int clam_prov_spill_fd = -1;
+static off_t clam_prov_spill_offset = 0; // Replayed up to
+static off_t clam_prov_spill_size = 0; // Spilled up to
+static off_t clam_prov_spill_cut = 0; // The rest of a write cut in the pipe is spilled up to
+static char *clam_prov_pipe_cut = NULL; // The rest of a write cut in the pipe, when dropping
+static size_t clam_prov_pipe_cut_size = 0;
+static char clam_prov_spill_path[CLAM_PROV_PATH_LENGTH];
+
+/*
+  Rotation of the file output (a rotate size).
+  All the processes append to the file at the output path (the active segment). The write that takes the file to the
+  rotate size closes the segment, under 'flock': its process appends the footer that indexes the records of all the
+  processes in the segment, and renames the file to the next free '<path>.<n>'. Before encoding a write, a process
+  checks under 'flock' that its file is still the one at the path, and if not, opens the path again (which creates the
+  next active segment) and writes all the function names again.
+*/
+typedef struct clam_prov_footer{
+  unsigned long records;
+  unsigned long start_time, end_time;
+  unsigned char call_sites[CLAM_PROV_MAX_CALL_SITES / 8]; // Bit set of the call-site ids in range
+  long *other_call_sites;                 // Call-site ids out of range, with duplicates
+  int total_other_call_sites, max_other_call_sites;
+} clam_prov_footer;
+
+/*
+  Shared memory output (CLAM_PROV_OUTPUT_SHM).
+  A bounded ring of records in a POSIX shared memory object, written by the threads of all the logged processes of the
+  user and read by one consumer. Each slot has a sequence number: a writer claims slot 'n' by moving 'tail' from 'n'
+  when the sequence of the slot is 'n', and publishes the record by setting the sequence to 'n + 1'. The consumer frees
+  the slot by setting the sequence to 'n + capacity'.
+  Function names are interned by name in a table in the same shared memory so that the consumer resolves function
+  ids of all processes without copying.
+  Records that don't fit in the ring stay in the buffer of the thread until the consumer makes room. If the buffer is
+  full too, the thread waits for the consumer like a writer of a full pipe, or drops (and counts) the record if there
+  is no consumer.
+*/
+#define CLAM_PROV_SHM_FUNCTION_EMPTY 0
+#define CLAM_PROV_SHM_FUNCTION_WRITING 1
+#define CLAM_PROV_SHM_FUNCTION_WRITTEN 2
+typedef struct clam_prov_ring_header{
+  atomic_uint magic;                      // CLAM_PROV_LOG_MAGIC once the shared memory is initialized
+  unsigned int version;                   // CLAM_PROV_SHM_VERSION
+  unsigned int capacity;                  // Number of slots
+  unsigned int max_functions;             // Number of entries in the function table
+  atomic_ulong dropped;                   // Number of records dropped by writers
+  atomic_int consumer_pid;                // Process id of the consumer, or '0'
+  _Alignas(64) atomic_ulong tail;         // Next slot to write
+  _Alignas(64) atomic_ulong head;         // Next slot to read. Only written by the consumer
+} clam_prov_ring_header;
+
+typedef struct clam_prov_ring_slot{
+  atomic_ulong sequence;
+  clam_prov_record record;
+} clam_prov_ring_slot;
+
+typedef struct clam_prov_ring_function{
+  atomic_int state;                       // CLAM_PROV_SHM_FUNCTION_*
+  char name[CLAM_PROV_FUNCTION_NAME_LENGTH];
+} clam_prov_ring_function;
+
+struct clam_prov_ring{
+  clam_prov_ring_header *header;
+  clam_prov_ring_function *functions;
+  clam_prov_ring_slot *slots;
+  size_t size;                            // Size of the shared memory
+  int fd;                                 // Only kept open by the consumer
+};
+
+static clam_prov_ring *clam_prov_ring_output = NULL; // Never unmapped so that a thread never writes to released memory
+static atomic_int clam_prov_ring_function_ids[CLAM_PROV_MAX_FUNCTIONS]; // Id in the ring (plus one) of each function id
 
 /*
-static int clam_prov_logger_profile_io = 1;
-static double clam_prov_logger_profile_total_time_taken;
-static double clam_prov_logger_profile_total_writes;
-static double clam_prov_logger_profile_total_bytes;
+  io_uring engine (CLAM_PROV_IO_ENGINE_URING) for the file output.
+  A flush submits the write of its encoded records (linked to a sync if the durability asks for one) and returns
+  without waiting for it. The encoded records are freed when the completion is reaped, which the flushing threads do
+  before they submit. All of it is guarded by 'clam_prov_lock' because the rings are single producer and consumer.
+  At most one write is in flight: the engine doesn't keep the order of the writes that it has at the same time (a write
+  punted to a worker thread can complete after a later one), and a block must not land before the function names
+  that it uses. So a flush waits for the write of the previous one before it submits (or writes without the engine).
 */
+#define CLAM_PROV_URING_ENTRIES 64
+typedef struct clam_prov_uring{
+  int fd;
+  char *sq_ring, *cq_ring;                // Mappings of the rings
+  size_t sq_ring_size, cq_ring_size;
+  unsigned int entries;                   // Number of submission entries
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned int sq_local_tail;             // Tail including the entries that are not submitted yet
+  unsigned int in_flight;                 // Entries submitted and not reaped yet
+} clam_prov_uring;
 
-static int clam_prov_logger_output_fd;
-static int clam_prov_logging_is_inited = 0;
+typedef struct clam_prov_uring_write{
+  char *dst;                              // Encoded records. Freed on completion
+  struct iovec iov[2];
+  int iovcnt;
+  size_t size;
+  int *new_function_ids;                  // v2 function table entries in 'dst', written again if the write fails
+  int total_new_functions;
+} clam_prov_uring_write;
 
-// Records array
-static clam_prov_record *clam_prov_records = NULL;
-static int clam_prov_record_index = 0;
+static clam_prov_uring *clam_prov_uring_output = NULL;
 
 // Synchronization
-static pthread_mutex_t clam_prov_lock;
-static int clam_prov_lock_is_inited = 0;
+static pthread_mutex_t clam_prov_lock = PTHREAD_MUTEX_INITIALIZER; // Output
+static pthread_mutex_t clam_prov_buffers_lock = PTHREAD_MUTEX_INITIALIZER; // Free list of buffers
+static pthread_mutex_t clam_prov_sync_lock = PTHREAD_MUTEX_INITIALIZER; // Syncing the output. Taken after 'clam_prov_lock'
+
+// Durability. Writes to the output are numbered so that one sync can cover the writes of many threads
+static atomic_ulong clam_prov_written_sequence = 0;
+static unsigned long clam_prov_synced_sequence = 0; // Guarded by 'clam_prov_sync_lock'
 
 // Protos
-static int clam_prov_alloc_records();
-static void clam_prov_free_records();
+static clam_prov_buffer* clam_prov_alloc_buffer(int max_records);
+static clam_prov_buffer* clam_prov_acquire_thread_buffer();
+static void clam_prov_release_thread_buffer(void *value);
+static int clam_prov_flush_buffer(clam_prov_buffer *buffer, int min_records);
+static int clam_prov_flush_all_buffers();
+static int clam_prov_hand_off_buffer(clam_prov_buffer *buffer);
+static void clam_prov_flush_full_buffers();
+static int clam_prov_start_flusher();
+static void clam_prov_stop_flusher();
+static int clam_prov_write_summary();
+static clam_prov_record* clam_prov_map_records(int max_records);
+static void clam_prov_map_function(int function_id);
+static void clam_prov_sync_segments();
+static int clam_prov_ring_write(clam_prov_record *records, int total_records);
+static clam_prov_ring* clam_prov_ring_attach();
 static void clam_prov_close_output();
-static void clam_prov_do_cleanup();
 static int clam_prov_open_output_file();
 static int clam_prov_open_output_pipe();
+static int clam_prov_open_output_mapped();
 static int clam_prov_open_output();
+static void clam_prov_lock_segment();
+static int clam_prov_lock_mutex(pthread_mutex_t *mutex);
+static void clam_prov_hold_lock();
+static void clam_prov_release_lock();
+static void clam_prov_rotate_output();
+static char* clam_prov_put_block_header(char *dst, int version, unsigned int payload_size);
 static char* copy_str_n(char *dst, char *src, int n, int best_effort);
 static char* copy_function_name(char *dst, char *src);
+static int clam_prov_intern_function_name(char *function_name);
 static unsigned long get_current_milliseconds();
+static unsigned long clam_prov_clock_read();
+static unsigned long get_monotonic_milliseconds();
 static char* create_home_path(char *dst, char *path_name, int create);
 
 static char* create_home_path(char *dst, char *path_name, int create){
@@ -122,6 +496,51 @@ static char* copy_function_name(char *dst, char *src){
   return copy_str_n(dst, src, CLAM_PROV_FUNCTION_NAME_LENGTH, 1);
 }
 
+static unsigned long get_monotonic_milliseconds(){
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return (spec.tv_sec * 1000) + (spec.tv_nsec / (1000 * 1000));
+}
+
+static unsigned long get_monotonic_microseconds(){
+  struct timespec spec;
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return (spec.tv_sec * 1000 * 1000) + (spec.tv_nsec / 1000);
+}
+
+static int clam_prov_intern_function_name(char *function_name){
+  clam_prov_function *entry;
+  const char *key;
+  unsigned long hash;
+  int slot, probe, id;
+
+  if(function_name == NULL || function_name[0] == '\0'){
+    return -1;
+  }
+
+  hash = ((unsigned long)function_name >> 3) * 0x9E3779B97F4A7C15UL;
+  slot = (int)(hash % CLAM_PROV_MAX_FUNCTIONS);
+  for(probe = 0; probe < CLAM_PROV_MAX_FUNCTIONS; probe++, slot = (slot + 1) % CLAM_PROV_MAX_FUNCTIONS){
+    entry = &clam_prov_functions[slot];
+    key = atomic_load_explicit(&entry->key, memory_order_acquire);
+    if(key == NULL && atomic_compare_exchange_strong_explicit(&entry->key, &key, function_name,
+                                                              memory_order_acq_rel, memory_order_acquire)){
+      // Every id has its own slot so the ids never run out before the slots do
+      id = atomic_fetch_add_explicit(&clam_prov_function_count, 1, memory_order_relaxed);
+      copy_function_name(&clam_prov_function_names[id][0], function_name);
+      atomic_store_explicit(&entry->id, id + 1, memory_order_release);
+      return id;
+    }
+    if(key == function_name){
+      while((id = atomic_load_explicit(&entry->id, memory_order_acquire)) == 0){
+        sched_yield(); // Being copied by another thread
+      }
+      return id - 1;
+    }
+  }
+  return -1; // Table is full
+}
+
 static unsigned long get_current_milliseconds(){
   unsigned long millis;
   struct timespec spec;
@@ -130,41 +549,420 @@ static unsigned long get_current_milliseconds(){
   return millis;
 }
 
-static int clam_prov_alloc_records(){
-  if(clam_prov_max_records < 1){
-    return 0; // Invalid max records
+/*
+  Clock of the records (CLAM_PROV_CLOCK_*).
+  Other than with CLAM_PROV_CLOCK_REALTIME, inserting a record only reads the clock, and the records keep the reading
+  until they are written. The writer converts them against an anchor: a reading of the clock taken right after one of
+  the time of day. The conversion only depends on the rate of the clock over the time the records were buffered, and
+  the records of a thread keep their order at the resolution of the clock.
+*/
+static unsigned long clam_prov_clock_mult = 0; // Nanos per tick of the time-stamp counter, in 32.32 fixed point
+
+typedef struct clam_prov_clock_anchor{
+  unsigned long reading; // Of the clock of the records
+  unsigned long nanos;   // Of CLOCK_REALTIME
+} clam_prov_clock_anchor;
+
+static inline unsigned long clam_prov_read_tsc(){
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static unsigned long clam_prov_clock_read(){
+  struct timespec spec;
+
+  switch(clam_prov_logger_clock){
+    case CLAM_PROV_CLOCK_COARSE:
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &spec);
+      return ((unsigned long)spec.tv_sec * 1000000000UL) + (unsigned long)spec.tv_nsec;
+    case CLAM_PROV_CLOCK_TSC:
+      return clam_prov_read_tsc();
+    default:
+      return get_current_milliseconds();
+  }
+}
+
+// Whether the time-stamp counter has a constant rate and is in sync on all the CPUs (invariant TSC)
+static int clam_prov_clock_is_invariant(){
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+
+  if(__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0){
+    return 0; // No advanced power management leaf
+  }
+  return (edx & (1U << 8)) != 0;
+#else
+  return 0;
+#endif
+}
+
+// Measures the rate of the time-stamp counter against CLOCK_MONOTONIC_RAW. Returns 0 if it doesn't advance
+static int clam_prov_clock_calibrate(){
+  struct timespec start, end, pause;
+  unsigned long start_ticks, end_ticks, nanos;
+
+#if defined(__x86_64__) || defined(__i386__)
+  pause.tv_sec = 0;
+  pause.tv_nsec = CLAM_PROV_CLOCK_CALIBRATION_MS * 1000 * 1000;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  start_ticks = clam_prov_read_tsc();
+  while(nanosleep(&pause, &pause) != 0 && errno == EINTR){
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  end_ticks = clam_prov_read_tsc();
+
+  nanos = ((end.tv_sec - start.tv_sec) * 1000000000UL) + end.tv_nsec - start.tv_nsec;
+  if(end_ticks <= start_ticks || nanos == 0){
+    return 0;
+  }
+  clam_prov_clock_mult = (unsigned long)(((unsigned __int128)nanos << 32) / (end_ticks - start_ticks));
+  return clam_prov_clock_mult != 0;
+#else
+  return 0;
+#endif
+}
+
+// The coarse clock is anchored to the coarse time of day, which advances with it (at the same tick)
+static void clam_prov_clock_anchor_now(clam_prov_clock_anchor *anchor){
+  struct timespec spec;
+
+  clock_gettime(clam_prov_logger_clock == CLAM_PROV_CLOCK_COARSE ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &spec);
+  anchor->reading = clam_prov_clock_read();
+  anchor->nanos = ((unsigned long)spec.tv_sec * 1000000000UL) + (unsigned long)spec.tv_nsec;
+}
+
+// Converts a reading of the clock (before or after the anchor) to the time of day in nanos
+static unsigned long clam_prov_clock_to_nanos(clam_prov_clock_anchor *anchor, unsigned long reading){
+  unsigned long elapsed;
+  int is_before;
+
+  is_before = reading <= anchor->reading;
+  elapsed = is_before ? anchor->reading - reading : reading - anchor->reading;
+  if(clam_prov_logger_clock == CLAM_PROV_CLOCK_TSC){
+    elapsed = (unsigned long)(((unsigned __int128)elapsed * clam_prov_clock_mult) >> 32);
+  }
+  return is_before ? anchor->nanos - elapsed : anchor->nanos + elapsed;
+}
+
+// Converts the time of the records from readings of the clock to the time of day, in nanos or in millis
+static void clam_prov_clock_convert(clam_prov_record *records, int total_records, int is_nanos){
+  clam_prov_clock_anchor anchor;
+  int current_record_index;
+
+  clam_prov_clock_anchor_now(&anchor);
+  for(current_record_index = 0; current_record_index < total_records; current_record_index++){
+    records[current_record_index].time = clam_prov_clock_to_nanos(&anchor, records[current_record_index].time);
+    if(!is_nanos){
+      records[current_record_index].time /= 1000 * 1000;
+    }
+  }
+}
+
+static int clam_prov_profile_bucket(unsigned long microseconds){
+  int bucket;
+
+  if(microseconds == 0){
+    return 0;
+  }
+  bucket = 64 - __builtin_clzl(microseconds);
+  return bucket < CLAM_PROV_STATS_BUCKETS ? bucket : CLAM_PROV_STATS_BUCKETS - 1;
+}
+
+/*
+  Locks 'mutex'. In crash mode, waits at most CLAM_PROV_CRASH_LOCK_MS for it, and not at all after that happened once.
+
+  Returns 0 if 'mutex' was not locked (in crash mode), and 1 otherwise
+*/
+static int clam_prov_lock_mutex(pthread_mutex_t *mutex){
+  struct timespec pause;
+  int waited_ms;
+
+  if(clam_prov_thread_crashed == 0){
+    pthread_mutex_lock(mutex);
+    return 1;
+  }
+  pause.tv_sec = 0;
+  pause.tv_nsec = 1000 * 1000;
+  for(waited_ms = 0; clam_prov_crash_lock_failed == 0 && waited_ms <= CLAM_PROV_CRASH_LOCK_MS; waited_ms++){
+    if(pthread_mutex_trylock(mutex) == 0){
+      return 1;
+    }
+    nanosleep(&pause, NULL);
+  }
+  clam_prov_crash_lock_failed = 1;
+  return 0;
+}
+
+/*
+  Takes 'clam_prov_lock' to write to the output, and counts the time waited for it.
+
+  Returns 0 if it was not taken (in crash mode), and 1 otherwise
+*/
+static int clam_prov_lock_output(){
+  unsigned long start;
+  int bucket;
+
+  bucket = 0;
+  if(pthread_mutex_trylock(&clam_prov_lock) != 0){
+    start = get_monotonic_microseconds();
+    if(clam_prov_lock_mutex(&clam_prov_lock) == 0){
+      return 0;
+    }
+    bucket = clam_prov_profile_bucket(get_monotonic_microseconds() - start);
   }
-  clam_prov_records = (clam_prov_record *)malloc(sizeof(clam_prov_record) * clam_prov_max_records);
-  if(clam_prov_records == NULL){
-    return 0; // Failed to allocate memory
+  clam_prov_thread_holds_lock = 1;
+  atomic_fetch_add_explicit(&clam_prov_logger_profile_lock_wait[bucket], 1, memory_order_relaxed);
+  if(clam_prov_logger_rotate_size_mb > 0 && clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_FILE){
+    clam_prov_lock_segment();
   }
   return 1;
 }
 
-static void clam_prov_free_records(){
-  if(clam_prov_records != NULL){
-    free(clam_prov_records);
+// Takes 'clam_prov_lock' outside of crash mode. The owner is marked so that the crash handler doesn't flush in it
+static void clam_prov_hold_lock(){
+  pthread_mutex_lock(&clam_prov_lock);
+  clam_prov_thread_holds_lock = 1;
+}
+
+static void clam_prov_release_lock(){
+  clam_prov_thread_holds_lock = 0;
+  pthread_mutex_unlock(&clam_prov_lock);
+}
+
+/*
+  Takes 'flock' of the output. In crash mode, doesn't wait for it.
+
+  Returns 0 if it was not taken (in crash mode), and 1 otherwise
+*/
+static int clam_prov_lock_file(int fd){
+  if(clam_prov_thread_crashed == 0){
+    flock(fd, LOCK_EX);
+    return 1;
+  }
+  return flock(fd, LOCK_EX|LOCK_NB) == 0;
+}
+
+// Counts a write of 'total_records' records that started at 'start'. The records are lost if it failed
+static void clam_prov_profile_flush(unsigned long start, int result, int total_records){
+  int bucket;
+
+  bucket = clam_prov_profile_bucket(get_monotonic_microseconds() - start);
+  atomic_fetch_add_explicit(&clam_prov_logger_profile_flush_latency[bucket], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&clam_prov_logger_profile_total_writes, 1, memory_order_relaxed);
+  if(result == 0){
+    atomic_fetch_add_explicit(&clam_prov_logger_profile_records_dropped, (unsigned long)total_records,
+                              memory_order_relaxed);
+  }
+}
+
+static clam_prov_buffer* clam_prov_alloc_buffer(int max_records){
+  clam_prov_buffer *buffer;
+
+  if(max_records < 1){
+    return NULL; // Invalid max records
+  }
+  buffer = (clam_prov_buffer *)malloc(sizeof(clam_prov_buffer));
+  if(buffer == NULL){
+    return NULL; // Failed to allocate memory
+  }
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP){
+    buffer->records = clam_prov_map_records(max_records);
+  }else{
+    buffer->records = (clam_prov_record *)malloc(sizeof(clam_prov_record) * max_records);
+  }
+  if(buffer->records == NULL){
+    free(buffer);
+    return NULL; // Failed to allocate memory
+  }
+  buffer->max_records = max_records;
+  buffer->next_free = NULL;
+  buffer->next_full = NULL;
+  buffer->sealed_records = 0;
+  atomic_init(&buffer->record_count, 0);
+  atomic_init(&buffer->records_taken, 0);
+  atomic_init(&buffer->is_released, 0);
+
+  // Publish in the list of all buffers. Only ever pushed to, so readers can walk it without a lock.
+  buffer->next = atomic_load_explicit(&clam_prov_buffers, memory_order_relaxed);
+  while(!atomic_compare_exchange_weak_explicit(&clam_prov_buffers, &buffer->next, buffer,
+                                               memory_order_release, memory_order_relaxed)){
+  }
+  return buffer;
+}
+
+static void clam_prov_free_buffer(clam_prov_buffer *buffer){
+  pthread_mutex_lock(&clam_prov_buffers_lock);
+  buffer->next_free = clam_prov_free_buffers;
+  clam_prov_free_buffers = buffer;
+  pthread_mutex_unlock(&clam_prov_buffers_lock);
+}
+
+static clam_prov_buffer* clam_prov_take_free_buffer(){
+  clam_prov_buffer *buffer;
+
+  pthread_mutex_lock(&clam_prov_buffers_lock);
+  buffer = clam_prov_free_buffers;
+  if(buffer != NULL){
+    clam_prov_free_buffers = buffer->next_free;
+    buffer->next_free = NULL;
+  }
+  pthread_mutex_unlock(&clam_prov_buffers_lock);
+
+  if(buffer == NULL){
+    buffer = clam_prov_alloc_buffer(clam_prov_max_records);
+  }
+  return buffer;
+}
+
+/*
+  Hands the sealed 'buffer' back with 'total_records' records. If its thread exited while it was sealed, puts it in the
+  free list (see 'clam_prov_release_buffer').
+*/
+static void clam_prov_unseal_buffer(clam_prov_buffer *buffer, int total_records){
+  atomic_store_explicit(&buffer->record_count, total_records, memory_order_seq_cst);
+  if(clam_prov_thread_crashed == 0 && atomic_load_explicit(&buffer->is_released, memory_order_seq_cst) != 0 &&
+     atomic_exchange_explicit(&buffer->is_released, 0, memory_order_acq_rel) != 0){
+    clam_prov_free_buffer(buffer);
+  }
+}
+
+/*
+  Puts the buffer of an exited thread in the free list, unless it is sealed (with the flusher thread, or being flushed
+  by another thread). Then the thread that unseals it does, so that it is not taken by a new thread before then.
+  Whichever of the two sees the other's store takes 'is_released' back and frees it.
+*/
+static void clam_prov_release_buffer(clam_prov_buffer *buffer){
+  atomic_store_explicit(&buffer->is_released, 1, memory_order_seq_cst);
+  if(atomic_load_explicit(&buffer->record_count, memory_order_seq_cst) != CLAM_PROV_BUFFER_SEALED &&
+     atomic_exchange_explicit(&buffer->is_released, 0, memory_order_acq_rel) != 0){
+    clam_prov_free_buffer(buffer);
+  }
+}
+
+/*
+  Makes 'buffer' the thread's buffer, for the logger and the inline logging of the instrumented code alike. The inline
+  code appends to it unless records go through 'clam_prov_log_slow' to the shared memory output, to be sampled, to be
+  aggregated, or when the clock is overridden (the inline code reads the instrumented one).
+*/
+static void clam_prov_set_thread_buffer(clam_prov_buffer *buffer){
+  clam_prov_thread_buffer = buffer;
+  if(buffer == NULL || clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_SHM ||
+     clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_AGGREGATE ||
+     clam_prov_logger_sampling != CLAM_PROV_SAMPLING_NONE || clam_prov_logger_clock != clam_prov_inline_clock){
+    clam_prov_inline_thread_buffer = NULL;
+  }else{
+    clam_prov_inline_thread_buffer = (clam_prov_inline_buffer *)buffer;
+  }
+}
+
+// 'value' is unused. The thread's buffers are swapped after registering so they are read from the thread locals.
+static void clam_prov_release_thread_buffer(void *value){
+  clam_prov_inline_thread_buffer = NULL;
+  if(clam_prov_thread_buffer != NULL){
+    clam_prov_flush_buffer(clam_prov_thread_buffer, 1);
+    clam_prov_release_buffer(clam_prov_thread_buffer);
+    clam_prov_set_thread_buffer(NULL);
+  }
+  if(clam_prov_thread_spare_buffer != NULL){
+    // Might still be with the flusher thread
+    clam_prov_release_buffer(clam_prov_thread_spare_buffer);
+    clam_prov_thread_spare_buffer = NULL;
+  }
+}
+
+static void clam_prov_create_thread_key(){
+  pthread_key_create(&clam_prov_thread_key, &clam_prov_release_thread_buffer);
+}
+
+static clam_prov_buffer* clam_prov_acquire_thread_buffer(){
+  clam_prov_buffer *buffer;
+
+  pthread_once(&clam_prov_thread_key_once, &clam_prov_create_thread_key);
+
+  buffer = clam_prov_take_free_buffer();
+  if(buffer == NULL){
+    return NULL;
+  }
+  if(clam_prov_logger_flush_mode == CLAM_PROV_FLUSH_ASYNC){
+    // Double buffering. Filled while the other one is with the flusher thread.
+    clam_prov_thread_spare_buffer = clam_prov_take_free_buffer();
+    if(clam_prov_thread_spare_buffer == NULL){
+      clam_prov_free_buffer(buffer);
+      return NULL;
+    }
+  }
+
+  buffer->tid = clam_prov_thread_tid;
+  if(clam_prov_thread_spare_buffer != NULL){
+    clam_prov_thread_spare_buffer->tid = clam_prov_thread_tid;
   }
+
+  // Register to flush and recycle the buffers when the thread exits
+  pthread_setspecific(clam_prov_thread_key, buffer);
+  clam_prov_set_thread_buffer(buffer);
+  return buffer;
 }
 
 static void clam_prov_close_output(){
+  pthread_mutex_lock(&clam_prov_sync_lock);
+  if(clam_prov_shared_output != NULL){
+    munmap((void*)clam_prov_shared_output, CLAM_PROV_SHARED_HEADER_SIZE);
+    clam_prov_shared_output = NULL;
+  }
   if(clam_prov_logger_output_fd > -1){
     close(clam_prov_logger_output_fd);
+    clam_prov_logger_output_fd = -1;
   }
+  pthread_mutex_unlock(&clam_prov_sync_lock);
 }
 
-static void clam_prov_do_cleanup(){
-  clam_prov_free_records();
-  clam_prov_close_output();
+/*
+  The path of the output. 'path_name' in '~/.clam-prov', or the 'output_path' override. With 'is_per_process', the
+  process id is inserted before the extension of the name of the override (as in 'audit.<pid>.log').
+*/
+static char* clam_prov_get_output_path(char *dst, char *path_name, int is_per_process){
+  char *name, *extension;
+  int length;
+
+  if(clam_prov_logger_path_setting[0] == '\0'){
+    return create_home_path(dst, path_name, 1);
+  }
+  if(is_per_process == 0){
+    length = snprintf(dst, CLAM_PROV_PATH_LENGTH, "%s", &clam_prov_logger_path_setting[0]);
+  }else{
+    name = strrchr(&clam_prov_logger_path_setting[0], '/');
+    name = (name == NULL) ? &clam_prov_logger_path_setting[0] : name + 1;
+    extension = strrchr(name, '.');
+    if(extension == NULL || extension == name){
+      extension = name + strlen(name); // No extension (or a hidden file)
+    }
+    length = snprintf(dst, CLAM_PROV_PATH_LENGTH, "%.*s.%d%s", (int)(extension - &clam_prov_logger_path_setting[0]),
+                      &clam_prov_logger_path_setting[0], (int)getpid(), extension);
+  }
+  if(length >= CLAM_PROV_PATH_LENGTH){
+    return NULL;
+  }
+  return dst;
+}
+
+// The path of the output file. '~/.clam-prov/audit.<pid>.log' with a file per process
+static char* clam_prov_get_output_file(char *dst){
+  char path_name[CLAM_PROV_PATH_LENGTH];
+
+  if(clam_prov_logger_per_process == 0){
+    return clam_prov_get_output_path(dst, CLAM_PROV_PATH_NAME_FILE, 0);
+  }
+  snprintf(&path_name[0], CLAM_PROV_PATH_LENGTH, CLAM_PROV_PATH_NAME_PROCESS_FILE, (int)getpid());
+  return clam_prov_get_output_path(dst, &path_name[0], 1);
 }
 
 static int clam_prov_open_output_file(){
-  int create;
   char *full_path;
 
-  create = 1;
-  full_path = &clam_prov_logger_output_path[0];
-  full_path = create_home_path(full_path, CLAM_PROV_PATH_NAME_FILE, create);
+  full_path = clam_prov_get_output_file(&clam_prov_logger_output_path[0]);
   if(full_path == NULL){
     return 0;
   }
@@ -176,12 +974,9 @@ static int clam_prov_open_output_file(){
 }
 
 static int clam_prov_open_output_pipe(){
-  int create;
   char *full_path;
 
-  create = 1;
-  full_path = &clam_prov_logger_output_path[0];
-  full_path = create_home_path(full_path, CLAM_PROV_PATH_NAME_PIPE, create);
+  full_path = clam_prov_get_output_path(&clam_prov_logger_output_path[0], CLAM_PROV_PATH_NAME_PIPE, 0);
   if(full_path == NULL){
     return 0;
   }
@@ -190,23 +985,116 @@ static int clam_prov_open_output_pipe(){
       return 0;
     }
   }
-  clam_prov_logger_output_fd = open(full_path, O_WRONLY);
+  if(clam_prov_logger_pipe_policy == CLAM_PROV_PIPE_BLOCK){
+    clam_prov_logger_output_fd = open(full_path, O_WRONLY);
+  }else{
+    clam_prov_logger_output_fd = open(full_path, O_RDWR|O_NONBLOCK);
+  }
+  if(clam_prov_logger_output_fd < 0){
+    return 0;
+  }
+  if(clam_prov_logger_pipe_policy != CLAM_PROV_PIPE_BLOCK){
+    clam_prov_pipe_capacity = fcntl(clam_prov_logger_output_fd, F_GETPIPE_SZ);
+    if(clam_prov_pipe_capacity >= 0 && clam_prov_pipe_capacity < CLAM_PROV_PIPE_SIZE){
+      // Best effort. Limited by '/proc/sys/fs/pipe-max-size'
+      fcntl(clam_prov_logger_output_fd, F_SETPIPE_SZ, CLAM_PROV_PIPE_SIZE);
+      clam_prov_pipe_capacity = fcntl(clam_prov_logger_output_fd, F_GETPIPE_SZ);
+    }
+    if(clam_prov_pipe_capacity < 0){
+      return 0;
+    }
+    clam_prov_pipe_page_size = (size_t)sysconf(_SC_PAGESIZE);
+  }
+  return 1;
+}
+
+// Segments are mapped when records are first reserved
+static int clam_prov_open_output_mapped(){
+  char *full_path;
+
+  full_path = clam_prov_get_output_file(&clam_prov_logger_output_path[0]);
+  if(full_path == NULL){
+    return 0;
+  }
+  clam_prov_logger_output_fd = open(full_path, O_RDWR|O_CREAT, CLAM_PROV_PATH_PERMISSIONS);
+  if(clam_prov_logger_output_fd < 0){
+    return 0;
+  }
+  return 1;
+}
+
+/*
+  Creates the header of the shared file if the file is new, and maps it. Only the creation is under 'flock'.
+*/
+static int clam_prov_open_output_shared(){
+  char header[CLAM_PROV_SHARED_HEADER_SIZE];
+  char *full_path;
+  struct stat file_stat;
+  unsigned long tail;
+  void *mapping;
+  int is_created;
+
+  full_path = clam_prov_get_output_path(&clam_prov_logger_output_path[0], CLAM_PROV_PATH_NAME_SHARED_FILE, 0);
+  if(full_path == NULL){
+    return 0;
+  }
+  clam_prov_logger_output_fd = open(full_path, O_RDWR|O_CREAT, CLAM_PROV_PATH_PERMISSIONS);
   if(clam_prov_logger_output_fd < 0){
     return 0;
   }
+
+  is_created = 0;
+  flock(clam_prov_logger_output_fd, LOCK_EX);
+  if(fstat(clam_prov_logger_output_fd, &file_stat) == 0){
+    if(file_stat.st_size >= CLAM_PROV_SHARED_HEADER_SIZE){
+      is_created = 1;
+    }else{
+      // New, or its creator crashed before writing all of the header
+      memset((void*)(&header[0]), 0, CLAM_PROV_SHARED_HEADER_SIZE);
+      clam_prov_put_block_header(&header[0], CLAM_PROV_BLOCK_SHARED,
+                                 CLAM_PROV_SHARED_HEADER_SIZE - CLAM_PROV_SIZE_BLOCK_HEADER);
+      tail = CLAM_PROV_SHARED_HEADER_SIZE;
+      memcpy((void*)(&header[CLAM_PROV_SIZE_BLOCK_HEADER]), (void*)(&tail), sizeof(tail));
+      is_created = pwrite(clam_prov_logger_output_fd, &header[0], CLAM_PROV_SHARED_HEADER_SIZE, 0) ==
+        CLAM_PROV_SHARED_HEADER_SIZE;
+    }
+  }
+  flock(clam_prov_logger_output_fd, LOCK_UN);
+  if(is_created == 0){
+    return 0;
+  }
+
+  mapping = mmap(NULL, CLAM_PROV_SHARED_HEADER_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, clam_prov_logger_output_fd, 0);
+  if(mapping == MAP_FAILED){
+    return 0;
+  }
+  clam_prov_shared_output = (clam_prov_shared_header *)mapping;
+  clam_prov_put_block_header(&header[0], CLAM_PROV_BLOCK_SHARED, 0);
+  if(memcmp((void*)(&clam_prov_shared_output->block_header[0]), (void*)(&header[0]), 5) != 0){
+    return 0; // Not a shared file (magic and version)
+  }
   return 1;
 }
 
+static int clam_prov_open_output_shm(){
+  if(clam_prov_ring_output == NULL){
+    clam_prov_ring_output = clam_prov_ring_attach();
+  }
+  return clam_prov_ring_output == NULL ? 0 : 1;
+}
+
 static int clam_prov_open_output(){
   switch(clam_prov_logger_output_mode){
     case CLAM_PROV_OUTPUT_FILE: return clam_prov_open_output_file();
     case CLAM_PROV_OUTPUT_PIPE: return clam_prov_open_output_pipe();
+    case CLAM_PROV_OUTPUT_MMAP: return clam_prov_open_output_mapped();
+    case CLAM_PROV_OUTPUT_SHM: return clam_prov_open_output_shm();
+    case CLAM_PROV_OUTPUT_SHARED: return clam_prov_open_output_shared();
+    case CLAM_PROV_OUTPUT_AGGREGATE: return clam_prov_open_output_file();
     default: return 0;
   }
 }
 
-// User API
-
 static char* copy_record_to_dst_buffer(char *dst, clam_prov_record *src){
   int offset = 0;
   memcpy((void*)(&dst[offset]), (void*)(&src->time), CLAM_PROV_SIZE_UNSIGNED_LONG);
@@ -217,18 +1105,18 @@ static char* copy_record_to_dst_buffer(char *dst, clam_prov_record *src){
   offset += CLAM_PROV_SIZE_LONG;
   memcpy((void*)(&dst[offset]), (void*)(&src->exit), CLAM_PROV_SIZE_LONG);
   offset += CLAM_PROV_SIZE_LONG;
-  memcpy((void*)(&dst[offset]), (void*)(&src->function_name[0]), CLAM_PROV_SIZE_FUNCTION_NAME);
+  memcpy((void*)(&dst[offset]), (void*)(&clam_prov_function_names[src->function_id][0]), CLAM_PROV_SIZE_FUNCTION_NAME);
   offset += CLAM_PROV_SIZE_FUNCTION_NAME;
   return &dst[offset];
 }
 
-static char* copy_records_to_dst_buffer(char *dst, int total_records){
+static char* copy_records_to_dst_buffer(char *dst, clam_prov_record *records, int total_records){
   int current_record_index;
 
   current_record_index = 0;
 
   for(; current_record_index < total_records; current_record_index++){
-    dst = copy_record_to_dst_buffer(dst, &clam_prov_records[current_record_index]);
+    dst = copy_record_to_dst_buffer(dst, &records[current_record_index]);
   }
   return dst;
 }
@@ -238,94 +1126,3263 @@ static int get_dst_buffer_size(int total_records){
 }
 
 static char* alloc_dst_buffer(int dst_buffer_size){
+  if(clam_prov_thread_crashed == 1){
+    return dst_buffer_size <= (int)CLAM_PROV_CRASH_BUFFER_SIZE ? &clam_prov_crash_buffer[0] : NULL;
+  }
   return (char*)malloc(sizeof(char) * dst_buffer_size);
 }
 
 static void free_dst_buffer(char *dst){
-  free(dst);
+  if(dst != &clam_prov_crash_buffer[0]){
+    free(dst);
+  }
+}
+
+/*
+  Must hold 'clam_prov_lock'. Writes 'iov' as a batch in the space reserved for it at the tail of the shared file.
+
+  Returns the number of bytes of 'iov' written, or -1 on failure
+*/
+static ssize_t clam_prov_write_shared(struct iovec *iov, int iovcnt){
+  char header[CLAM_PROV_SIZE_BLOCK_HEADER];
+  struct iovec batch_iov[4];
+  size_t payload_size, batch_size;
+  off_t offset;
+  int i;
+
+  if(clam_prov_shared_output == NULL || iovcnt > 3){
+    return -1;
+  }
+  payload_size = 0;
+  for(i = 0; i < iovcnt; i++){
+    batch_iov[i + 1] = iov[i];
+    payload_size += iov[i].iov_len;
+  }
+  clam_prov_put_block_header(&header[0], CLAM_PROV_BLOCK_BATCH, (unsigned int)payload_size);
+  batch_iov[0].iov_base = (void*)(&header[4]); // Everything but the magic
+  batch_iov[0].iov_len = CLAM_PROV_SIZE_BLOCK_HEADER - 4;
+
+  batch_size = CLAM_PROV_SIZE_BLOCK_HEADER + payload_size;
+  batch_size = (batch_size + CLAM_PROV_SHARED_ALIGNMENT - 1) & ~((size_t)CLAM_PROV_SHARED_ALIGNMENT - 1);
+  offset = (off_t)atomic_fetch_add_explicit(&clam_prov_shared_output->tail, batch_size, memory_order_relaxed);
+
+  // A batch without its magic is skipped by readers
+  if(pwritev(clam_prov_logger_output_fd, &batch_iov[0], iovcnt + 1, offset + 4) !=
+     (ssize_t)(CLAM_PROV_SIZE_BLOCK_HEADER - 4 + payload_size)){
+    return -1;
+  }
+  if(pwrite(clam_prov_logger_output_fd, &header[0], 4, offset) != 4){
+    return -1;
+  }
+  return (ssize_t)payload_size;
+}
+
+/*
+  Sets 'slice_iov' to the 'length' bytes of 'iov' from 'offset' (or to fewer, at its end).
+
+  Returns the number of entries in 'slice_iov'
+*/
+static int clam_prov_slice_iov(struct iovec *iov, int iovcnt, size_t offset, size_t length, struct iovec *slice_iov){
+  int i, slice_iovcnt;
+
+  slice_iovcnt = 0;
+  for(i = 0; i < iovcnt && length > 0; i++){
+    if(offset >= iov[i].iov_len){
+      offset -= iov[i].iov_len;
+      continue;
+    }
+    slice_iov[slice_iovcnt].iov_base = (void*)((char*)iov[i].iov_base + offset);
+    slice_iov[slice_iovcnt].iov_len = iov[i].iov_len - offset < length ? iov[i].iov_len - offset : length;
+    length -= slice_iov[slice_iovcnt].iov_len;
+    offset = 0;
+    slice_iovcnt++;
+  }
+  return slice_iovcnt;
+}
+
+/*
+  Writes as much of 'iov' to the pipe as it takes, without waiting for the consumer.
+
+  Returns the number of bytes written, or -1 on failure
+*/
+static ssize_t clam_prov_write_nowait(struct iovec *iov, int iovcnt){
+  struct iovec remaining_iov[4];
+  ssize_t written_bytes, total_bytes;
+  size_t size;
+  int i;
+
+  if(iovcnt > 4){
+    return -1;
+  }
+  size = 0;
+  for(i = 0; i < iovcnt; i++){
+    size += iov[i].iov_len;
+  }
+  total_bytes = 0;
+  while((size_t)total_bytes < size){
+    written_bytes = writev(clam_prov_logger_output_fd, &remaining_iov[0],
+                           clam_prov_slice_iov(iov, iovcnt, (size_t)total_bytes, size, &remaining_iov[0]));
+    if(written_bytes < 0){
+      if(errno == EAGAIN){
+        break;
+      }else if(errno != EINTR){
+        return -1;
+      }
+      continue;
+    }
+    total_bytes += written_bytes;
+  }
+  return total_bytes;
+}
+
+/*
+  Writes all of 'iov' to the pipe, waiting for the consumer for at most 'wait_ms' milliseconds.
+
+  Returns the number of bytes written, or -1 on failure
+*/
+static ssize_t clam_prov_write_waiting(struct iovec *iov, int iovcnt, int wait_ms){
+  struct iovec remaining_iov[4];
+  struct pollfd pipe_poll;
+  unsigned long deadline, current_time;
+  ssize_t written_bytes, total_bytes;
+  size_t size;
+  int i;
+
+  size = 0;
+  for(i = 0; i < iovcnt; i++){
+    size += iov[i].iov_len;
+  }
+  deadline = get_monotonic_milliseconds() + (unsigned long)wait_ms;
+  total_bytes = 0;
+  while(1){
+    written_bytes = clam_prov_write_nowait(&remaining_iov[0],
+                                           clam_prov_slice_iov(iov, iovcnt, (size_t)total_bytes, size, &remaining_iov[0]));
+    if(written_bytes < 0){
+      return total_bytes > 0 ? total_bytes : -1;
+    }
+    total_bytes += written_bytes;
+    current_time = get_monotonic_milliseconds();
+    if((size_t)total_bytes == size || current_time >= deadline){
+      return total_bytes;
+    }
+    pipe_poll.fd = clam_prov_logger_output_fd;
+    pipe_poll.events = POLLOUT;
+    poll(&pipe_poll, 1, (int)(deadline - current_time));
+  }
+}
+
+/*
+  Must hold 'clam_prov_lock'. Forgets the rest of a write cut in the pipe (it is the parent's after a 'fork').
+*/
+static void clam_prov_clear_pipe_cut(){
+  free(clam_prov_pipe_cut);
+  clam_prov_pipe_cut = NULL;
+  clam_prov_pipe_cut_size = 0;
+}
+
+/*
+  Must hold 'clam_prov_lock' and 'flock' of the pipe. Writes the rest of a block (or record) cut in the pipe, waiting
+  for the consumer for at most 'wait_ms' milliseconds.
+
+  Returns '1' if nothing is left of it, otherwise '0'
+*/
+static int clam_prov_finish_pipe_cut(int wait_ms){
+  struct iovec iov;
+  ssize_t written_bytes;
+
+  if(clam_prov_pipe_cut_size == 0){
+    return 1;
+  }
+  iov.iov_base = (void*)clam_prov_pipe_cut;
+  iov.iov_len = clam_prov_pipe_cut_size;
+  written_bytes = clam_prov_write_waiting(&iov, 1, wait_ms);
+  if(written_bytes > 0 && (size_t)written_bytes < clam_prov_pipe_cut_size){
+    memmove(clam_prov_pipe_cut, clam_prov_pipe_cut + written_bytes, clam_prov_pipe_cut_size - (size_t)written_bytes);
+  }
+  if(written_bytes > 0){
+    clam_prov_pipe_cut_size -= (size_t)written_bytes;
+  }
+  if(clam_prov_pipe_cut_size > 0){
+    return 0;
+  }
+  if(clam_prov_thread_crashed == 0){
+    clam_prov_clear_pipe_cut();
+  }
+  return 1;
+}
+
+/*
+  Most bytes that fit in the empty pipe (see 'clam_prov_pipe_fits').
+*/
+static size_t clam_prov_pipe_max_size(){
+  size_t pages;
+
+  pages = (size_t)clam_prov_pipe_capacity / clam_prov_pipe_page_size;
+  return pages > 5 ? (pages - 5) * clam_prov_pipe_page_size : 0;
+}
+
+/*
+  Most bytes of v1 records written to the pipe in one write.
+*/
+static size_t clam_prov_pipe_piece_size(){
+  size_t size;
+
+  size = clam_prov_pipe_max_size() < CLAM_PROV_PIPE_REPLAY_SIZE ? clam_prov_pipe_max_size() : CLAM_PROV_PIPE_REPLAY_SIZE;
+  size = (size / CLAM_PROV_SIZE_RECORD) * CLAM_PROV_SIZE_RECORD;
+  return size > 0 ? size : CLAM_PROV_SIZE_RECORD;
+}
+
+/*
+  Must hold 'flock' of the pipe. Whether 'size' bytes can be written to the pipe without waiting for the consumer.
+  A block bigger than the pipe never fits.
+*/
+static int clam_prov_pipe_fits(size_t size){
+  size_t pages, needed_pages, used_pages;
+  int queued_bytes;
+
+  if(size > clam_prov_pipe_max_size()){
+    return 0;
+  }
+  pages = (size_t)clam_prov_pipe_capacity / clam_prov_pipe_page_size;
+  needed_pages = (size / clam_prov_pipe_page_size) + 2;
+  if(ioctl(clam_prov_logger_output_fd, FIONREAD, &queued_bytes) != 0){
+    return 0;
+  }
+  // Plus the page partially read, and the last one
+  used_pages = (2 * (((size_t)queued_bytes / clam_prov_pipe_page_size) + 1)) + 1;
+  return used_pages + needed_pages <= pages;
+}
+
+/*
+  Must hold 'clam_prov_lock'. Appends 'iov' to the spill file, which is created on the first spill.
+
+  Returns the number of bytes spilled, or -1 on failure
+*/
+static ssize_t clam_prov_spill(struct iovec *iov, int iovcnt, size_t size){
+  char path_name[CLAM_PROV_PATH_LENGTH];
+
+  if(clam_prov_spill_fd < 0){
+    if(clam_prov_thread_crashed == 1){
+      return -1; // Finding the home directory isn't safe in a signal handler
+    }
+    snprintf(&path_name[0], CLAM_PROV_PATH_LENGTH, CLAM_PROV_PATH_NAME_SPILL_FILE, (int)getpid());
+    if(create_home_path(&clam_prov_spill_path[0], &path_name[0], 1) == NULL){
+      return -1;
+    }
+    clam_prov_spill_fd = open(&clam_prov_spill_path[0], O_RDWR|O_CREAT|O_TRUNC, CLAM_PROV_PATH_PERMISSIONS);
+    if(clam_prov_spill_fd < 0){
+      return -1;
+    }
+    clam_prov_spill_offset = 0;
+    clam_prov_spill_size = 0;
+    clam_prov_spill_cut = 0;
+  }
+  // A partial append is written over by the next one
+  if(pwritev(clam_prov_spill_fd, iov, iovcnt, clam_prov_spill_size) != (ssize_t)size){
+    return -1;
+  }
+  clam_prov_spill_size += (off_t)size;
+  return (ssize_t)size;
+}
+
+/*
+  Must hold 'clam_prov_lock' and 'flock' of the pipe. Writes the spilled blocks (or v1 records) to the pipe, in order,
+  as long as they fit. The rest of a write cut in the pipe is written first, as much of it as the pipe takes. The spill
+  file is emptied once all of it is replayed.
+
+  Returns '1' if nothing is left in the spill file, otherwise '0'
+*/
+static int clam_prov_replay_spill(){
+  unsigned char header[CLAM_PROV_SIZE_BLOCK_HEADER];
+  struct iovec iov;
+  size_t size;
+  ssize_t written_bytes;
+  char *dst;
+  int is_read;
+
+  while(clam_prov_spill_offset < clam_prov_spill_size){
+    if(clam_prov_spill_offset < clam_prov_spill_cut){
+      size = (size_t)(clam_prov_spill_cut - clam_prov_spill_offset);
+      if(size > CLAM_PROV_PIPE_REPLAY_SIZE){
+        size = CLAM_PROV_PIPE_REPLAY_SIZE;
+      }
+    }else if(clam_prov_logger_log_format == CLAM_PROV_LOG_FORMAT_V1){
+      size = (size_t)(clam_prov_spill_size - clam_prov_spill_offset);
+      if(size > clam_prov_pipe_piece_size()){
+        size = clam_prov_pipe_piece_size();
+      }
+      if(clam_prov_pipe_fits(size) == 0){
+        return 0;
+      }
+    }else{
+      if(pread(clam_prov_spill_fd, &header[0], CLAM_PROV_SIZE_BLOCK_HEADER, clam_prov_spill_offset) !=
+         CLAM_PROV_SIZE_BLOCK_HEADER){
+        break;
+      }
+      size = CLAM_PROV_SIZE_BLOCK_HEADER + ((size_t)header[12] | ((size_t)header[13] << 8) |
+                                            ((size_t)header[14] << 16) | ((size_t)header[15] << 24));
+      if(clam_prov_pipe_fits(size) == 0){
+        return 0;
+      }
+    }
+    dst = alloc_dst_buffer((int)size);
+    if(dst == NULL){
+      return 0;
+    }
+    written_bytes = 0;
+    is_read = pread(clam_prov_spill_fd, dst, size, clam_prov_spill_offset) == (ssize_t)size;
+    if(is_read == 1){
+      iov.iov_base = (void*)dst;
+      iov.iov_len = size;
+      written_bytes = clam_prov_write_nowait(&iov, 1);
+    }
+    free_dst_buffer(dst);
+    if(is_read == 0){
+      break;
+    }
+    if(written_bytes < 0){
+      return 0;
+    }
+    if((size_t)written_bytes < size){
+      if(written_bytes > 0 && clam_prov_spill_offset >= clam_prov_spill_cut){
+        // The pipe took less than it was checked for, so the rest of the block (or record) goes first
+        clam_prov_spill_cut = clam_prov_spill_offset + (clam_prov_logger_log_format == CLAM_PROV_LOG_FORMAT_V1 ?
+          (off_t)(((written_bytes + CLAM_PROV_SIZE_RECORD - 1) / CLAM_PROV_SIZE_RECORD) * CLAM_PROV_SIZE_RECORD) :
+          (off_t)size);
+      }
+      clam_prov_spill_offset += (off_t)written_bytes;
+      return 0;
+    }
+    clam_prov_spill_offset += (off_t)size;
+  }
+  // Everything replayed, or the rest can't be read back
+  if(clam_prov_spill_size > 0){
+    ftruncate(clam_prov_spill_fd, 0);
+  }
+  clam_prov_spill_offset = 0;
+  clam_prov_spill_size = 0;
+  clam_prov_spill_cut = 0;
+  return 1;
+}
+
+/*
+  Must hold 'clam_prov_lock' and 'flock' of the pipe. Writes 'iov' to the pipe without waiting for the consumer
+  (CLAM_PROV_PIPE_DROP and CLAM_PROV_PIPE_SPILL). A v1 write bigger than the pipe is written in pieces, as long as they
+  fit. With CLAM_PROV_PIPE_SPILL, what doesn't fit is spilled, and so is all of 'iov' if the spill file can't be
+  replayed first. Otherwise, a block (or record) cut by the pipe is finished, and all of 'iov' is dropped if the rest of
+  a previous one can't be written first.
+
+  Returns the number of bytes written (or spilled), or -1 if 'iov' is dropped. If only some v1 records are written, the
+  others are counted as dropped, and all the bytes are returned
+*/
+static ssize_t clam_prov_write_pipe(struct iovec *iov, int iovcnt){
+  struct iovec piece_iov[4];
+  size_t size, piece_size, cut_size;
+  ssize_t written_bytes, total_bytes;
+  int i, piece_iovcnt;
+
+  if(iovcnt > 4){
+    return -1;
+  }
+  size = 0;
+  for(i = 0; i < iovcnt; i++){
+    size += iov[i].iov_len;
+  }
+  if(clam_prov_logger_pipe_policy == CLAM_PROV_PIPE_SPILL && clam_prov_replay_spill() == 0){
+    return clam_prov_spill(iov, iovcnt, size);
+  }
+  if(clam_prov_logger_pipe_policy != CLAM_PROV_PIPE_SPILL && clam_prov_finish_pipe_cut(0) == 0){
+    return -1;
+  }
+  piece_size = size;
+  if(clam_prov_logger_log_format == CLAM_PROV_LOG_FORMAT_V1){
+    piece_size = size < clam_prov_pipe_piece_size() ? size : clam_prov_pipe_piece_size();
+  }else if(size > clam_prov_pipe_max_size()){
+    return -1; // It would never be replayed either
+  }
+  total_bytes = 0;
+  while((size_t)total_bytes < size){
+    piece_iovcnt = clam_prov_slice_iov(iov, iovcnt, (size_t)total_bytes, piece_size, &piece_iov[0]);
+    if(clam_prov_pipe_fits(size - (size_t)total_bytes < piece_size ? size - (size_t)total_bytes : piece_size) == 0){
+      break;
+    }
+    written_bytes = clam_prov_write_nowait(&piece_iov[0], piece_iovcnt);
+    if(written_bytes < 0){
+      return -1;
+    }
+    total_bytes += written_bytes;
+    if(written_bytes == 0 || (size_t)total_bytes % piece_size != 0){
+      break; // The pipe took less than it was checked for
+    }
+  }
+  if((size_t)total_bytes == size){
+    return total_bytes;
+  }
+  cut_size = 0;
+  if(total_bytes > 0){
+    cut_size = clam_prov_logger_log_format == CLAM_PROV_LOG_FORMAT_V1 ?
+               (CLAM_PROV_SIZE_RECORD - ((size_t)total_bytes % CLAM_PROV_SIZE_RECORD)) % CLAM_PROV_SIZE_RECORD :
+               size - (size_t)total_bytes;
+  }
+  if(clam_prov_logger_pipe_policy == CLAM_PROV_PIPE_SPILL){
+    // The rest of a cut block (or record) is replayed before anything else
+    piece_iovcnt = clam_prov_slice_iov(iov, iovcnt, (size_t)total_bytes, size - (size_t)total_bytes, &piece_iov[0]);
+    if(clam_prov_spill(&piece_iov[0], piece_iovcnt, size - (size_t)total_bytes) < 0){
+      return -1;
+    }
+    clam_prov_spill_cut = clam_prov_spill_size - (off_t)(size - (size_t)total_bytes) + (off_t)cut_size;
+    return (ssize_t)size;
+  }
+  if(total_bytes == 0){
+    return -1;
+  }
+  if(cut_size > 0){
+    // The rest of the cut block (or record) is finished, as the consumer can't find the next one otherwise
+    piece_iovcnt = clam_prov_slice_iov(iov, iovcnt, (size_t)total_bytes, cut_size, &piece_iov[0]);
+    written_bytes = clam_prov_write_waiting(&piece_iov[0], piece_iovcnt, CLAM_PROV_PIPE_CUT_WAIT_MS);
+    if(written_bytes < 0){
+      written_bytes = 0;
+    }
+    if((size_t)written_bytes < cut_size && clam_prov_thread_crashed == 0){
+      // Then kept to be written before anything else (there is no room to keep it when crashing)
+      clam_prov_pipe_cut = (char*)malloc(cut_size - (size_t)written_bytes);
+      if(clam_prov_pipe_cut != NULL){
+        clam_prov_pipe_cut_size = cut_size - (size_t)written_bytes;
+        piece_iovcnt = clam_prov_slice_iov(iov, iovcnt, (size_t)(total_bytes + written_bytes),
+                                           clam_prov_pipe_cut_size, &piece_iov[0]);
+        piece_size = 0;
+        for(i = 0; i < piece_iovcnt; i++){
+          memcpy(clam_prov_pipe_cut + piece_size, piece_iov[i].iov_base, piece_iov[i].iov_len);
+          piece_size += piece_iov[i].iov_len;
+        }
+      }
+    }
+    total_bytes += (ssize_t)cut_size;
+  }
+  // Only the records that are not written are dropped
+  if((size_t)total_bytes < size){
+    atomic_fetch_add_explicit(&clam_prov_logger_profile_records_dropped,
+                              (size - (size_t)total_bytes) / CLAM_PROV_SIZE_RECORD, memory_order_relaxed);
+  }
+  return (ssize_t)size;
+}
+
+/*
+  Must hold 'clam_prov_lock'. Closes the spill file. At shutdown ('is_final'), it is removed if nothing is left in it,
+  otherwise what is left is moved to its start so that it only has what is not in the pipe.
+*/
+static void clam_prov_close_spill(int is_final){
+  char *dst;
+  off_t offset;
+  ssize_t read_bytes;
+
+  if(clam_prov_spill_fd < 0){
+    return;
+  }
+  if(is_final == 1 && clam_prov_spill_offset > 0 && clam_prov_spill_size > 0){
+    dst = alloc_dst_buffer(CLAM_PROV_PIPE_REPLAY_SIZE);
+    if(dst != NULL){
+      for(offset = clam_prov_spill_offset; offset < clam_prov_spill_size; offset += read_bytes){
+        read_bytes = pread(clam_prov_spill_fd, dst, CLAM_PROV_PIPE_REPLAY_SIZE, offset);
+        if(read_bytes <= 0 ||
+           pwrite(clam_prov_spill_fd, dst, (size_t)read_bytes, offset - clam_prov_spill_offset) != read_bytes){
+          break;
+        }
+      }
+      free_dst_buffer(dst);
+      ftruncate(clam_prov_spill_fd, clam_prov_spill_size - clam_prov_spill_offset);
+    }
+  }
+  close(clam_prov_spill_fd);
+  clam_prov_spill_fd = -1;
+  if(is_final == 1 && clam_prov_spill_size == 0){
+    unlink(&clam_prov_spill_path[0]);
+  }
+  clam_prov_spill_offset = 0;
+  clam_prov_spill_size = 0;
+  clam_prov_spill_cut = 0;
+}
+
+/*
+  Replays the spill file of the pipe output (CLAM_PROV_PIPE_SPILL), or writes the rest of a block cut in the pipe
+  (waiting for the consumer for at most 'wait_ms' milliseconds), when nothing new is written.
+*/
+static void clam_prov_replay_output(int wait_ms){
+  if(clam_prov_logger_output_mode != CLAM_PROV_OUTPUT_PIPE || clam_prov_logger_pipe_policy == CLAM_PROV_PIPE_BLOCK){
+    return;
+  }
+  clam_prov_hold_lock();
+  if((clam_prov_spill_size > 0 || clam_prov_pipe_cut_size > 0) && clam_prov_logger_output_fd > -1){
+    flock(clam_prov_logger_output_fd, LOCK_EX);
+    if(clam_prov_logger_pipe_policy == CLAM_PROV_PIPE_SPILL){
+      clam_prov_replay_spill();
+    }else{
+      clam_prov_finish_pipe_cut(wait_ms);
+    }
+    flock(clam_prov_logger_output_fd, LOCK_UN);
+  }
+  clam_prov_release_lock();
+}
+
+/*
+  Must hold 'clam_prov_lock'. Writes 'iov' to the output. Syncs the output if the durability is
+  CLAM_PROV_DURABILITY_FLUSH.
+  'write_sequence' is set to the sequence number of the write (for syncing later), or '0' if there is nothing to sync.
+
+  Returns the number of bytes written, or -1 on failure
+*/
+static ssize_t clam_prov_write_output(struct iovec *iov, int iovcnt, unsigned long *write_sequence){
+  ssize_t written_bytes;
+
+  *write_sequence = 0;
+  if(clam_prov_logger_output_fd < 0){
+    return -1;
+  }
+
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_SHARED){
+    written_bytes = clam_prov_write_shared(iov, iovcnt);
+  }else if(clam_prov_lock_file(clam_prov_logger_output_fd) == 0){
+    return -1;
+  }else{
+    if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_PIPE &&
+       (clam_prov_logger_pipe_policy != CLAM_PROV_PIPE_BLOCK || clam_prov_thread_crashed == 1)){
+      written_bytes = clam_prov_write_pipe(iov, iovcnt);
+    }else{
+      written_bytes = writev(clam_prov_logger_output_fd, iov, iovcnt);
+    }
+  }
+  if(written_bytes > 0 && (clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_FILE ||
+                           clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_SHARED ||
+                           clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_AGGREGATE)){
+    if(clam_prov_logger_durability == CLAM_PROV_DURABILITY_FLUSH){
+      fdatasync(clam_prov_logger_output_fd);
+    }else if(clam_prov_logger_durability != CLAM_PROV_DURABILITY_NONE){
+      *write_sequence = atomic_fetch_add_explicit(&clam_prov_written_sequence, 1, memory_order_relaxed) + 1;
+    }
+  }
+  if(written_bytes > 0 && clam_prov_logger_rotate_size_mb > 0 &&
+     clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_FILE && clam_prov_thread_crashed == 0){
+    clam_prov_rotate_output(); // Left to the next write in crash mode, as the footer is allocated
+  }
+  if(clam_prov_logger_output_mode != CLAM_PROV_OUTPUT_SHARED){
+    flock(clam_prov_logger_output_fd, LOCK_UN);
+  }
+  if(written_bytes > 0){
+    atomic_fetch_add_explicit(&clam_prov_logger_profile_total_bytes, (unsigned long)written_bytes, memory_order_relaxed);
+  }
+  return written_bytes;
+}
+
+/*
+  Syncs the output if the writes up to 'write_sequence' are not synced yet.
+  A single sync covers all the writes that completed before it started, so concurrent callers share it.
+*/
+static void clam_prov_sync_output(unsigned long write_sequence){
+  unsigned long target_sequence;
+
+  if(write_sequence == 0 || clam_prov_thread_crashed == 1){
+    return;
+  }
+  pthread_mutex_lock(&clam_prov_sync_lock);
+  if(clam_prov_synced_sequence < write_sequence && clam_prov_logger_output_fd > -1){
+    target_sequence = atomic_load_explicit(&clam_prov_written_sequence, memory_order_relaxed);
+    fdatasync(clam_prov_logger_output_fd);
+    clam_prov_synced_sequence = target_sequence;
+  }
+  pthread_mutex_unlock(&clam_prov_sync_lock);
+}
+
+static void clam_prov_sync_output_group(unsigned long write_sequence){
+  if(clam_prov_logger_durability == CLAM_PROV_DURABILITY_GROUP){
+    clam_prov_sync_output(write_sequence);
+  }
+}
+
+static void clam_prov_uring_close(){
+  if(clam_prov_uring_output == NULL){
+    return;
+  }
+  munmap((void*)clam_prov_uring_output->sqes, clam_prov_uring_output->entries * sizeof(struct io_uring_sqe));
+  if(clam_prov_uring_output->cq_ring != clam_prov_uring_output->sq_ring){
+    munmap((void*)clam_prov_uring_output->cq_ring, clam_prov_uring_output->cq_ring_size);
+  }
+  munmap((void*)clam_prov_uring_output->sq_ring, clam_prov_uring_output->sq_ring_size);
+  close(clam_prov_uring_output->fd);
+  free(clam_prov_uring_output);
+  clam_prov_uring_output = NULL;
+}
+
+// Returns the engine, or NULL if io_uring is not available
+static clam_prov_uring* clam_prov_uring_open(){
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+  clam_prov_uring *uring;
+  struct io_uring_params params;
+  size_t sq_size, cq_size;
+  char *sq_ring, *cq_ring;
+
+  uring = (clam_prov_uring *)calloc(1, sizeof(clam_prov_uring));
+  if(uring == NULL){
+    return NULL;
+  }
+  memset((void*)(&params), 0, sizeof(params));
+  uring->fd = (int)syscall(__NR_io_uring_setup, CLAM_PROV_URING_ENTRIES, &params);
+  if(uring->fd < 0){
+    free(uring);
+    return NULL; // Not supported by the kernel, or not allowed
+  }
+
+  sq_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+  cq_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+  }
+  sq_ring = (char *)mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  cq_ring = sq_ring;
+  if(sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)){
+    cq_ring = (char *)mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+  }
+  uring->sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                                            MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if(sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED){
+    if(uring->sqes != MAP_FAILED){
+      munmap((void*)uring->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if(cq_ring != MAP_FAILED && cq_ring != sq_ring){
+      munmap((void*)cq_ring, cq_size);
+    }
+    if(sq_ring != MAP_FAILED){
+      munmap((void*)sq_ring, sq_size);
+    }
+    close(uring->fd);
+    free(uring);
+    return NULL;
+  }
+
+  uring->sq_ring = sq_ring;
+  uring->cq_ring = cq_ring;
+  uring->sq_ring_size = sq_size;
+  uring->cq_ring_size = cq_size;
+  uring->entries = params.sq_entries;
+  uring->sq_head = (unsigned int *)(&sq_ring[params.sq_off.head]);
+  uring->sq_tail = (unsigned int *)(&sq_ring[params.sq_off.tail]);
+  uring->sq_mask = (unsigned int *)(&sq_ring[params.sq_off.ring_mask]);
+  uring->sq_array = (unsigned int *)(&sq_ring[params.sq_off.array]);
+  uring->cq_head = (unsigned int *)(&cq_ring[params.cq_off.head]);
+  uring->cq_tail = (unsigned int *)(&cq_ring[params.cq_off.tail]);
+  uring->cq_mask = (unsigned int *)(&cq_ring[params.cq_off.ring_mask]);
+  uring->cqes = (struct io_uring_cqe *)(&cq_ring[params.cq_off.cqes]);
+  uring->sq_local_tail = *uring->sq_tail;
+  return uring;
+#else
+  return NULL;
+#endif
+}
+
+/*
+  Must hold 'clam_prov_lock'. Submits the entries that are not submitted yet, and waits for 'min_complete' completions.
+
+  Returns 0 on failure, and 1 on success
+*/
+static int clam_prov_uring_enter(unsigned int min_complete){
+  unsigned int to_submit;
+  long result;
+
+  atomic_store_explicit((atomic_uint *)clam_prov_uring_output->sq_tail, clam_prov_uring_output->sq_local_tail,
+                        memory_order_release);
+  to_submit = clam_prov_uring_output->sq_local_tail -
+    atomic_load_explicit((atomic_uint *)clam_prov_uring_output->sq_head, memory_order_acquire);
+  if(to_submit == 0 && min_complete == 0){
+    return 1;
+  }
+  do{
+    result = syscall(__NR_io_uring_enter, clam_prov_uring_output->fd, to_submit, min_complete,
+                     min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  }while(result < 0 && errno == EINTR);
+  return result < 0 ? 0 : 1;
+}
+
+/*
+  Must hold 'clam_prov_lock'. The part of a write that the engine didn't do (all of it if it failed, e.g. canceled
+  because it couldn't start a worker thread, or the rest of a short write) is done with a blocking write. Nothing else
+  was submitted after it, so the block stays whole and in order.
+*/
+static void clam_prov_uring_complete(clam_prov_uring_write *write, int result){
+  struct iovec remaining_iov[2];
+  size_t written_bytes;
+  int i, remaining_iovcnt;
+  unsigned long write_sequence;
+
+  written_bytes = result > 0 ? (size_t)result : 0;
+  if(written_bytes > 0){
+    atomic_fetch_add_explicit(&clam_prov_logger_profile_total_bytes, (unsigned long)written_bytes, memory_order_relaxed);
+  }
+  if(written_bytes == write->size){
+    if(clam_prov_logger_durability == CLAM_PROV_DURABILITY_PERIODIC){
+      atomic_fetch_add_explicit(&clam_prov_written_sequence, 1, memory_order_relaxed); // For the periodic sync
+    }
+    free_dst_buffer(write->dst);
+    free(write);
+    return;
+  }
+
+  remaining_iovcnt = 0;
+  for(i = 0; i < write->iovcnt; i++){
+    if(written_bytes >= write->iov[i].iov_len){
+      written_bytes -= write->iov[i].iov_len;
+      continue;
+    }
+    remaining_iov[remaining_iovcnt].iov_base = (void*)((char *)write->iov[i].iov_base + written_bytes);
+    remaining_iov[remaining_iovcnt++].iov_len = write->iov[i].iov_len - written_bytes;
+    written_bytes = 0;
+  }
+  written_bytes = 0;
+  for(i = 0; i < remaining_iovcnt; i++){
+    written_bytes += remaining_iov[i].iov_len;
+  }
+  if(clam_prov_write_output(&remaining_iov[0], remaining_iovcnt, &write_sequence) == (ssize_t)written_bytes){
+    clam_prov_sync_output_group(write_sequence);
+  }else{
+    for(i = 0; i < write->total_new_functions; i++){
+      clam_prov_function_written[write->new_function_ids[i]] = 0; // Write them again with the next block
+    }
+  }
+  free_dst_buffer(write->dst);
+  free(write);
+}
+
+/*
+  Must hold 'clam_prov_lock'. Reaps the completions. Waits until at most 'max_in_flight' entries are in flight.
+*/
+static void clam_prov_uring_reap(unsigned int max_in_flight){
+  clam_prov_uring *uring;
+  struct io_uring_cqe *cqe;
+  unsigned int head, tail;
+
+  uring = clam_prov_uring_output;
+  while(1){
+    head = *uring->cq_head;
+    tail = atomic_load_explicit((atomic_uint *)uring->cq_tail, memory_order_acquire);
+    for(; head != tail; head++){
+      cqe = &uring->cqes[head & *uring->cq_mask];
+      if(cqe->user_data != 0){ // Syncs have no user data
+        clam_prov_uring_complete((clam_prov_uring_write *)(unsigned long)cqe->user_data, cqe->res);
+      }
+      uring->in_flight--;
+    }
+    atomic_store_explicit((atomic_uint *)uring->cq_head, head, memory_order_release);
+    if(uring->in_flight <= max_in_flight){
+      return;
+    }
+    if(clam_prov_uring_enter(1) == 0){
+      return;
+    }
+  }
+}
+
+/*
+  Must hold 'clam_prov_lock'. Submits a write of 'iov' to the output (linked to a sync if the durability asks for one).
+  The engine owns 'dst' from then on.
+
+  Returns 0 if the write needs to be done without the engine, and 1 if it was submitted
+*/
+static int clam_prov_uring_submit(struct iovec *iov, int iovcnt, char *dst, int *new_function_ids,
+                                  int total_new_functions){
+  clam_prov_uring *uring;
+  clam_prov_uring_write *write;
+  struct io_uring_sqe *sqe;
+  unsigned int total_entries, index;
+  int i, is_synced;
+
+  uring = clam_prov_uring_output;
+  if(uring == NULL || clam_prov_logger_output_fd < 0 || clam_prov_thread_crashed == 1){
+    return 0;
+  }
+  // The previous write lands first, whether this one goes through the engine or not
+  clam_prov_uring_reap(0);
+  write = (clam_prov_uring_write *)malloc(sizeof(clam_prov_uring_write));
+  if(write == NULL){
+    return 0;
+  }
+  write->dst = dst;
+  write->iovcnt = iovcnt;
+  write->size = 0;
+  for(i = 0; i < iovcnt; i++){
+    write->iov[i] = iov[i];
+    write->size += iov[i].iov_len;
+  }
+  write->new_function_ids = new_function_ids;
+  write->total_new_functions = total_new_functions;
+
+  is_synced = clam_prov_logger_durability == CLAM_PROV_DURABILITY_FLUSH ||
+    clam_prov_logger_durability == CLAM_PROV_DURABILITY_GROUP;
+  total_entries = is_synced ? 2 : 1;
+  if(uring->in_flight > 0){
+    free(write);
+    return 0; // The engine failed to wait for the previous write
+  }
+
+  index = uring->sq_local_tail & *uring->sq_mask;
+  sqe = &uring->sqes[index];
+  memset((void*)sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = clam_prov_logger_output_fd;
+  sqe->off = 0; // Appended because of O_APPEND
+  sqe->addr = (unsigned long)(&write->iov[0]);
+  sqe->len = (unsigned int)iovcnt;
+  sqe->user_data = (unsigned long)write;
+  if(is_synced){
+    sqe->flags = IOSQE_IO_LINK; // Sync only if the write succeeds
+  }
+  uring->sq_array[index] = index;
+  uring->sq_local_tail++;
+
+  if(is_synced){
+    index = uring->sq_local_tail & *uring->sq_mask;
+    sqe = &uring->sqes[index];
+    memset((void*)sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = clam_prov_logger_output_fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    uring->sq_array[index] = index;
+    uring->sq_local_tail++;
+  }
+  uring->in_flight += total_entries;
+
+  // On failure, the entries are submitted with the next call
+  clam_prov_uring_enter(0);
+  return 1;
+}
+
+// Waits for all the writes submitted to the engine, and closes it
+static void clam_prov_uring_drain(){
+  clam_prov_hold_lock();
+  if(clam_prov_uring_output != NULL){
+    clam_prov_uring_reap(0);
+    clam_prov_uring_close();
+  }
+  clam_prov_release_lock();
+}
+
+static int clam_prov_write_records_v1(clam_prov_record *records, int total_records){
+  int dst_buffer_size;
+  char *dst;
+  struct iovec iov;
+  ssize_t written_bytes;
+  unsigned long write_sequence;
+
+  dst_buffer_size = get_dst_buffer_size(total_records);
+  dst = alloc_dst_buffer(dst_buffer_size);
+  if(dst == NULL){
+    return 0;
+  }
+  copy_records_to_dst_buffer(dst, records, total_records);
+
+  iov.iov_base = (void*)dst;
+  iov.iov_len = dst_buffer_size;
+  if(clam_prov_lock_output() == 0){
+    free_dst_buffer(dst);
+    return 0;
+  }
+  if(clam_prov_uring_submit(&iov, 1, dst, NULL, 0) == 1){
+    clam_prov_release_lock();
+    return 1;
+  }
+  written_bytes = clam_prov_write_output(&iov, 1, &write_sequence);
+  clam_prov_release_lock();
+  clam_prov_sync_output_group(write_sequence);
+  free_dst_buffer(dst);
+
+  if(dst_buffer_size != written_bytes){
+    return 0; // The records are lost. The caller counts them as dropped (see 'clam_prov_profile_flush')
+  }
+  return 1;
+}
+
+static char* clam_prov_put_u32(char *dst, unsigned int value){
+  dst[0] = (char)(value & 0xFF);
+  dst[1] = (char)((value >> 8) & 0xFF);
+  dst[2] = (char)((value >> 16) & 0xFF);
+  dst[3] = (char)((value >> 24) & 0xFF);
+  return &dst[4];
+}
+
+static char* clam_prov_put_varint(char *dst, unsigned long value){
+  while(value >= 0x80){
+    *dst++ = (char)((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  *dst++ = (char)value;
+  return dst;
+}
+
+static char* clam_prov_put_zigzag(char *dst, long value){
+  return clam_prov_put_varint(dst, ((unsigned long)value << 1) ^ (unsigned long)(value >> 63));
+}
+
+static char* clam_prov_put_block_header(char *dst, int version, unsigned int payload_size){
+  dst = clam_prov_put_u32(dst, CLAM_PROV_LOG_MAGIC);
+  *dst++ = (char)version;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  *dst = version == CLAM_PROV_LOG_FORMAT_V3 || version == CLAM_PROV_BLOCK_SHARED ? CLAM_PROV_BLOCK_FLAG_BIG_ENDIAN : 0;
+#else
+  *dst = 0;
+#endif
+  if(version == CLAM_PROV_LOG_FORMAT_V2 && clam_prov_logger_sampling != CLAM_PROV_SAMPLING_NONE){
+    *dst |= CLAM_PROV_BLOCK_FLAG_WEIGHTS;
+  }
+  if((version == CLAM_PROV_LOG_FORMAT_V2 || version == CLAM_PROV_LOG_FORMAT_V3) &&
+     clam_prov_logger_clock != CLAM_PROV_CLOCK_REALTIME){
+    *dst |= CLAM_PROV_BLOCK_FLAG_NANOS;
+  }
+  if(version == CLAM_PROV_LOG_FORMAT_V3){
+    *dst |= CLAM_PROV_BLOCK_FLAG_SIZES; // Part of the layout of the records
+  }
+  dst++; // flags
+  *dst++ = 0; // reserved
+  *dst++ = 0;
+  dst = clam_prov_put_u32(dst, (unsigned int)getpid());
+  dst = clam_prov_put_u32(dst, payload_size);
+  return dst;
+}
+
+// Returns 1 if a record has a size, so that the v2 block has CLAM_PROV_BLOCK_FLAG_SIZES
+static int clam_prov_records_have_sizes(clam_prov_record *records, int total_records){
+  int current_record_index;
+
+  for(current_record_index = 0; current_record_index < total_records; current_record_index++){
+    if(records[current_record_index].size != -1){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static char* copy_records_to_dst_buffer_v2(char *dst, clam_prov_record *records, int total_records, int has_sizes){
+  clam_prov_record previous;
+  int current_record_index;
+
+  memset((void*)(&previous), 0, sizeof(clam_prov_record));
+  dst = clam_prov_put_varint(dst, (unsigned long)total_records);
+  for(current_record_index = 0; current_record_index < total_records; current_record_index++){
+    clam_prov_record *record = &records[current_record_index];
+    dst = clam_prov_put_zigzag(dst, (long)(record->time - previous.time));
+    dst = clam_prov_put_zigzag(dst, (long)record->pid - (long)previous.pid);
+    dst = clam_prov_put_zigzag(dst, record->call_site_id - previous.call_site_id);
+    dst = clam_prov_put_zigzag(dst, record->exit);
+    dst = clam_prov_put_varint(dst, (unsigned long)record->function_id);
+    if(clam_prov_logger_sampling != CLAM_PROV_SAMPLING_NONE){
+      dst = clam_prov_put_varint(dst, record->weight);
+    }
+    if(has_sizes){
+      dst = clam_prov_put_zigzag(dst, record->size);
+    }
+    previous = *record;
+  }
+  return dst;
+}
+
+// Must hold 'clam_prov_lock'. Adds the entries of the functions in the records that are not in the output yet.
+static char* copy_functions_to_dst_buffer_v2(char *dst, clam_prov_record *records, int total_records,
+                                             int *new_function_ids, int *total_new_functions){
+  int current_record_index;
+  int function_id;
+  int name_length;
+  int i;
+
+  *total_new_functions = 0;
+  for(current_record_index = 0; current_record_index < total_records; current_record_index++){
+    function_id = records[current_record_index].function_id;
+    if(clam_prov_function_written[function_id] == 0){
+      clam_prov_function_written[function_id] = 1;
+      new_function_ids[(*total_new_functions)++] = function_id;
+    }
+  }
+
+  dst = clam_prov_put_varint(dst, (unsigned long)(*total_new_functions));
+  for(i = 0; i < *total_new_functions; i++){
+    function_id = new_function_ids[i];
+    name_length = strnlen(&clam_prov_function_names[function_id][0], CLAM_PROV_FUNCTION_NAME_LENGTH);
+    dst = clam_prov_put_varint(dst, (unsigned long)function_id);
+    dst = clam_prov_put_varint(dst, (unsigned long)name_length);
+    memcpy((void*)dst, (void*)(&clam_prov_function_names[function_id][0]), name_length);
+    dst += name_length;
+  }
+  return dst;
+}
+
+static int clam_prov_write_records_v2(clam_prov_record *records, int total_records){
+  int total_functions;
+  int functions_size, records_size;
+  char *dst, *functions_dst, *records_dst;
+  int *new_function_ids;
+  int total_new_functions;
+  struct iovec iov[2];
+  ssize_t written_bytes;
+  unsigned long write_sequence;
+  int has_sizes;
+  int i;
+
+  total_functions = atomic_load_explicit(&clam_prov_function_count, memory_order_relaxed);
+  functions_size = CLAM_PROV_SIZE_BLOCK_HEADER + CLAM_PROV_SIZE_VARINT + (total_functions * CLAM_PROV_SIZE_FUNCTION_V2);
+  records_size = CLAM_PROV_SIZE_VARINT + (total_records * CLAM_PROV_SIZE_RECORD_V2);
+  dst = alloc_dst_buffer(functions_size + records_size + (total_functions * sizeof(int)));
+  if(dst == NULL){
+    return 0;
+  }
+  // The ids first, as the sizes of the encoded parts are not multiples of the size of an 'int'
+  new_function_ids = (int *)dst;
+  functions_dst = dst + (total_functions * sizeof(int));
+  records_dst = functions_dst + functions_size;
+
+  // Records are encoded outside of the lock
+  iov[1].iov_base = (void*)records_dst;
+  has_sizes = clam_prov_records_have_sizes(records, total_records);
+  iov[1].iov_len = copy_records_to_dst_buffer_v2(records_dst, records, total_records, has_sizes) - records_dst;
+
+  written_bytes = -1;
+  write_sequence = 0;
+  if(clam_prov_lock_output() == 0){
+    free_dst_buffer(dst);
+    return 0;
+  }
+  if(clam_prov_logger_output_fd > -1){
+    char *functions_end;
+    functions_end = copy_functions_to_dst_buffer_v2(functions_dst + CLAM_PROV_SIZE_BLOCK_HEADER, records, total_records,
+                                                    new_function_ids, &total_new_functions);
+    iov[0].iov_base = (void*)functions_dst;
+    iov[0].iov_len = functions_end - functions_dst;
+    clam_prov_put_block_header(functions_dst, CLAM_PROV_LOG_FORMAT_V2, (unsigned int)(iov[0].iov_len - CLAM_PROV_SIZE_BLOCK_HEADER + iov[1].iov_len));
+    if(has_sizes){
+      functions_dst[5] |= CLAM_PROV_BLOCK_FLAG_SIZES; // flags
+    }
+
+    if(clam_prov_uring_submit(iov, 2, dst, new_function_ids, total_new_functions) == 1){
+      clam_prov_release_lock();
+      return 1;
+    }
+    written_bytes = clam_prov_write_output(iov, 2, &write_sequence);
+
+    if(written_bytes != (ssize_t)(iov[0].iov_len + iov[1].iov_len)){
+      for(i = 0; i < total_new_functions; i++){
+        clam_prov_function_written[new_function_ids[i]] = 0; // Write them again with the next block
+      }
+    }
+  }
+  clam_prov_release_lock();
+  clam_prov_sync_output_group(write_sequence);
+  free_dst_buffer(dst);
+
+  if(written_bytes < 0 || written_bytes != (ssize_t)(iov[0].iov_len + iov[1].iov_len)){
+    return 0; // The records are lost. The caller counts them as dropped (see 'clam_prov_profile_flush')
+  }
+  return 1;
+}
+
+/*
+  Writes the records as they are in memory, preceded by a v2 block (without records) with the function names that are
+  not in the output yet. Nothing is allocated or copied, except for the io_uring engine, which writes after the records
+  are reused.
+*/
+static int clam_prov_write_records_v3(clam_prov_record *records, int total_records){
+  char header[CLAM_PROV_SIZE_BLOCK_HEADER];
+  char *functions_end, *dst;
+  struct iovec iov[3];
+  int iovcnt, total_new_functions;
+  ssize_t written_bytes, total_bytes;
+  unsigned long write_sequence;
+  int i;
+
+  clam_prov_put_block_header(&header[0], CLAM_PROV_LOG_FORMAT_V3, (unsigned int)(total_records * sizeof(clam_prov_record)));
+
+  written_bytes = -1;
+  total_bytes = 0;
+  write_sequence = 0;
+  if(clam_prov_lock_output() == 0){
+    return 0;
+  }
+  if(clam_prov_logger_output_fd > -1){
+    iovcnt = 0;
+    functions_end = copy_functions_to_dst_buffer_v2(&clam_prov_functions_block[CLAM_PROV_SIZE_BLOCK_HEADER], records,
+                                                    total_records, &clam_prov_new_function_ids[0], &total_new_functions);
+    if(total_new_functions > 0){
+      functions_end = clam_prov_put_varint(functions_end, 0); // Number of records
+      clam_prov_put_block_header(&clam_prov_functions_block[0], CLAM_PROV_LOG_FORMAT_V2,
+                                 (unsigned int)(functions_end - &clam_prov_functions_block[CLAM_PROV_SIZE_BLOCK_HEADER]));
+      iov[iovcnt].iov_base = (void*)(&clam_prov_functions_block[0]);
+      iov[iovcnt++].iov_len = functions_end - &clam_prov_functions_block[0];
+    }
+    iov[iovcnt].iov_base = (void*)(&header[0]);
+    iov[iovcnt++].iov_len = CLAM_PROV_SIZE_BLOCK_HEADER;
+    iov[iovcnt].iov_base = (void*)records;
+    iov[iovcnt++].iov_len = total_records * sizeof(clam_prov_record);
+    for(i = 0; i < iovcnt; i++){
+      total_bytes += iov[i].iov_len;
+    }
+
+    if(clam_prov_uring_output != NULL){
+      dst = alloc_dst_buffer(total_bytes + (total_new_functions * sizeof(int)));
+      if(dst != NULL){
+        struct iovec copy;
+        // The ids first, so that they are aligned
+        memcpy((void*)dst, (void*)(&clam_prov_new_function_ids[0]), total_new_functions * sizeof(int));
+        copy.iov_base = (void*)(&dst[total_new_functions * sizeof(int)]);
+        copy.iov_len = 0;
+        for(i = 0; i < iovcnt; i++){
+          memcpy((void*)((char*)copy.iov_base + copy.iov_len), iov[i].iov_base, iov[i].iov_len);
+          copy.iov_len += iov[i].iov_len;
+        }
+        if(clam_prov_uring_submit(&copy, 1, dst, (int *)dst, total_new_functions) == 1){
+          clam_prov_release_lock();
+          return 1;
+        }
+        free_dst_buffer(dst);
+      }
+    }
+    written_bytes = clam_prov_write_output(iov, iovcnt, &write_sequence);
+
+    if(written_bytes != total_bytes){
+      for(i = 0; i < total_new_functions; i++){
+        clam_prov_function_written[clam_prov_new_function_ids[i]] = 0; // Write them again with the next block
+      }
+    }
+  }
+  clam_prov_release_lock();
+  clam_prov_sync_output_group(write_sequence);
+
+  if(written_bytes < 0 || written_bytes != total_bytes){
+    return 0; // The records are lost. The caller counts them as dropped (see 'clam_prov_profile_flush')
+  }
+  return 1;
+}
+
+static int clam_prov_write_records(clam_prov_record *records, int total_records){
+  int current_record_index, result;
+
+  if(clam_prov_thread_crashed == 1 && total_records > CLAM_PROV_CRASH_RECORDS){
+    // In pieces that fit in the crash buffer
+    result = 1;
+    for(current_record_index = 0; current_record_index < total_records; current_record_index += CLAM_PROV_CRASH_RECORDS){
+      if(clam_prov_write_records(&records[current_record_index],
+                                 total_records - current_record_index < CLAM_PROV_CRASH_RECORDS ?
+                                 total_records - current_record_index : CLAM_PROV_CRASH_RECORDS) == 0){
+        result = 0;
+      }
+    }
+    return result;
+  }
+  if(clam_prov_logger_clock != CLAM_PROV_CLOCK_REALTIME){
+    clam_prov_clock_convert(records, total_records, clam_prov_logger_log_format != CLAM_PROV_LOG_FORMAT_V1);
+  }
+  switch(clam_prov_logger_log_format){
+    case CLAM_PROV_LOG_FORMAT_V1: return clam_prov_write_records_v1(records, total_records);
+    case CLAM_PROV_LOG_FORMAT_V2: return clam_prov_write_records_v2(records, total_records);
+    case CLAM_PROV_LOG_FORMAT_V3: return clam_prov_write_records_v3(records, total_records);
+    default: return 0;
+  }
+}
+
+static unsigned int clam_prov_get_u32(char *src){
+  unsigned char *bytes = (unsigned char *)src;
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+}
+
+// Returns NULL if the varint runs past 'end'
+static char* clam_prov_get_varint(char *src, char *end, unsigned long *value){
+  unsigned char byte;
+  int shift;
+
+  *value = 0;
+  for(shift = 0; src < end && shift < 64; shift += 7){
+    byte = (unsigned char)(*src++);
+    *value |= ((unsigned long)(byte & 0x7F)) << shift;
+    if((byte & 0x80) == 0){
+      return src;
+    }
+  }
+  return NULL;
+}
+
+static char* clam_prov_get_zigzag(char *src, char *end, long *value){
+  unsigned long encoded;
+
+  src = clam_prov_get_varint(src, end, &encoded);
+  *value = (long)(encoded >> 1) ^ -(long)(encoded & 1);
+  return src;
+}
+
+/*
+  Must hold 'clam_prov_lock'. Takes 'flock' of the file output (released by 'clam_prov_write_output'), and opens the
+  path again if the file is not the active segment anymore (rotated by another process).
+*/
+static void clam_prov_lock_segment(){
+  struct stat fd_stat, path_stat;
+  char *path;
+  int fd;
+
+  if(clam_prov_logger_output_fd < 0){
+    return;
+  }
+  path = &clam_prov_logger_output_path[0];
+  if(clam_prov_lock_file(clam_prov_logger_output_fd) == 0){
+    return; // Then the write fails too (crash mode)
+  }
+  while(fstat(clam_prov_logger_output_fd, &fd_stat) == 0 &&
+        (stat(path, &path_stat) != 0 || path_stat.st_ino != fd_stat.st_ino || path_stat.st_dev != fd_stat.st_dev)){
+    fd = open(path, O_WRONLY|O_APPEND|O_CREAT, CLAM_PROV_PATH_PERMISSIONS);
+    if(fd < 0){
+      return; // Appends to the rotated segment
+    }
+    if(clam_prov_lock_file(fd) == 0 || clam_prov_lock_mutex(&clam_prov_sync_lock) == 0){
+      close(fd);
+      return; // Appends to the rotated segment (crash mode)
+    }
+    flock(clam_prov_logger_output_fd, LOCK_UN);
+    close(clam_prov_logger_output_fd);
+    clam_prov_logger_output_fd = fd;
+    pthread_mutex_unlock(&clam_prov_sync_lock);
+    // The segment has none of the function names
+    memset((void*)(&clam_prov_function_written[0]), 0, CLAM_PROV_MAX_FUNCTIONS);
+  }
+}
+
+static void clam_prov_footer_add(clam_prov_footer *footer, unsigned long time, long call_site_id){
+  long *other_call_sites;
+
+  if(footer->records == 0 || time < footer->start_time){
+    footer->start_time = time;
+  }
+  if(footer->records == 0 || time > footer->end_time){
+    footer->end_time = time;
+  }
+  footer->records++;
+  if(call_site_id >= 0 && call_site_id < CLAM_PROV_MAX_CALL_SITES){
+    footer->call_sites[call_site_id >> 3] |= (unsigned char)(1 << (call_site_id & 7));
+    return;
+  }
+  if(footer->total_other_call_sites == footer->max_other_call_sites){
+    other_call_sites = (long *)realloc(footer->other_call_sites,
+                                       (2 * footer->max_other_call_sites + 16) * sizeof(long));
+    if(other_call_sites == NULL){
+      return;
+    }
+    footer->other_call_sites = other_call_sites;
+    footer->max_other_call_sites = 2 * footer->max_other_call_sites + 16;
+  }
+  footer->other_call_sites[footer->total_other_call_sites++] = call_site_id;
+}
+
+// Adds the records of a v2 block
+static void clam_prov_footer_add_v2(clam_prov_footer *footer, int flags, char *src, char *end){
+  unsigned long total_functions, total_records, name_length, value, i;
+  long time, tid, call_site_id, delta;
+
+  src = clam_prov_get_varint(src, end, &total_functions);
+  for(i = 0; src != NULL && i < total_functions; i++){
+    src = clam_prov_get_varint(src, end, &value);
+    if(src != NULL){
+      src = clam_prov_get_varint(src, end, &name_length);
+    }
+    if(src == NULL || name_length > (unsigned long)(end - src)){
+      return;
+    }
+    src += name_length;
+  }
+  if(src != NULL){
+    src = clam_prov_get_varint(src, end, &total_records);
+  }
+  time = tid = call_site_id = 0;
+  for(i = 0; src != NULL && i < total_records; i++){
+    src = clam_prov_get_zigzag(src, end, &delta);
+    time += delta;
+    if(src != NULL) src = clam_prov_get_zigzag(src, end, &delta);
+    tid += delta;
+    if(src != NULL) src = clam_prov_get_zigzag(src, end, &delta);
+    call_site_id += delta;
+    if(src != NULL) src = clam_prov_get_zigzag(src, end, &delta); // Return value
+    if(src != NULL) src = clam_prov_get_varint(src, end, &value); // Function id
+    if(src != NULL && (flags & CLAM_PROV_BLOCK_FLAG_WEIGHTS) != 0) src = clam_prov_get_varint(src, end, &value);
+    if(src != NULL && (flags & CLAM_PROV_BLOCK_FLAG_SIZES) != 0) src = clam_prov_get_zigzag(src, end, &delta);
+    if(src != NULL){
+      clam_prov_footer_add(footer, (flags & CLAM_PROV_BLOCK_FLAG_NANOS) != 0 ? (unsigned long)time / (1000 * 1000) :
+                                   (unsigned long)time, call_site_id);
+    }
+  }
+}
+
+// Adds the records of a v3 block. The time and the call-site id are at the same offsets with and without the size
+static void clam_prov_footer_add_v3(clam_prov_footer *footer, int flags, char *src, size_t size){
+  clam_prov_record record;
+  size_t offset, record_size;
+  int is_swapped;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  is_swapped = (flags & CLAM_PROV_BLOCK_FLAG_BIG_ENDIAN) == 0;
+#else
+  is_swapped = (flags & CLAM_PROV_BLOCK_FLAG_BIG_ENDIAN) != 0;
+#endif
+  record_size = (flags & CLAM_PROV_BLOCK_FLAG_SIZES) != 0 ? sizeof(clam_prov_record) : offsetof(clam_prov_record, size);
+  for(offset = 0; offset + record_size <= size; offset += record_size){
+    memcpy((void*)(&record), (void*)(&src[offset]), record_size);
+    if(is_swapped){
+      record.time = __builtin_bswap64(record.time);
+      record.call_site_id = (long)__builtin_bswap64((unsigned long)record.call_site_id);
+    }
+    if(record.time != 0){
+      clam_prov_footer_add(footer, (flags & CLAM_PROV_BLOCK_FLAG_NANOS) != 0 ? record.time / (1000 * 1000) : record.time,
+                           record.call_site_id);
+    }
+  }
+}
+
+static int clam_prov_compare_call_sites(const void *a, const void *b){
+  long x = *(const long *)a, y = *(const long *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+  Encodes the footer of 'footer' in 'dst'.
+
+  Returns the size of the footer, or '0' if 'dst' is too small
+*/
+static size_t clam_prov_encode_footer(clam_prov_footer *footer, char *dst, size_t dst_size){
+  long previous, call_site_id;
+  unsigned long total_call_sites;
+  char *payload, *end;
+  int i, j, k;
+
+  // Ids out of range are merged in order: the negative ones before the bit set, and the others after it
+  qsort(footer->other_call_sites, footer->total_other_call_sites, sizeof(long), &clam_prov_compare_call_sites);
+  for(i = 0, j = 0; i < footer->total_other_call_sites; i++){
+    if(j == 0 || footer->other_call_sites[j - 1] != footer->other_call_sites[i]){
+      footer->other_call_sites[j++] = footer->other_call_sites[i];
+    }
+  }
+  footer->total_other_call_sites = j;
+  total_call_sites = (unsigned long)footer->total_other_call_sites;
+  for(i = 0; i < CLAM_PROV_MAX_CALL_SITES / 8; i++){
+    total_call_sites += (unsigned long)__builtin_popcount(footer->call_sites[i]);
+  }
+  if(dst_size < CLAM_PROV_SIZE_BLOCK_HEADER + ((4 + total_call_sites) * CLAM_PROV_SIZE_VARINT) + 4){
+    return 0;
+  }
+
+  payload = &dst[CLAM_PROV_SIZE_BLOCK_HEADER];
+  end = clam_prov_put_varint(payload, footer->records);
+  end = clam_prov_put_varint(end, footer->start_time);
+  end = clam_prov_put_varint(end, footer->end_time);
+  end = clam_prov_put_varint(end, total_call_sites);
+  previous = 0;
+  for(j = 0; j < footer->total_other_call_sites && footer->other_call_sites[j] < 0; j++){
+    end = clam_prov_put_zigzag(end, footer->other_call_sites[j] - previous);
+    previous = footer->other_call_sites[j];
+  }
+  for(i = 0; i < CLAM_PROV_MAX_CALL_SITES / 8; i++){
+    for(k = 0; footer->call_sites[i] != 0 && k < 8; k++){
+      if((footer->call_sites[i] & (1 << k)) != 0){
+        call_site_id = (long)((i << 3) + k);
+        end = clam_prov_put_zigzag(end, call_site_id - previous);
+        previous = call_site_id;
+      }
+    }
+  }
+  for(; j < footer->total_other_call_sites; j++){
+    end = clam_prov_put_zigzag(end, footer->other_call_sites[j] - previous);
+    previous = footer->other_call_sites[j];
+  }
+  end = clam_prov_put_u32(end, (unsigned int)(end + 4 - dst));
+  clam_prov_put_block_header(dst, CLAM_PROV_BLOCK_FOOTER, (unsigned int)(end - payload));
+  return (size_t)(end - dst);
+}
+
+/*
+  Must hold 'clam_prov_lock' and 'flock' of the file output. Appends the footer of the active segment, of 'size'
+  bytes, after reading back its records.
+
+  Returns 1 on success, and 0 on failure
+*/
+static int clam_prov_write_footer(off_t size){
+  clam_prov_footer *footer;
+  clam_prov_record record;
+  char *mapping, *dst, *header;
+  size_t dst_size, footer_size;
+  unsigned int payload_size;
+  off_t offset;
+  int fd, is_written;
+
+  fd = open(&clam_prov_logger_output_path[0], O_RDONLY);
+  if(fd < 0){
+    return 0;
+  }
+  mapping = (char *)mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED){
+    return 0;
+  }
+  footer = (clam_prov_footer *)calloc(1, sizeof(clam_prov_footer));
+  if(footer == NULL){
+    munmap((void*)mapping, (size_t)size);
+    return 0;
+  }
+
+  // v1 records have no header, and are at least as big as a block header (as in the reader)
+  offset = 0;
+  while(offset + CLAM_PROV_SIZE_BLOCK_HEADER <= size){
+    header = &mapping[offset];
+    if(clam_prov_get_u32(&header[0]) != CLAM_PROV_LOG_MAGIC){
+      if(offset + (off_t)CLAM_PROV_SIZE_RECORD > size){
+        break;
+      }
+      memcpy((void*)(&record.time), (void*)header, CLAM_PROV_SIZE_UNSIGNED_LONG);
+      memcpy((void*)(&record.call_site_id), (void*)(&header[CLAM_PROV_SIZE_UNSIGNED_LONG + CLAM_PROV_SIZE_INT]),
+             CLAM_PROV_SIZE_LONG);
+      clam_prov_footer_add(footer, record.time, record.call_site_id);
+      offset += CLAM_PROV_SIZE_RECORD;
+      continue;
+    }
+    payload_size = clam_prov_get_u32(&header[12]);
+    if((off_t)payload_size > size - offset - CLAM_PROV_SIZE_BLOCK_HEADER){
+      break;
+    }
+    if((unsigned char)header[4] == CLAM_PROV_LOG_FORMAT_V2){
+      clam_prov_footer_add_v2(footer, (unsigned char)header[5], &header[CLAM_PROV_SIZE_BLOCK_HEADER],
+                              &header[CLAM_PROV_SIZE_BLOCK_HEADER + payload_size]);
+    }else if((unsigned char)header[4] == CLAM_PROV_LOG_FORMAT_V3){
+      clam_prov_footer_add_v3(footer, (unsigned char)header[5], &header[CLAM_PROV_SIZE_BLOCK_HEADER], payload_size);
+    }
+    offset += CLAM_PROV_SIZE_BLOCK_HEADER + payload_size;
+  }
+  munmap((void*)mapping, (size_t)size);
+
+  is_written = 0;
+  dst_size = CLAM_PROV_SIZE_BLOCK_HEADER + (4 * CLAM_PROV_SIZE_VARINT) + 4 +
+    ((CLAM_PROV_MAX_CALL_SITES + (size_t)footer->total_other_call_sites) * CLAM_PROV_SIZE_VARINT);
+  dst = alloc_dst_buffer((int)dst_size);
+  if(dst != NULL){
+    footer_size = clam_prov_encode_footer(footer, dst, dst_size);
+    is_written = footer_size > 0 && write(clam_prov_logger_output_fd, dst, footer_size) == (ssize_t)footer_size;
+    free_dst_buffer(dst);
+  }
+  free(footer->other_call_sites);
+  free(footer);
+  return is_written;
+}
+
+/*
+  Must hold 'clam_prov_lock' and 'flock' of the file output. Rotates the active segment if it reached the rotate size:
+  appends its footer, and renames it to the next free '<path>.<n>'. The next write opens the next active segment.
+*/
+static void clam_prov_rotate_output(){
+  char segment_path[CLAM_PROV_PATH_LENGTH];
+  char *path, *name, *digit;
+  struct stat fd_stat;
+  struct dirent *entry;
+  unsigned long n, max_n;
+  size_t path_length, name_length;
+  DIR *dir;
+  int is_number;
+
+  if(fstat(clam_prov_logger_output_fd, &fd_stat) != 0 ||
+     fd_stat.st_size < (off_t)clam_prov_logger_rotate_size_mb * 1024 * 1024){
+    return;
+  }
+
+  // The next free 'n' after all the segments of the path
+  path = &clam_prov_logger_output_path[0];
+  name = strrchr(path, '/') + 1;
+  name_length = strlen(name);
+  path_length = (size_t)(name - path);
+  memcpy((void*)(&segment_path[0]), (void*)path, path_length);
+  segment_path[path_length] = '\0';
+  dir = opendir(&segment_path[0]);
+  if(dir == NULL){
+    return;
+  }
+  max_n = 0;
+  while((entry = readdir(dir)) != NULL){
+    if(strncmp(entry->d_name, name, name_length) != 0 || entry->d_name[name_length] != '.'){
+      continue;
+    }
+    is_number = entry->d_name[name_length + 1] != '\0';
+    n = 0;
+    for(digit = &entry->d_name[name_length + 1]; is_number && *digit != '\0'; digit++){
+      is_number = *digit >= '0' && *digit <= '9';
+      n = (n * 10) + (unsigned long)(*digit - '0');
+    }
+    if(is_number && n > max_n){
+      max_n = n;
+    }
+  }
+  closedir(dir);
+  if(snprintf(&segment_path[0], CLAM_PROV_PATH_LENGTH, "%s.%lu", path, max_n + 1) >= CLAM_PROV_PATH_LENGTH){
+    return;
+  }
+
+  if(clam_prov_write_footer(fd_stat.st_size) == 0){
+    return; // Tried again by the next write
+  }
+  if(clam_prov_logger_durability != CLAM_PROV_DURABILITY_NONE){
+    fdatasync(clam_prov_logger_output_fd); // The whole segment, whoever wrote it
+  }
+  rename(path, &segment_path[0]);
+}
+
+static off_t clam_prov_align_offset(off_t offset){
+  return (offset + CLAM_PROV_MMAP_ALIGNMENT - 1) & ~((off_t)CLAM_PROV_MMAP_ALIGNMENT - 1);
+}
+
+/*
+  Must hold 'clam_prov_lock'. Extends the output file by a segment with room for a block of 'min_size' bytes, maps
+  it, and makes it the current segment.
+
+  Returns the segment, or NULL on failure
+*/
+static clam_prov_segment* clam_prov_map_segment(size_t min_size){
+  clam_prov_segment *segment;
+  struct stat file_stat;
+  off_t file_offset, mapping_offset;
+  size_t size, first_block_offset;
+  char *mapping;
+
+  if(clam_prov_logger_output_fd < 0){
+    return NULL;
+  }
+  segment = (clam_prov_segment *)malloc(sizeof(clam_prov_segment));
+  if(segment == NULL){
+    return NULL;
+  }
+
+  mapping = MAP_FAILED;
+  flock(clam_prov_logger_output_fd, LOCK_EX);
+  if(fstat(clam_prov_logger_output_fd, &file_stat) == 0){
+    file_offset = file_stat.st_size;
+    first_block_offset = clam_prov_align_offset(file_offset + CLAM_PROV_SIZE_BLOCK_HEADER) - file_offset;
+    size = CLAM_PROV_MMAP_SEGMENT_SIZE;
+    if(first_block_offset + min_size > size){
+      size = first_block_offset + min_size;
+    }
+    // Preallocated if the file system supports it
+    if(fallocate(clam_prov_logger_output_fd, 0, file_offset, size) == 0 ||
+       ftruncate(clam_prov_logger_output_fd, file_offset + size) == 0){
+      mapping_offset = file_offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+      mapping = (char *)mmap(NULL, (file_offset - mapping_offset) + size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                             clam_prov_logger_output_fd, mapping_offset);
+      if(mapping == MAP_FAILED){
+        ftruncate(clam_prov_logger_output_fd, file_offset);
+      }else{
+        segment->mapping = mapping;
+        segment->mapping_length = (file_offset - mapping_offset) + size;
+        segment->data = &mapping[file_offset - mapping_offset];
+        segment->file_offset = file_offset;
+        segment->size = size;
+        atomic_init(&segment->used, first_block_offset);
+        clam_prov_put_block_header(segment->data, CLAM_PROV_BLOCK_SEGMENT, (unsigned int)(size - CLAM_PROV_SIZE_BLOCK_HEADER));
+      }
+    }
+  }
+  flock(clam_prov_logger_output_fd, LOCK_UN);
+
+  if(mapping == MAP_FAILED){
+    free(segment);
+    return NULL;
+  }
+  segment->next = atomic_load_explicit(&clam_prov_segments, memory_order_relaxed);
+  atomic_store_explicit(&clam_prov_segments, segment, memory_order_release);
+  return segment;
+}
+
+/*
+  Reserve 'size' bytes in the current segment. Maps a new segment if the current one is full.
+
+  Returns the reserved bytes (zero, and aligned in the output file), or NULL on failure
+*/
+static char* clam_prov_reserve_mapped(size_t size){
+  clam_prov_segment *segment;
+  size_t offset;
+
+  size = clam_prov_align_offset(size);
+  while(1){
+    segment = atomic_load_explicit(&clam_prov_segments, memory_order_acquire);
+    if(segment != NULL){
+      offset = atomic_fetch_add_explicit(&segment->used, size, memory_order_relaxed);
+      if(offset + size <= segment->size){
+        return &segment->data[offset];
+      }
+    }
+    if(clam_prov_lock_output() == 0){
+      return NULL;
+    }
+    // Another thread might have mapped a new segment in the meantime
+    if(atomic_load_explicit(&clam_prov_segments, memory_order_relaxed) == segment &&
+       clam_prov_map_segment(size) == NULL){
+      clam_prov_release_lock();
+      return NULL;
+    }
+    clam_prov_release_lock();
+  }
+}
+
+// Reserve a v3 block for 'max_records' records. Returns its records, or NULL on failure
+static clam_prov_record* clam_prov_map_records(int max_records){
+  size_t payload_size;
+  char *block;
+
+  payload_size = sizeof(clam_prov_record) * max_records;
+  block = clam_prov_reserve_mapped(CLAM_PROV_SIZE_BLOCK_HEADER + payload_size);
+  if(block == NULL){
+    return NULL;
+  }
+  clam_prov_put_block_header(block, CLAM_PROV_LOG_FORMAT_V3, (unsigned int)payload_size);
+  // The block is in the output as soon as it is reserved
+  atomic_fetch_add_explicit(&clam_prov_logger_profile_total_bytes, CLAM_PROV_SIZE_BLOCK_HEADER + payload_size,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&clam_prov_logger_profile_total_writes, 1, memory_order_relaxed);
+  return (clam_prov_record *)(&block[CLAM_PROV_SIZE_BLOCK_HEADER]);
+}
+
+// Write the function table entry of 'function_id' in a v2 block without records, if it is not in the output yet
+static void clam_prov_map_function(int function_id){
+  char entry[CLAM_PROV_SIZE_BLOCK_HEADER + CLAM_PROV_SIZE_FUNCTION_V2 + (2 * CLAM_PROV_SIZE_VARINT)];
+  char *entry_end, *block;
+  int name_length;
+
+  if(atomic_exchange_explicit(&clam_prov_function_written[function_id], 1, memory_order_relaxed) != 0){
+    return; // Written by another thread
+  }
+
+  name_length = strnlen(&clam_prov_function_names[function_id][0], CLAM_PROV_FUNCTION_NAME_LENGTH);
+  entry_end = clam_prov_put_varint(&entry[CLAM_PROV_SIZE_BLOCK_HEADER], 1);
+  entry_end = clam_prov_put_varint(entry_end, (unsigned long)function_id);
+  entry_end = clam_prov_put_varint(entry_end, (unsigned long)name_length);
+  memcpy((void*)entry_end, (void*)(&clam_prov_function_names[function_id][0]), name_length);
+  entry_end += name_length;
+  entry_end = clam_prov_put_varint(entry_end, 0); // Number of records
+  clam_prov_put_block_header(&entry[0], CLAM_PROV_LOG_FORMAT_V2, (unsigned int)(entry_end - &entry[CLAM_PROV_SIZE_BLOCK_HEADER]));
+
+  block = clam_prov_reserve_mapped(entry_end - &entry[0]);
+  if(block == NULL){
+    atomic_store_explicit(&clam_prov_function_written[function_id], 0, memory_order_relaxed);
+    return;
+  }
+  // Readers skip a block without a magic, so the magic is written last
+  memcpy((void*)(&block[4]), (void*)(&entry[4]), (entry_end - &entry[0]) - 4);
+  atomic_signal_fence(memory_order_release);
+  memcpy((void*)block, (void*)(&entry[0]), 4);
+  atomic_fetch_add_explicit(&clam_prov_logger_profile_total_bytes, (unsigned long)(entry_end - &entry[0]),
+                            memory_order_relaxed);
+}
+
+// Inline logging knows the ids of the functions it logged before, and doesn't map their names into a new output
+static void clam_prov_map_functions(){
+  int function_id;
+
+  for(function_id = 0; function_id < atomic_load_explicit(&clam_prov_function_count, memory_order_relaxed);
+      function_id++){
+    clam_prov_map_function(function_id);
+  }
+}
+
+static void clam_prov_sync_mapped(char *start, size_t length){
+  char *page;
+
+  page = (char *)((unsigned long)start & ~((unsigned long)sysconf(_SC_PAGESIZE) - 1));
+  msync(page, (start - page) + length, MS_SYNC);
+}
+
+// Sync all the segments, unless the durability is CLAM_PROV_DURABILITY_NONE
+static void clam_prov_sync_segments(){
+  clam_prov_segment *segment;
+
+  if(clam_prov_logger_durability == CLAM_PROV_DURABILITY_NONE){
+    return;
+  }
+  segment = atomic_load_explicit(&clam_prov_segments, memory_order_acquire);
+  for(; segment != NULL; segment = segment->next){
+    clam_prov_sync_mapped(segment->mapping, segment->mapping_length);
+  }
+}
+
+/*
+  Must hold 'clam_prov_lock'. Closes the current segment to reservations. Gives the space in it that was never reserved
+  back to the file system if nothing was appended to the file after it.
+*/
+static void clam_prov_trim_segment(){
+  clam_prov_segment *segment;
+  struct stat file_stat;
+  size_t used;
+
+  segment = atomic_load_explicit(&clam_prov_segments, memory_order_acquire);
+  if(segment == NULL || clam_prov_logger_output_fd < 0){
+    return;
+  }
+  used = atomic_fetch_add_explicit(&segment->used, segment->size, memory_order_relaxed);
+  if(used >= segment->size){
+    return; // Full
+  }
+
+  flock(clam_prov_logger_output_fd, LOCK_EX);
+  if(fstat(clam_prov_logger_output_fd, &file_stat) == 0 &&
+     file_stat.st_size == segment->file_offset + (off_t)segment->size &&
+     ftruncate(clam_prov_logger_output_fd, segment->file_offset + used) == 0){
+    // Readers stop at the end of the file if this doesn't make it
+    clam_prov_put_block_header(segment->data, CLAM_PROV_BLOCK_SEGMENT, (unsigned int)(used - CLAM_PROV_SIZE_BLOCK_HEADER));
+  }
+  flock(clam_prov_logger_output_fd, LOCK_UN);
+}
+
+/*
+  Called by the owner of the full 'buffer' in the memory-mapped output. Moves the buffer to a new v3 block. The
+  records of the old block are already in the output.
+
+  Returns 0 on failure, and 1 on success
+*/
+static int clam_prov_remap_buffer(clam_prov_buffer *buffer){
+  clam_prov_record *records;
+
+  records = clam_prov_map_records(buffer->max_records);
+  if(records == NULL){
+    return 0;
+  }
+  if(clam_prov_logger_durability == CLAM_PROV_DURABILITY_FLUSH || clam_prov_logger_durability == CLAM_PROV_DURABILITY_GROUP){
+    clam_prov_sync_mapped((char *)buffer->records, sizeof(clam_prov_record) * buffer->max_records);
+  }
+  atomic_fetch_add_explicit(&buffer->records_taken, (unsigned long)buffer->max_records, memory_order_relaxed);
+  buffer->records = records;
+  atomic_store_explicit(&buffer->record_count, 0, memory_order_release);
+  return 1;
+}
+
+static size_t clam_prov_ring_size(){
+  return sizeof(clam_prov_ring_header) + (sizeof(clam_prov_ring_function) * CLAM_PROV_MAX_FUNCTIONS) +
+    (sizeof(clam_prov_ring_slot) * CLAM_PROV_SHM_CAPACITY);
+}
+
+/*
+  Open (or create and initialize) the shared memory of the current user, and map it.
+  'consumer' - Set to '1' to keep the shared memory open and locked as the consumer
+
+  Returns the ring on success, otherwise returns NULL
+*/
+static clam_prov_ring* clam_prov_ring_attach_concrete(int consumer){
+  char name[CLAM_PROV_PATH_LENGTH];
+  clam_prov_ring *ring;
+  struct stat shm_stat;
+  char *mapping;
+  int fd, created, wait_ms;
+  unsigned int slot;
+  struct timespec wait_time = {0, 1000 * 1000};
+
+  snprintf(name, sizeof(name), CLAM_PROV_SHM_NAME, (unsigned int)getuid());
+  created = 1;
+  fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, CLAM_PROV_PATH_PERMISSIONS);
+  if(fd < 0 && errno == EEXIST){
+    created = 0;
+    fd = shm_open(name, O_RDWR, CLAM_PROV_PATH_PERMISSIONS);
+  }
+  if(fd < 0){
+    return NULL;
+  }
+  if(consumer == 1 && flock(fd, LOCK_EX|LOCK_NB) != 0){
+    close(fd);
+    return NULL; // Another consumer is attached
+  }
+  if(created == 1 && ftruncate(fd, clam_prov_ring_size()) != 0){
+    shm_unlink(name);
+    close(fd);
+    return NULL;
+  }
+
+  // Wait (for a second at most) for the process that created the shared memory to size it
+  for(wait_ms = 0; fstat(fd, &shm_stat) == 0 && shm_stat.st_size == 0 && wait_ms < 1000; wait_ms++){
+    nanosleep(&wait_time, NULL);
+  }
+  if(shm_stat.st_size != (off_t)clam_prov_ring_size()){
+    close(fd);
+    return NULL; // Not sized in time, or by a different version
+  }
+
+  ring = (clam_prov_ring *)malloc(sizeof(clam_prov_ring));
+  if(ring == NULL){
+    close(fd);
+    return NULL;
+  }
+  mapping = (char *)mmap(NULL, clam_prov_ring_size(), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(mapping == MAP_FAILED){
+    free(ring);
+    close(fd);
+    return NULL;
+  }
+  ring->header = (clam_prov_ring_header *)mapping;
+  ring->functions = (clam_prov_ring_function *)(&mapping[sizeof(clam_prov_ring_header)]);
+  ring->slots = (clam_prov_ring_slot *)(&mapping[sizeof(clam_prov_ring_header) + (sizeof(clam_prov_ring_function) * CLAM_PROV_MAX_FUNCTIONS)]);
+  ring->size = clam_prov_ring_size();
+  ring->fd = fd;
+
+  if(created == 1){
+    ring->header->version = CLAM_PROV_SHM_VERSION;
+    ring->header->capacity = CLAM_PROV_SHM_CAPACITY;
+    ring->header->max_functions = CLAM_PROV_MAX_FUNCTIONS;
+    for(slot = 0; slot < CLAM_PROV_SHM_CAPACITY; slot++){
+      atomic_init(&ring->slots[slot].sequence, slot);
+    }
+    atomic_store_explicit(&ring->header->magic, CLAM_PROV_LOG_MAGIC, memory_order_release);
+  }else{
+    for(wait_ms = 0; atomic_load_explicit(&ring->header->magic, memory_order_acquire) != CLAM_PROV_LOG_MAGIC && wait_ms < 1000; wait_ms++){
+      nanosleep(&wait_time, NULL);
+    }
+  }
+  if(atomic_load_explicit(&ring->header->magic, memory_order_acquire) != CLAM_PROV_LOG_MAGIC ||
+     ring->header->version != CLAM_PROV_SHM_VERSION || ring->header->capacity != CLAM_PROV_SHM_CAPACITY ||
+     ring->header->max_functions != CLAM_PROV_MAX_FUNCTIONS){
+    munmap(mapping, ring->size);
+    free(ring);
+    close(fd);
+    return NULL; // Not initialized in time, or by a different version
+  }
+
+  if(consumer == 0){
+    close(fd);
+    ring->fd = -1;
+  }
+  return ring;
+}
+
+static clam_prov_ring* clam_prov_ring_attach(){
+  memset((void*)(&clam_prov_ring_function_ids[0]), 0, sizeof(clam_prov_ring_function_ids));
+  return clam_prov_ring_attach_concrete(0);
+}
+
+// Returns the id in the ring of the function with the id 'function_id', or -1 if the function table is full
+static int clam_prov_ring_intern(int function_id){
+  clam_prov_ring_function *entry;
+  char *function_name;
+  unsigned long hash;
+  int slot, probe, state;
+
+  slot = atomic_load_explicit(&clam_prov_ring_function_ids[function_id], memory_order_relaxed);
+  if(slot > 0){
+    return slot - 1;
+  }
+
+  function_name = &clam_prov_function_names[function_id][0];
+  hash = 14695981039346656037UL; // FNV-1a
+  for(probe = 0; probe < CLAM_PROV_FUNCTION_NAME_LENGTH && function_name[probe] != '\0'; probe++){
+    hash = (hash ^ (unsigned char)function_name[probe]) * 1099511628211UL;
+  }
+  slot = (int)(hash % CLAM_PROV_MAX_FUNCTIONS);
+  for(probe = 0; probe < CLAM_PROV_MAX_FUNCTIONS; probe++, slot = (slot + 1) % CLAM_PROV_MAX_FUNCTIONS){
+    entry = &clam_prov_ring_output->functions[slot];
+    state = CLAM_PROV_SHM_FUNCTION_EMPTY;
+    if(atomic_compare_exchange_strong_explicit(&entry->state, &state, CLAM_PROV_SHM_FUNCTION_WRITING,
+                                               memory_order_acquire, memory_order_acquire)){
+      memcpy((void*)(&entry->name[0]), (void*)function_name, CLAM_PROV_FUNCTION_NAME_LENGTH);
+      atomic_store_explicit(&entry->state, CLAM_PROV_SHM_FUNCTION_WRITTEN, memory_order_release);
+      break;
+    }
+    while(state == CLAM_PROV_SHM_FUNCTION_WRITING){
+      sched_yield(); // Being written by another thread or process
+      state = atomic_load_explicit(&entry->state, memory_order_acquire);
+    }
+    if(strncmp(&entry->name[0], function_name, CLAM_PROV_FUNCTION_NAME_LENGTH) == 0){
+      break;
+    }
+  }
+  if(probe == CLAM_PROV_MAX_FUNCTIONS){
+    return -1;
+  }
+  atomic_store_explicit(&clam_prov_ring_function_ids[function_id], slot + 1, memory_order_relaxed);
+  return slot;
+}
+
+// Returns the number of records written to the ring. Stops at the first record that doesn't fit.
+static int clam_prov_ring_write(clam_prov_record *records, int total_records){
+  clam_prov_ring_header *header;
+  clam_prov_ring_slot *slot;
+  unsigned long position, sequence;
+  clam_prov_clock_anchor anchor;
+  int current_record_index, function_id;
+
+  header = clam_prov_ring_output->header;
+  anchor.reading = anchor.nanos = 0;
+  if(clam_prov_logger_clock != CLAM_PROV_CLOCK_REALTIME){
+    clam_prov_clock_anchor_now(&anchor);
+  }
+  for(current_record_index = 0; current_record_index < total_records; current_record_index++){
+    function_id = clam_prov_ring_intern(records[current_record_index].function_id);
+
+    position = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    while(1){
+      slot = &clam_prov_ring_output->slots[position & (CLAM_PROV_SHM_CAPACITY - 1)];
+      sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+      if(sequence == position){
+        if(atomic_compare_exchange_weak_explicit(&header->tail, &position, position + 1,
+                                                 memory_order_relaxed, memory_order_relaxed)){
+          break;
+        }
+      }else if((long)(sequence - position) < 0){
+        return current_record_index; // Full
+      }else{
+        position = atomic_load_explicit(&header->tail, memory_order_relaxed); // Claimed by another writer
+      }
+    }
+
+    slot->record = records[current_record_index];
+    slot->record.function_id = function_id;
+    if(clam_prov_logger_clock != CLAM_PROV_CLOCK_REALTIME){
+      slot->record.time = clam_prov_clock_to_nanos(&anchor, slot->record.time) / (1000 * 1000);
+    }
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+  }
+  return total_records;
+}
+
+static int clam_prov_ring_has_consumer(clam_prov_ring *ring){
+  int consumer_pid;
+
+  consumer_pid = atomic_load_explicit(&ring->header->consumer_pid, memory_order_relaxed);
+  return consumer_pid != 0 && (kill(consumer_pid, 0) == 0 || errno == EPERM);
+}
+
+// Count the records left in the buffers as dropped (at shutdown)
+static void clam_prov_ring_drop_buffers(){
+  clam_prov_buffer *buffer;
+  int total_records;
+
+  buffer = atomic_load_explicit(&clam_prov_buffers, memory_order_acquire);
+  for(; buffer != NULL; buffer = buffer->next){
+    total_records = atomic_load_explicit(&buffer->record_count, memory_order_relaxed);
+    while(total_records > 0 &&
+          !atomic_compare_exchange_weak_explicit(&buffer->record_count, &total_records, 0,
+                                                 memory_order_relaxed, memory_order_relaxed)){
+    }
+    if(total_records > 0){
+      atomic_fetch_add_explicit(&clam_prov_ring_output->header->dropped, total_records, memory_order_relaxed);
+      atomic_fetch_add_explicit(&buffer->records_taken, (unsigned long)total_records, memory_order_relaxed);
+      atomic_fetch_add_explicit(&clam_prov_logger_profile_records_dropped, (unsigned long)total_records,
+                                memory_order_relaxed);
+    }
+  }
+}
+
+/*
+  Seal the buffer and write out its records if it has at least 'min_records' records.
+  The records are dropped if writing fails, except for the shared memory output where they stay in the buffer.
+
+  Returns 0 on failure, and 1 on success (or if nothing needed flushing)
+*/
+static int clam_prov_flush_buffer(clam_prov_buffer *buffer, int min_records){
+  int total_records, written_records;
+  int result;
+  unsigned long start;
+
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP){
+    return 1; // Records are written in place
+  }
+
+  total_records = atomic_load_explicit(&buffer->record_count, memory_order_relaxed);
+  do{
+    if(total_records == CLAM_PROV_BUFFER_SEALED || total_records == 0 || total_records < min_records){
+      return 1; // Being flushed by another thread, or nothing to flush
+    }
+  }while(!atomic_compare_exchange_weak_explicit(&buffer->record_count, &total_records, CLAM_PROV_BUFFER_SEALED,
+                                                memory_order_acquire, memory_order_relaxed));
+
+  start = get_monotonic_microseconds();
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_SHM){
+    // The records that don't fit in the ring stay in the buffer
+    written_records = clam_prov_ring_write(buffer->records, total_records);
+    memmove((void*)(&buffer->records[0]), (void*)(&buffer->records[written_records]),
+            sizeof(clam_prov_record) * (total_records - written_records));
+    atomic_fetch_add_explicit(&buffer->records_taken, (unsigned long)written_records, memory_order_relaxed);
+    clam_prov_unseal_buffer(buffer, total_records - written_records);
+    if(written_records > 0){
+      atomic_fetch_add_explicit(&clam_prov_logger_profile_total_bytes, sizeof(clam_prov_record) * written_records,
+                                memory_order_relaxed);
+      clam_prov_profile_flush(start, 1, 0);
+    }
+    return written_records == total_records ? 1 : 0;
+  }
+
+  atomic_fetch_add_explicit(&buffer->records_taken, (unsigned long)total_records, memory_order_relaxed);
+  result = clam_prov_write_records(buffer->records, total_records);
+  clam_prov_profile_flush(start, result, total_records);
+
+  clam_prov_unseal_buffer(buffer, 0);
+  return result;
+}
+
+static int clam_prov_flush_all_buffers(){
+  clam_prov_buffer *buffer;
+  int result;
+
+  result = 1;
+  buffer = atomic_load_explicit(&clam_prov_buffers, memory_order_acquire);
+  for(; buffer != NULL; buffer = buffer->next){
+    if(clam_prov_flush_buffer(buffer, 1) == 0){
+      result = 0;
+    }
+  }
+  return result;
+}
+
+/*
+  Called by the owner of the full 'buffer'.
+  In CLAM_PROV_FLUSH_ASYNC mode, queues the buffer for the flusher thread and switches to the spare buffer. In the
+  memory-mapped output, moves the buffer to a new block. In the shared memory output, flushes the buffer even if it
+  is not full. Otherwise, flushes the buffer.
+
+  Returns 0 on failure, and 1 on success
+*/
+static int clam_prov_hand_off_buffer(clam_prov_buffer *buffer){
+  int total_records;
+
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP){
+    if(atomic_load_explicit(&buffer->record_count, memory_order_relaxed) < buffer->max_records){
+      return 1; // Not full
+    }
+    return clam_prov_remap_buffer(buffer);
+  }
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_SHM){
+    return clam_prov_flush_buffer(buffer, 1); // To the ring as soon as possible
+  }
+
+  if(clam_prov_logger_flush_mode != CLAM_PROV_FLUSH_ASYNC || clam_prov_thread_spare_buffer == NULL){
+    return clam_prov_flush_buffer(buffer, buffer->max_records);
+  }
+
+  total_records = atomic_load_explicit(&buffer->record_count, memory_order_relaxed);
+  if(total_records < buffer->max_records ||
+     !atomic_compare_exchange_strong_explicit(&buffer->record_count, &total_records, CLAM_PROV_BUFFER_SEALED,
+                                              memory_order_acquire, memory_order_relaxed)){
+    return 1; // Not full, or being flushed by another thread
+  }
+  buffer->sealed_records = total_records;
+  atomic_fetch_add_explicit(&buffer->records_taken, (unsigned long)total_records, memory_order_relaxed);
+
+  buffer->next_full = atomic_load_explicit(&clam_prov_full_buffers, memory_order_relaxed);
+  while(!atomic_compare_exchange_weak_explicit(&clam_prov_full_buffers, &buffer->next_full, buffer,
+                                               memory_order_release, memory_order_relaxed)){
+  }
+  sem_post(&clam_prov_flusher_signal);
+
+  // The spare is usually back from the flusher thread by now. If it is not then appending waits for it.
+  clam_prov_set_thread_buffer(clam_prov_thread_spare_buffer);
+  clam_prov_thread_spare_buffer = buffer;
+  return 1;
+}
+
+static void clam_prov_flush_full_buffers(){
+  clam_prov_buffer *buffers, *queued, *next;
+  unsigned long start;
+  int result;
+
+  // Reverse the stack to write in the order of hand off
+  queued = NULL;
+  buffers = atomic_exchange_explicit(&clam_prov_full_buffers, NULL, memory_order_acquire);
+  for(; buffers != NULL; buffers = next){
+    next = buffers->next_full;
+    buffers->next_full = queued;
+    queued = buffers;
+  }
+
+  for(; queued != NULL; queued = next){
+    next = queued->next_full;
+    start = get_monotonic_microseconds();
+    result = clam_prov_write_records(queued->records, queued->sealed_records);
+    clam_prov_profile_flush(start, result, queued->sealed_records);
+    clam_prov_unseal_buffer(queued, 0);
+  }
+}
+
+static int clam_prov_flusher_timeout_ms(){
+  int timeout_ms;
+
+  timeout_ms = clam_prov_logger_flush_interval_ms;
+  if(clam_prov_logger_durability == CLAM_PROV_DURABILITY_PERIODIC &&
+     (timeout_ms <= 0 || clam_prov_logger_durability_interval_ms < timeout_ms)){
+    timeout_ms = clam_prov_logger_durability_interval_ms;
+  }
+  return timeout_ms;
+}
+
+static int clam_prov_flusher_wait(){
+  struct timespec deadline;
+  int timeout_ms;
+
+  timeout_ms = clam_prov_flusher_timeout_ms();
+  if(timeout_ms <= 0){
+    return sem_wait(&clam_prov_flusher_signal);
+  }
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000 * 1000;
+  if(deadline.tv_nsec >= 1000 * 1000 * 1000){
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000 * 1000 * 1000;
+  }
+  return sem_timedwait(&clam_prov_flusher_signal, &deadline);
+}
+
+static void* clam_prov_flusher_run(void *arg){
+  sigset_t signals;
+  int is_running;
+  unsigned long last_flush_time, last_sync_time, current_time;
+
+  // Signals are for the application threads
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  last_flush_time = last_sync_time = get_monotonic_milliseconds();
+  do{
+    if(clam_prov_flusher_wait() != 0 && errno != ETIMEDOUT){
+      continue; // EINTR
+    }
+    is_running = atomic_load_explicit(&clam_prov_flusher_is_running, memory_order_acquire);
+    clam_prov_flush_full_buffers();
+
+    current_time = get_monotonic_milliseconds();
+    if(clam_prov_logger_flush_interval_ms > 0 &&
+       current_time - last_flush_time >= (unsigned long)clam_prov_logger_flush_interval_ms){
+      if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_AGGREGATE){
+        clam_prov_write_summary();
+      }else{
+        clam_prov_flush_all_buffers();
+        clam_prov_replay_output(0);
+      }
+      last_flush_time = current_time;
+    }
+    if(clam_prov_logger_durability == CLAM_PROV_DURABILITY_PERIODIC &&
+       current_time - last_sync_time >= (unsigned long)clam_prov_logger_durability_interval_ms){
+      if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP){
+        clam_prov_sync_segments();
+      }else{
+        clam_prov_sync_output(atomic_load_explicit(&clam_prov_written_sequence, memory_order_relaxed));
+      }
+      last_sync_time = current_time;
+    }
+  }while(is_running == 1);
+
+  return NULL;
+}
+
+static int clam_prov_start_flusher(){
+  if(sem_init(&clam_prov_flusher_signal, 0, 0) != 0){
+    return 0;
+  }
+  atomic_store_explicit(&clam_prov_flusher_is_running, 1, memory_order_release);
+  if(pthread_create(&clam_prov_flusher_thread, NULL, &clam_prov_flusher_run, NULL) != 0){
+    atomic_store_explicit(&clam_prov_flusher_is_running, 0, memory_order_release);
+    sem_destroy(&clam_prov_flusher_signal);
+    return 0;
+  }
+  return 1;
+}
+
+static void clam_prov_stop_flusher(){
+  if(atomic_exchange_explicit(&clam_prov_flusher_is_running, 0, memory_order_acq_rel) == 0){
+    return; // Not running
+  }
+  sem_post(&clam_prov_flusher_signal);
+  pthread_join(clam_prov_flusher_thread, NULL);
+  sem_destroy(&clam_prov_flusher_signal);
+
+  // Buffers queued after the last wake up of the flusher thread
+  clam_prov_flush_full_buffers();
+}
+
+// Token bucket of 'rate' tokens, with a token every '1000000 / rate' microseconds (generic cell rate algorithm)
+static int clam_prov_take_token(clam_prov_call_site *call_site, long rate){
+  unsigned long now, interval, next, new_next;
+
+  now = get_monotonic_microseconds();
+  interval = 1000000UL / (unsigned long)rate;
+  if(interval == 0){
+    interval = 1;
+  }
+  next = atomic_load_explicit(&call_site->next_us, memory_order_relaxed);
+  do{
+    new_next = (next > now ? next : now) + interval;
+    if(new_next - now > interval * (unsigned long)rate){
+      return 0; // Empty
+    }
+  }while(!atomic_compare_exchange_weak_explicit(&call_site->next_us, &next, new_next, memory_order_relaxed,
+                                                memory_order_relaxed));
+  return 1;
+}
+
+/*
+  The rate of the adaptive sampling, so that the executions of the interval make 'records_per_second' records. It is
+  raised as soon as the executions so far are over the budget so far, and set by the thread that ends the interval.
+*/
+static unsigned long clam_prov_adapt_rate(long records_per_second){
+  unsigned long calls, now, start, elapsed, budget, rate, new_rate;
+
+  rate = atomic_load_explicit(&clam_prov_adaptive_rate, memory_order_relaxed);
+  if(++clam_prov_thread_adaptive_calls < CLAM_PROV_SAMPLING_BATCH){
+    return rate;
+  }
+  calls = atomic_fetch_add_explicit(&clam_prov_adaptive_calls, clam_prov_thread_adaptive_calls, memory_order_relaxed) +
+    clam_prov_thread_adaptive_calls;
+  clam_prov_thread_adaptive_calls = 0;
+
+  now = get_monotonic_milliseconds();
+  start = atomic_load_explicit(&clam_prov_adaptive_interval_start, memory_order_relaxed);
+  elapsed = now > start ? now - start : 1;
+  budget = ((unsigned long)records_per_second * elapsed) / 1000;
+  new_rate = budget == 0 ? calls : (calls + budget - 1) / budget;
+  if(new_rate == 0){
+    new_rate = 1;
+  }
+  if(elapsed >= CLAM_PROV_SAMPLING_INTERVAL_MS){
+    if(!atomic_compare_exchange_strong_explicit(&clam_prov_adaptive_interval_start, &start, now, memory_order_relaxed,
+                                                memory_order_relaxed)){
+      return rate; // Ended by another thread
+    }
+    atomic_store_explicit(&clam_prov_adaptive_calls, 0, memory_order_relaxed);
+  }else if(new_rate <= rate){
+    return rate;
+  }
+  atomic_store_explicit(&clam_prov_adaptive_rate, new_rate, memory_order_relaxed);
+  return new_rate;
+}
+
+/*
+  Decides if an execution of the call-site 'call_site_id' is logged.
+
+  Returns the weight of its record, or 0 if it is not logged
+*/
+static unsigned long clam_prov_sample(long call_site_id){
+  clam_prov_call_site *call_site;
+  int sampling, is_sampled;
+  long parameter;
+
+  if(call_site_id < 0 || call_site_id >= CLAM_PROV_MAX_CALL_SITES){
+    return 1;
+  }
+  call_site = &clam_prov_call_sites[call_site_id];
+  sampling = atomic_load_explicit(&call_site->sampling, memory_order_acquire);
+  if(sampling == 0){
+    sampling = clam_prov_logger_sampling;
+    parameter = clam_prov_logger_sampling_parameter;
+  }else{
+    sampling--;
+    parameter = atomic_load_explicit(&call_site->parameter, memory_order_relaxed);
+  }
+
+  switch(sampling){
+    case CLAM_PROV_SAMPLING_FIXED:
+      is_sampled = atomic_fetch_add_explicit(&call_site->calls, 1, memory_order_relaxed) % (unsigned long)parameter == 0;
+      break;
+    case CLAM_PROV_SAMPLING_TOKEN_BUCKET:
+      is_sampled = clam_prov_take_token(call_site, parameter);
+      break;
+    case CLAM_PROV_SAMPLING_ADAPTIVE:
+      is_sampled = atomic_fetch_add_explicit(&call_site->calls, 1, memory_order_relaxed) %
+        clam_prov_adapt_rate(parameter) == 0;
+      break;
+    default:
+      is_sampled = 1;
+  }
+  if(is_sampled == 0){
+    atomic_fetch_add_explicit(&call_site->skipped, 1, memory_order_relaxed);
+    return 0;
+  }
+  return atomic_exchange_explicit(&call_site->skipped, 0, memory_order_relaxed) + 1;
+}
+
+static clam_prov_histogram* clam_prov_alloc_histogram(long call_site_id, int function_id){
+  clam_prov_histogram *histogram, *existing;
+  long end;
+
+  histogram = (clam_prov_histogram *)aligned_alloc(_Alignof(clam_prov_histogram), sizeof(clam_prov_histogram));
+  if(histogram == NULL){
+    return NULL;
+  }
+  memset((void*)histogram, 0, sizeof(clam_prov_histogram));
+  atomic_store_explicit(&histogram->function_id, function_id, memory_order_relaxed);
+
+  existing = NULL;
+  if(!atomic_compare_exchange_strong_explicit(&clam_prov_histograms[call_site_id], &existing, histogram,
+                                              memory_order_acq_rel, memory_order_acquire)){
+    free(histogram); // Allocated by another thread
+    return existing;
+  }
+  end = atomic_load_explicit(&clam_prov_histograms_end, memory_order_relaxed);
+  while(end <= call_site_id &&
+        !atomic_compare_exchange_weak_explicit(&clam_prov_histograms_end, &end, call_site_id + 1,
+                                               memory_order_release, memory_order_relaxed));
+  return histogram;
+}
+
+// Adds an execution of the call-site 'call_site_id' that returned 'exit_value' to its histogram
+static int clam_prov_aggregate(long call_site_id, long exit_value, int function_id){
+  clam_prov_histogram *histogram;
+  int bucket;
+
+  if(call_site_id < 0 || call_site_id >= CLAM_PROV_MAX_CALL_SITES){
+    atomic_fetch_add_explicit(&clam_prov_not_aggregated, 1, memory_order_relaxed);
+    return 1;
+  }
+  histogram = atomic_load_explicit(&clam_prov_histograms[call_site_id], memory_order_acquire);
+  if(histogram == NULL){
+    histogram = clam_prov_alloc_histogram(call_site_id, function_id);
+    if(histogram == NULL){
+      return 0; // Failed to allocate memory for the histogram
+    }
+  }
+  if(atomic_load_explicit(&histogram->function_id, memory_order_relaxed) != function_id){
+    atomic_store_explicit(&histogram->function_id, function_id, memory_order_relaxed);
+  }
+
+  if(exit_value == 0){
+    bucket = 0;
+  }else if(exit_value > 0){
+    bucket = 64 - __builtin_clzl((unsigned long)exit_value);
+  }else{
+    bucket = 127 - __builtin_clzl(-(unsigned long)exit_value);
+  }
+  atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+  return 1;
+}
+
+static clam_prov_latency_histogram* clam_prov_alloc_latency(long index){
+  clam_prov_latency_histogram *histogram, *existing;
+  long end;
+
+  histogram = (clam_prov_latency_histogram *)aligned_alloc(_Alignof(clam_prov_latency_histogram),
+                                                           sizeof(clam_prov_latency_histogram));
+  if(histogram == NULL){
+    return NULL;
+  }
+  memset((void*)histogram, 0, sizeof(clam_prov_latency_histogram));
+
+  existing = NULL;
+  if(!atomic_compare_exchange_strong_explicit(&clam_prov_latencies[index], &existing, histogram,
+                                              memory_order_acq_rel, memory_order_acquire)){
+    free(histogram); // Allocated by another thread
+    return existing;
+  }
+  end = atomic_load_explicit(&clam_prov_latencies_end, memory_order_relaxed);
+  while(index < CLAM_PROV_MAX_CALL_SITES && end <= index &&
+        !atomic_compare_exchange_weak_explicit(&clam_prov_latencies_end, &end, index + 1,
+                                               memory_order_release, memory_order_relaxed));
+  return histogram;
+}
+
+// Copies the histogram at 'index' of 'clam_prov_latencies'. Async-signal-safe. Returns 0 if it is not allocated
+static int clam_prov_get_latency(long index, clam_prov_latency *latency){
+  clam_prov_latency_histogram *histogram;
+  int bucket;
+
+  histogram = atomic_load_explicit(&clam_prov_latencies[index], memory_order_acquire);
+  if(histogram == NULL){
+    return 0;
+  }
+  latency->calls = 0;
+  latency->total_nanos = atomic_load_explicit(&histogram->total_nanos, memory_order_relaxed);
+  for(bucket = 0; bucket < CLAM_PROV_LATENCY_BUCKETS; bucket++){
+    latency->buckets[bucket] = atomic_load_explicit(&histogram->buckets[bucket], memory_order_relaxed);
+    latency->calls += latency->buckets[bucket];
+  }
+  return 1;
+}
+
+/*
+  Writes a summary block with the executions since the previous summary, if there are any. The function names that
+  are not in the output yet are in the block.
+
+  Returns 0 on failure, and 1 on success
+*/
+static int clam_prov_write_summary(){
+  clam_prov_histogram *histogram;
+  unsigned long counts[CLAM_PROV_AGGREGATE_BUCKETS];
+  unsigned long not_aggregated, current_time;
+  long call_site_id, previous_call_site_id, end;
+  int total_functions, total_new_functions, total_sites, total_buckets, function_id, name_length, bucket, i;
+  int functions_size, sites_size;
+  char *dst, *functions_end, *sites_dst, *sites_end;
+  struct iovec iov[2];
+  ssize_t written_bytes;
+  unsigned long write_sequence, start;
+
+  end = atomic_load_explicit(&clam_prov_histograms_end, memory_order_acquire);
+  total_functions = atomic_load_explicit(&clam_prov_function_count, memory_order_relaxed);
+  functions_size = CLAM_PROV_SIZE_BLOCK_HEADER + (5 * CLAM_PROV_SIZE_VARINT) + (total_functions * CLAM_PROV_SIZE_FUNCTION_V2);
+  sites_size = (int)end * ((3 * CLAM_PROV_SIZE_VARINT) + (CLAM_PROV_AGGREGATE_BUCKETS * (1 + CLAM_PROV_SIZE_VARINT)));
+  dst = alloc_dst_buffer(functions_size + sites_size);
+  if(dst == NULL){
+    return 0;
+  }
+  sites_dst = dst + functions_size;
+
+  written_bytes = 0;
+  write_sequence = 0;
+  if(clam_prov_lock_output() == 0){
+    free_dst_buffer(dst);
+    return 0;
+  }
+  if(clam_prov_logger_output_fd < 0){
+    clam_prov_release_lock();
+    free_dst_buffer(dst);
+    return 0;
+  }
+
+  current_time = get_current_milliseconds();
+  not_aggregated = atomic_exchange_explicit(&clam_prov_not_aggregated, 0, memory_order_relaxed);
+  total_sites = 0;
+  total_new_functions = 0;
+  previous_call_site_id = 0;
+  sites_end = sites_dst;
+  for(call_site_id = 0; call_site_id < end; call_site_id++){
+    histogram = atomic_load_explicit(&clam_prov_histograms[call_site_id], memory_order_acquire);
+    if(histogram == NULL){
+      continue;
+    }
+    total_buckets = 0;
+    for(bucket = 0; bucket < CLAM_PROV_AGGREGATE_BUCKETS; bucket++){
+      // Only the buckets that changed are written to, to leave the cache lines of the others shared
+      counts[bucket] = atomic_load_explicit(&histogram->buckets[bucket], memory_order_relaxed);
+      if(counts[bucket] != 0){
+        counts[bucket] = atomic_exchange_explicit(&histogram->buckets[bucket], 0, memory_order_relaxed);
+        total_buckets++;
+      }
+    }
+    if(total_buckets == 0){
+      continue;
+    }
+
+    function_id = atomic_load_explicit(&histogram->function_id, memory_order_relaxed);
+    if(clam_prov_function_written[function_id] == 0){
+      clam_prov_function_written[function_id] = 1;
+      clam_prov_new_function_ids[total_new_functions++] = function_id;
+    }
+    sites_end = clam_prov_put_varint(sites_end, (unsigned long)(call_site_id - previous_call_site_id));
+    sites_end = clam_prov_put_varint(sites_end, (unsigned long)function_id);
+    sites_end = clam_prov_put_varint(sites_end, (unsigned long)total_buckets);
+    for(bucket = 0; bucket < CLAM_PROV_AGGREGATE_BUCKETS; bucket++){
+      if(counts[bucket] != 0){
+        sites_end = clam_prov_put_varint(sites_end, (unsigned long)bucket);
+        sites_end = clam_prov_put_varint(sites_end, counts[bucket]);
+      }
+    }
+    previous_call_site_id = call_site_id;
+    total_sites++;
+  }
+
+  if(total_sites > 0 || not_aggregated > 0){
+    functions_end = clam_prov_put_varint(dst + CLAM_PROV_SIZE_BLOCK_HEADER, (unsigned long)total_new_functions);
+    for(i = 0; i < total_new_functions; i++){
+      function_id = clam_prov_new_function_ids[i];
+      name_length = strnlen(&clam_prov_function_names[function_id][0], CLAM_PROV_FUNCTION_NAME_LENGTH);
+      functions_end = clam_prov_put_varint(functions_end, (unsigned long)function_id);
+      functions_end = clam_prov_put_varint(functions_end, (unsigned long)name_length);
+      memcpy((void*)functions_end, (void*)(&clam_prov_function_names[function_id][0]), name_length);
+      functions_end += name_length;
+    }
+    functions_end = clam_prov_put_varint(functions_end, clam_prov_summary_start);
+    functions_end = clam_prov_put_varint(functions_end, current_time);
+    functions_end = clam_prov_put_varint(functions_end, not_aggregated);
+    functions_end = clam_prov_put_varint(functions_end, (unsigned long)total_sites);
+
+    iov[0].iov_base = (void*)dst;
+    iov[0].iov_len = functions_end - dst;
+    iov[1].iov_base = (void*)sites_dst;
+    iov[1].iov_len = sites_end - sites_dst;
+    clam_prov_put_block_header(dst, CLAM_PROV_BLOCK_SUMMARY, (unsigned int)(iov[0].iov_len - CLAM_PROV_SIZE_BLOCK_HEADER + iov[1].iov_len));
+    start = get_monotonic_microseconds();
+    written_bytes = clam_prov_write_output(iov, 2, &write_sequence);
+    clam_prov_profile_flush(start, 1, 0);
+
+    if(written_bytes != (ssize_t)(iov[0].iov_len + iov[1].iov_len)){
+      for(i = 0; i < total_new_functions; i++){
+        clam_prov_function_written[clam_prov_new_function_ids[i]] = 0; // Write them again with the next summary
+      }
+      written_bytes = -1;
+    }
+    clam_prov_summary_start = current_time;
+  }
+  clam_prov_release_lock();
+  clam_prov_sync_output_group(write_sequence);
+  free_dst_buffer(dst);
+
+  if(written_bytes < 0){
+    // The executions of the summary are lost, like the records of a failed write
+    return 0;
+  }
+  return 1;
+}
+
+// Must hold 'clam_prov_lock'. Drops the executions aggregated so far, and starts the interval of the next summary
+static void clam_prov_clear_histograms(){
+  clam_prov_histogram *histogram;
+  long call_site_id, end;
+  int bucket;
+
+  end = atomic_load_explicit(&clam_prov_histograms_end, memory_order_acquire);
+  for(call_site_id = 0; call_site_id < end; call_site_id++){
+    histogram = atomic_load_explicit(&clam_prov_histograms[call_site_id], memory_order_acquire);
+    for(bucket = 0; histogram != NULL && bucket < CLAM_PROV_AGGREGATE_BUCKETS; bucket++){
+      atomic_store_explicit(&histogram->buckets[bucket], 0, memory_order_relaxed);
+    }
+  }
+  atomic_store_explicit(&clam_prov_not_aggregated, 0, memory_order_relaxed);
+  clam_prov_summary_start = get_current_milliseconds();
+}
+
+// Starts the stats over. The records in the buffers are not counted, as they are not buffered from now on
+static void clam_prov_reset_stats(){
+  clam_prov_buffer *buffer;
+  clam_prov_latency_histogram *latency;
+  int record_count, bucket;
+  long index;
+
+  buffer = atomic_load_explicit(&clam_prov_buffers, memory_order_acquire);
+  for(; buffer != NULL; buffer = buffer->next){
+    record_count = atomic_load_explicit(&buffer->record_count, memory_order_relaxed);
+    atomic_store_explicit(&buffer->records_taken, record_count > 0 ? -(unsigned long)record_count : 0,
+                          memory_order_relaxed);
+  }
+  atomic_store_explicit(&clam_prov_logger_profile_records_dropped, 0, memory_order_relaxed);
+  atomic_store_explicit(&clam_prov_logger_profile_total_bytes, 0, memory_order_relaxed);
+  atomic_store_explicit(&clam_prov_logger_profile_total_writes, 0, memory_order_relaxed);
+  for(bucket = 0; bucket < CLAM_PROV_STATS_BUCKETS; bucket++){
+    atomic_store_explicit(&clam_prov_logger_profile_flush_latency[bucket], 0, memory_order_relaxed);
+    atomic_store_explicit(&clam_prov_logger_profile_lock_wait[bucket], 0, memory_order_relaxed);
+  }
+  for(index = 0; index <= CLAM_PROV_MAX_CALL_SITES; index++){
+    latency = atomic_load_explicit(&clam_prov_latencies[index], memory_order_acquire);
+    for(bucket = 0; latency != NULL && bucket < CLAM_PROV_LATENCY_BUCKETS; bucket++){
+      atomic_store_explicit(&latency->buckets[bucket], 0, memory_order_relaxed);
+    }
+    if(latency != NULL){
+      atomic_store_explicit(&latency->total_nanos, 0, memory_order_relaxed);
+    }
+  }
+}
+
+// Async-signal-safe: only reads atomics, and the list of buffers which are never freed
+static void clam_prov_get_stats(clam_prov_stats *stats){
+  clam_prov_buffer *buffer;
+  int record_count, bucket;
+
+  stats->records_buffered = 0;
+  buffer = atomic_load_explicit(&clam_prov_buffers, memory_order_acquire);
+  for(; buffer != NULL; buffer = buffer->next){
+    record_count = atomic_load_explicit(&buffer->record_count, memory_order_relaxed);
+    stats->records_buffered += atomic_load_explicit(&buffer->records_taken, memory_order_relaxed);
+    stats->records_buffered += record_count > 0 ? (unsigned long)record_count : 0; // Sealed ones are taken
+  }
+  stats->records_dropped = atomic_load_explicit(&clam_prov_logger_profile_records_dropped, memory_order_relaxed);
+  stats->bytes_written = atomic_load_explicit(&clam_prov_logger_profile_total_bytes, memory_order_relaxed);
+  stats->flushes = atomic_load_explicit(&clam_prov_logger_profile_total_writes, memory_order_relaxed);
+  for(bucket = 0; bucket < CLAM_PROV_STATS_BUCKETS; bucket++){
+    stats->flush_latency[bucket] = atomic_load_explicit(&clam_prov_logger_profile_flush_latency[bucket],
+                                                        memory_order_relaxed);
+    stats->lock_wait[bucket] = atomic_load_explicit(&clam_prov_logger_profile_lock_wait[bucket], memory_order_relaxed);
+  }
+}
+
+// Formatting of the stats without 'printf', to be async-signal-safe
+static char* clam_prov_put_text(char *dst, char *end, const char *text){
+  while(*text != '\0' && dst < end){
+    *dst++ = *text++;
+  }
+  return dst;
+}
+
+static char* clam_prov_put_decimal(char *dst, char *end, unsigned long value){
+  char digits[20];
+  int total_digits;
+
+  total_digits = 0;
+  do{
+    digits[total_digits++] = (char)('0' + (value % 10));
+    value /= 10;
+  }while(value != 0);
+  while(total_digits > 0 && dst < end){
+    *dst++ = digits[--total_digits];
+  }
+  return dst;
+}
+
+static char* clam_prov_put_histogram(char *dst, char *end, const char *name, unsigned long *buckets,
+                                     int total_buckets){
+  int bucket;
+
+  dst = clam_prov_put_text(dst, end, name);
+  for(bucket = 0; bucket < total_buckets; bucket++){
+    if(buckets[bucket] == 0){
+      continue;
+    }
+    dst = clam_prov_put_text(dst, end, " ");
+    if(bucket == 0){
+      dst = clam_prov_put_text(dst, end, "0");
+    }else{
+      dst = clam_prov_put_decimal(dst, end, 1UL << (bucket - 1));
+      dst = clam_prov_put_text(dst, end, "..");
+      if(bucket < total_buckets - 1){
+        dst = clam_prov_put_decimal(dst, end, (1UL << bucket) - 1);
+      }
+    }
+    dst = clam_prov_put_text(dst, end, ":");
+    dst = clam_prov_put_decimal(dst, end, buckets[bucket]);
+  }
+  return clam_prov_put_text(dst, end, "\n");
+}
+
+// Writes the text in ['text', 'end') to the standard error. Async-signal-safe
+static void clam_prov_write_stderr(char *text, char *end){
+  ssize_t written_bytes;
+
+  for(; text < end; text += written_bytes){
+    written_bytes = write(STDERR_FILENO, text, end - text);
+    if(written_bytes <= 0 && errno != EINTR){
+      break;
+    }
+    if(written_bytes < 0){
+      written_bytes = 0;
+    }
+  }
+}
+
+// Prints the latency histograms of the call-sites to the standard error, one line each. Async-signal-safe
+static void clam_prov_dump_latencies(){
+  clam_prov_latency latency;
+  char text[1024];
+  char *dst, *end;
+  long index, latencies_end;
+
+  latencies_end = atomic_load_explicit(&clam_prov_latencies_end, memory_order_acquire);
+  for(index = 0; index <= CLAM_PROV_MAX_CALL_SITES; index++){
+    if(index == latencies_end){
+      index = CLAM_PROV_MAX_CALL_SITES; // Then the call-sites out of range
+    }
+    if(clam_prov_get_latency(index, &latency) == 0 || latency.calls == 0){
+      continue;
+    }
+    dst = &text[0];
+    end = &text[sizeof(text)];
+    dst = clam_prov_put_text(dst, end, "clam-prov latency: call_site=");
+    if(index == CLAM_PROV_MAX_CALL_SITES){
+      dst = clam_prov_put_text(dst, end, "-1");
+    }else{
+      dst = clam_prov_put_decimal(dst, end, (unsigned long)index);
+    }
+    dst = clam_prov_put_text(dst, end, " calls=");
+    dst = clam_prov_put_decimal(dst, end, latency.calls);
+    dst = clam_prov_put_text(dst, end, " mean_ns=");
+    dst = clam_prov_put_decimal(dst, end, latency.total_nanos / latency.calls);
+    dst = clam_prov_put_histogram(dst, end, " (ns):", &latency.buckets[0], CLAM_PROV_LATENCY_BUCKETS);
+    clam_prov_write_stderr(&text[0], dst);
+  }
+}
+
+// Prints the stats to the standard error. Async-signal-safe
+static void clam_prov_dump_stats(){
+  clam_prov_stats stats;
+  char text[4096];
+  char *dst, *end;
+
+  clam_prov_get_stats(&stats);
+  dst = &text[0];
+  end = &text[sizeof(text)];
+  dst = clam_prov_put_text(dst, end, "clam-prov stats: pid=");
+  dst = clam_prov_put_decimal(dst, end, (unsigned long)getpid());
+  dst = clam_prov_put_text(dst, end, " records_buffered=");
+  dst = clam_prov_put_decimal(dst, end, stats.records_buffered);
+  dst = clam_prov_put_text(dst, end, " records_dropped=");
+  dst = clam_prov_put_decimal(dst, end, stats.records_dropped);
+  dst = clam_prov_put_text(dst, end, " bytes_written=");
+  dst = clam_prov_put_decimal(dst, end, stats.bytes_written);
+  dst = clam_prov_put_text(dst, end, " flushes=");
+  dst = clam_prov_put_decimal(dst, end, stats.flushes);
+  dst = clam_prov_put_text(dst, end, "\n");
+  dst = clam_prov_put_histogram(dst, end, "clam-prov flush latency (us):", &stats.flush_latency[0],
+                                CLAM_PROV_STATS_BUCKETS);
+  dst = clam_prov_put_histogram(dst, end, "clam-prov lock wait (us):", &stats.lock_wait[0], CLAM_PROV_STATS_BUCKETS);
+  clam_prov_write_stderr(&text[0], dst);
+  clam_prov_dump_latencies();
+}
+
+static void clam_prov_stats_signal_handler(int signal){
+  int saved_errno;
+
+  saved_errno = errno;
+  clam_prov_dump_stats();
+  errno = saved_errno;
+}
+
+// Turns the switches of the call-site 'call_site_id' (or of all of them with 'is_all') on or off. Async-signal-safe
+static int clam_prov_switch_sites(long call_site_id, int is_all, int enabled){
+  clam_prov_site *sites;
+  int table, total_tables, i, switched;
+
+  switched = 0;
+  total_tables = atomic_load_explicit(&clam_prov_site_table_count, memory_order_acquire);
+  for(table = 0; table < total_tables; table++){
+    sites = clam_prov_site_tables[table];
+    for(i = 0; i < clam_prov_site_table_sizes[table]; i++){
+      if(is_all == 1 || sites[i].call_site_id == call_site_id){
+        atomic_store_explicit((atomic_char *)sites[i].enabled, (char)enabled, memory_order_relaxed);
+        switched++;
+      }
+    }
+  }
+  return switched;
+}
+
+static char* clam_prov_skip_blanks(char *text){
+  while(*text == ' ' || *text == '\t' || *text == '\r'){
+    text++;
+  }
+  return text;
+}
+
+// Applies a line of the file of the site switches: '<call-site id> = <0|1>' or '* = <0|1>'. Async-signal-safe
+static void clam_prov_apply_site_line(char *line){
+  long call_site_id;
+  int is_all, is_negative, enabled;
+
+  call_site_id = 0;
+  is_all = 0;
+  line = clam_prov_skip_blanks(line);
+  if(*line == '*'){
+    is_all = 1;
+    line++;
+  }else{
+    is_negative = (*line == '-');
+    if(is_negative){
+      line++;
+    }
+    if(*line < '0' || *line > '9'){
+      return; // Comments, blank lines, and anything else
+    }
+    for(; *line >= '0' && *line <= '9'; line++){
+      call_site_id = (call_site_id * 10) + (*line - '0');
+    }
+    if(is_negative){
+      call_site_id = -call_site_id;
+    }
+  }
+  line = clam_prov_skip_blanks(line);
+  if(*line != '='){
+    return;
+  }
+  line = clam_prov_skip_blanks(line + 1);
+  if(*line != '0' && *line != '1'){
+    return;
+  }
+  enabled = *line - '0';
+  if(*clam_prov_skip_blanks(line + 1) != '\0'){
+    return;
+  }
+  clam_prov_switch_sites(call_site_id, is_all, enabled);
+}
+
+// Sets the site switches from their file, if there is one. Async-signal-safe
+static void clam_prov_load_site_switches(){
+  char chunk[4096], line[128];
+  ssize_t read_bytes, i;
+  int fd, line_length;
+
+  if(clam_prov_sites_path[0] == '\0'){
+    return;
+  }
+  fd = open(&clam_prov_sites_path[0], O_RDONLY|O_CLOEXEC);
+  if(fd < 0){
+    return;
+  }
+  line_length = 0;
+  while((read_bytes = read(fd, &chunk[0], sizeof(chunk))) != 0){
+    if(read_bytes < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      break;
+    }
+    for(i = 0; i < read_bytes; i++){
+      if(chunk[i] == '\n'){
+        line[line_length] = '\0';
+        clam_prov_apply_site_line(&line[0]);
+        line_length = 0;
+      }else if(line_length < (int)sizeof(line) - 1){
+        line[line_length++] = chunk[i]; // Longer lines are cut, and then ignored
+      }
+    }
+  }
+  line[line_length] = '\0';
+  clam_prov_apply_site_line(&line[0]);
+  close(fd);
+}
+
+static void clam_prov_site_signal_handler(int signal){
+  int saved_errno;
+
+  saved_errno = errno;
+  clam_prov_load_site_switches();
+  errno = saved_errno;
+}
+
+// Waits at most CLAM_PROV_CRASH_LOCK_MS for the buffers that other threads are writing (e.g. the flusher thread)
+static void clam_prov_crash_wait_for_writers(){
+  clam_prov_buffer *buffer;
+  struct timespec pause;
+  int waited_ms;
+
+  pause.tv_sec = 0;
+  pause.tv_nsec = 1000 * 1000;
+  waited_ms = 0;
+  buffer = atomic_load_explicit(&clam_prov_buffers, memory_order_acquire);
+  while(buffer != NULL && waited_ms <= CLAM_PROV_CRASH_LOCK_MS){
+    if(atomic_load_explicit(&buffer->record_count, memory_order_acquire) != CLAM_PROV_BUFFER_SEALED){
+      buffer = buffer->next;
+      continue;
+    }
+    nanosleep(&pause, NULL);
+    waited_ms++;
+  }
+}
+
+/*
+  Handler of the fatal signals (crash mode). The first thread to get one flushes, and the others wait for it. A thread
+  interrupted while it holds 'clam_prov_lock' doesn't flush, as the output is in the middle of a write. The handler is
+  reset to the default action when it runs (SA_RESETHAND), so the signal raised again ends the process once the handler
+  returns (a fault happens again when the instruction is retried).
+*/
+static void clam_prov_crash_signal_handler(int signal){
+  struct timespec pause;
+  int saved_errno, state, pipe_capacity;
+
+  saved_errno = errno;
+  state = 0;
+  if(atomic_compare_exchange_strong_explicit(&clam_prov_crash_state, &state, 1, memory_order_acq_rel,
+                                             memory_order_acquire)){
+    if(atomic_load_explicit(&clam_prov_logging_is_inited, memory_order_acquire) == 1 &&
+       getpid() == clam_prov_logger_pid && clam_prov_thread_holds_lock == 0){
+      clam_prov_thread_crashed = 1;
+      if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_PIPE && clam_prov_logger_output_fd > -1 &&
+         clam_prov_logger_pipe_policy == CLAM_PROV_PIPE_BLOCK){
+        // Written without waiting for the consumer, like with CLAM_PROV_PIPE_DROP, and with as much room as allowed
+        fcntl(clam_prov_logger_output_fd, F_SETPIPE_SZ, CLAM_PROV_PIPE_SIZE);
+        pipe_capacity = fcntl(clam_prov_logger_output_fd, F_GETPIPE_SZ);
+        clam_prov_pipe_capacity = pipe_capacity > 0 ? pipe_capacity : 0;
+        fcntl(clam_prov_logger_output_fd, F_SETFL, fcntl(clam_prov_logger_output_fd, F_GETFL) | O_NONBLOCK);
+      }
+      if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_AGGREGATE){
+        clam_prov_write_summary();
+      }else{
+        clam_prov_flush_full_buffers(); // Queued for the flusher thread
+        clam_prov_flush_all_buffers();
+        clam_prov_crash_wait_for_writers();
+      }
+      clam_prov_thread_crashed = 0;
+    }
+    atomic_store_explicit(&clam_prov_crash_state, 2, memory_order_release);
+  }else{
+    pause.tv_sec = 0;
+    pause.tv_nsec = 1000 * 1000;
+    while(state == 1){
+      nanosleep(&pause, NULL);
+      state = atomic_load_explicit(&clam_prov_crash_state, memory_order_acquire);
+    }
+  }
+  errno = saved_errno;
+  raise(signal);
+}
+
+// Sets the handler of the fatal signals that have their default action
+static void clam_prov_crash_install(){
+  struct sigaction action, old_action;
+  int i;
+
+  memset((void*)(&action), 0, sizeof(action));
+  action.sa_handler = &clam_prov_crash_signal_handler;
+  action.sa_flags = SA_RESETHAND | SA_ONSTACK;
+  sigfillset(&action.sa_mask);
+  atomic_store_explicit(&clam_prov_crash_state, 0, memory_order_relaxed);
+  clam_prov_crash_lock_failed = 0;
+  for(i = 0; i < CLAM_PROV_CRASH_SIGNALS; i++){
+    clam_prov_crash_handled[i] = sigaction(clam_prov_crash_signals[i], NULL, &old_action) == 0 &&
+      (old_action.sa_flags & SA_SIGINFO) == 0 && old_action.sa_handler == SIG_DFL &&
+      sigaction(clam_prov_crash_signals[i], &action, NULL) == 0;
+  }
+}
+
+// Restores the default action of the fatal signals that still have the handler
+static void clam_prov_crash_uninstall(){
+  struct sigaction action, current_action;
+  int i;
+
+  memset((void*)(&action), 0, sizeof(action));
+  action.sa_handler = SIG_DFL;
+  sigemptyset(&action.sa_mask);
+  for(i = 0; i < CLAM_PROV_CRASH_SIGNALS; i++){
+    if(clam_prov_crash_handled[i] == 1 && sigaction(clam_prov_crash_signals[i], NULL, &current_action) == 0 &&
+       (current_action.sa_flags & SA_SIGINFO) == 0 && current_action.sa_handler == &clam_prov_crash_signal_handler){
+      sigaction(clam_prov_crash_signals[i], &action, NULL);
+    }
+    clam_prov_crash_handled[i] = 0;
+  }
+}
+
+/*
+  Fork handling. The forking thread holds all the locks across 'fork' so that the child gets them in a consistent
+  state. The records in the buffers are the parent's, which writes them, so the child drops its copies. The child
+  doesn't share the output with the parent: on its first record, it opens the output file again (so that 'flock' works
+  between them, or its own file with a file per process), maps its own segments, and sets up its own io_uring engine
+  and flusher thread. Until then, it only resets the state of the parent, so that a child that doesn't log (like one
+  that calls 'exec') leaves nothing in the output.
+  The writes in flight in the io_uring engine are waited for before forking, so that the child has nothing to complete
+  in the engine it closes. The buffers of the threads that only exist in the parent are recycled.
+*/
+static atomic_int clam_prov_output_pid = 0; // The process that the output is set up for
+static int clam_prov_child_uring = 0; // The parent had an io_uring engine, so the child sets up its own
+static int clam_prov_child_flusher = 0; // The parent had a flusher thread, so the child starts its own
+static pthread_mutex_t clam_prov_child_lock = PTHREAD_MUTEX_INITIALIZER; // Setting up the output of a child. Taken first
+
+/*
+  Sets up the output of a child of 'fork' on its first record (see fork handling).
+
+  Returns 0 on failure, and 1 on success
+*/
+static int clam_prov_open_child_output(){
+  int result;
+
+  pthread_mutex_lock(&clam_prov_child_lock);
+  if(atomic_load_explicit(&clam_prov_output_pid, memory_order_relaxed) == (int)clam_prov_logger_pid){
+    pthread_mutex_unlock(&clam_prov_child_lock);
+    return 1; // Set up by another thread
+  }
+
+  clam_prov_hold_lock();
+  result = 1;
+  // The pipe is opened again without waiting so that 'flock' excludes the parent
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_FILE || clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP ||
+     clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_SHARED || clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_AGGREGATE ||
+     (clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_PIPE && clam_prov_logger_pipe_policy != CLAM_PROV_PIPE_BLOCK)){
+    result = clam_prov_open_output();
+  }
+  if(result == 1 && clam_prov_child_uring == 1){
+    clam_prov_uring_output = clam_prov_uring_open();
+  }
+  clam_prov_release_lock();
+
+  if(result == 1 && clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP){
+    clam_prov_map_functions();
+  }
+  if(result == 1 && clam_prov_child_flusher == 1){
+    clam_prov_start_flusher();
+  }
+  if(result == 1){
+    atomic_store_explicit(&clam_prov_output_pid, (int)clam_prov_logger_pid, memory_order_release);
+  }else{
+    atomic_store_explicit(&clam_prov_logging_is_inited, 0, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&clam_prov_child_lock);
+  return result;
+}
+
+static void clam_prov_atfork_prepare(){
+  pthread_mutex_lock(&clam_prov_child_lock);
+  clam_prov_hold_lock();
+  if(clam_prov_uring_output != NULL){
+    clam_prov_uring_reap(0);
+  }
+  pthread_mutex_lock(&clam_prov_sync_lock);
+  pthread_mutex_lock(&clam_prov_buffers_lock);
+}
+
+static void clam_prov_atfork_parent(){
+  pthread_mutex_unlock(&clam_prov_buffers_lock);
+  pthread_mutex_unlock(&clam_prov_sync_lock);
+  clam_prov_release_lock();
+  pthread_mutex_unlock(&clam_prov_child_lock);
+}
+
+static void clam_prov_atfork_child(){
+  clam_prov_buffer *buffer;
+  clam_prov_segment *segment, *next_segment;
+
+  clam_prov_thread_tid = (int)gettid();
+  clam_prov_logger_pid = getpid();
+  if(atomic_load_explicit(&clam_prov_logging_is_inited, memory_order_relaxed) == 0){
+    clam_prov_atfork_parent();
+    return;
+  }
+
+  clam_prov_free_buffers = NULL;
+  buffer = atomic_load_explicit(&clam_prov_buffers, memory_order_relaxed);
+  for(; buffer != NULL; buffer = buffer->next){
+    if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP){
+      // Full, so that the next record moves it to a block of the child
+      atomic_store_explicit(&buffer->record_count, buffer->max_records, memory_order_relaxed);
+    }else{
+      atomic_store_explicit(&buffer->record_count, 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&buffer->is_released, 0, memory_order_relaxed);
+    if(buffer == clam_prov_thread_buffer || buffer == clam_prov_thread_spare_buffer){
+      buffer->tid = clam_prov_thread_tid;
+    }else{
+      buffer->next_free = clam_prov_free_buffers;
+      clam_prov_free_buffers = buffer;
+    }
+  }
+  atomic_store_explicit(&clam_prov_full_buffers, NULL, memory_order_relaxed);
+  // The first record of the thread goes through the logger, which sets up the output
+  clam_prov_inline_thread_buffer = NULL;
+  clam_prov_child_flusher = atomic_exchange_explicit(&clam_prov_flusher_is_running, 0, memory_order_relaxed);
+
+  // The engine is the parent's (with nothing in flight)
+  clam_prov_child_uring = clam_prov_uring_output != NULL;
+  clam_prov_uring_close();
+
+  segment = atomic_exchange_explicit(&clam_prov_segments, NULL, memory_order_relaxed);
+  for(; segment != NULL; segment = next_segment){
+    next_segment = segment->next;
+    munmap((void*)segment->mapping, segment->mapping_length);
+    free(segment);
+  }
+
+  // Function names are written again for the process id of the child
+  memset((void*)(&clam_prov_function_written[0]), 0, CLAM_PROV_MAX_FUNCTIONS);
+  clam_prov_reset_stats(); // The stats are per process
+
+  // The executions aggregated so far are the parent's, which writes them
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_AGGREGATE){
+    clam_prov_clear_histograms();
+  }
+
+  pthread_mutex_unlock(&clam_prov_buffers_lock);
+  pthread_mutex_unlock(&clam_prov_sync_lock);
+
+  // What the parent spilled (or cut) is the parent's to write
+  clam_prov_close_spill(0);
+  clam_prov_clear_pipe_cut();
+
+  // The output is the parent's, unless it is shared (see 'clam_prov_open_child_output')
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_FILE || clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP ||
+     clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_SHARED || clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_AGGREGATE ||
+     (clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_PIPE && clam_prov_logger_pipe_policy != CLAM_PROV_PIPE_BLOCK)){
+    clam_prov_close_output();
+  }
+  clam_prov_release_lock();
+  pthread_mutex_unlock(&clam_prov_child_lock);
+}
+
+static void clam_prov_register_atfork(){
+  pthread_atfork(&clam_prov_atfork_prepare, &clam_prov_atfork_parent, &clam_prov_atfork_child);
 }
 
-static int clam_prov_logging_check_and_flush_concrete(int force){
-  int flush;
-  flush = 0;
+// User API
+
+int clam_prov_logging_check_and_flush(int force){
+  clam_prov_buffer *buffer;
 
-  if(clam_prov_logging_is_inited == 0){
+  if(atomic_load_explicit(&clam_prov_logging_is_inited, memory_order_acquire) == 0){
     return 0; // Failed to init or no init
   }
 
-  if(clam_prov_record_index == 0){
+  if(force == 1){
+    if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_AGGREGATE){
+      return clam_prov_write_summary();
+    }
+    if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP){
+      // Records are already in the output. Only syncing is left
+      if(clam_prov_logger_durability != CLAM_PROV_DURABILITY_PERIODIC){
+        clam_prov_sync_segments();
+      }
+      return 1;
+    }
+    return clam_prov_flush_all_buffers();
+  }
+
+  // Buffers that don't fill up are flushed by the flusher thread if there is a flush interval
+  buffer = clam_prov_thread_buffer;
+  if(buffer == NULL){
     return 1; // nothing to flush
   }
+  return clam_prov_hand_off_buffer(buffer);
+}
 
-  if(force == 1){
-    flush = 1;
-  }else if(clam_prov_record_index >= clam_prov_max_records){
-    flush = 1;
-  }// TIME check, too TODO
-
-  if(flush == 1){
-    int total_records;
-    int dst_buffer_size;
-    char *dst;
-    int written_bytes;
-
-    total_records = clam_prov_record_index;
-    dst_buffer_size = get_dst_buffer_size(total_records);
-    dst = alloc_dst_buffer(dst_buffer_size);
-    if(dst != NULL){
-      copy_records_to_dst_buffer(dst, total_records);
-      flock(clam_prov_logger_output_fd, LOCK_EX);
-      written_bytes = write(clam_prov_logger_output_fd, (void*)(dst), dst_buffer_size);
-      if(written_bytes > 0){
-        fsync(clam_prov_logger_output_fd);
+static int clam_prov_logging_buffer_concrete(long call_site_id, long exit_value, long size, char *function_name){
+  clam_prov_buffer *buffer;
+  int record_index;
+  int function_id;
+  unsigned long weight;
+
+  if(atomic_load_explicit(&clam_prov_logging_is_inited, memory_order_acquire) == 0){
+    return 0; // Failed to init or no init
+  }
+  if(atomic_load_explicit(&clam_prov_output_pid, memory_order_acquire) != (int)clam_prov_logger_pid &&
+     clam_prov_open_child_output() == 0){
+    return 0; // The first record of a child of 'fork', which failed to open the output
+  }
+
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_AGGREGATE){
+    function_id = clam_prov_intern_function_name(function_name);
+    if(function_id < 0){
+      return 0; // Invalid function name or too many functions
+    }
+    return clam_prov_aggregate(call_site_id, exit_value, function_id);
+  }
+
+  weight = 1;
+  if(clam_prov_logger_sampling != CLAM_PROV_SAMPLING_NONE){
+    weight = clam_prov_sample(call_site_id);
+    if(weight == 0){
+      return 1; // Not sampled
+    }
+  }
+
+  if(clam_prov_thread_tid == -1){
+    clam_prov_thread_tid = (int)gettid();
+  }
+
+  function_id = clam_prov_intern_function_name(function_name);
+  if(function_id < 0){
+    return 0; // Invalid function name or too many functions
+  }
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP &&
+     atomic_load_explicit(&clam_prov_function_written[function_id], memory_order_relaxed) == 0){
+    clam_prov_map_function(function_id);
+  }
+
+  if(clam_prov_thread_buffer == NULL){
+    if(clam_prov_acquire_thread_buffer() == NULL){
+      atomic_fetch_add_explicit(&clam_prov_logger_profile_records_dropped, 1, memory_order_relaxed);
+      return 0; // Failed to allocate memory for the buffer
+    }
+  }
+
+  while(1){
+    buffer = clam_prov_thread_buffer;
+    record_index = atomic_load_explicit(&buffer->record_count, memory_order_relaxed);
+    if(record_index == CLAM_PROV_BUFFER_SEALED){
+      sched_yield(); // Being flushed by another thread
+      continue;
+    }
+    if(record_index >= buffer->max_records){
+      if(clam_prov_hand_off_buffer(buffer) == 0 &&
+         atomic_load_explicit(&buffer->record_count, memory_order_relaxed) >= buffer->max_records){
+        if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_SHM){
+          if(clam_prov_ring_has_consumer(clam_prov_ring_output)){
+            sched_yield(); // Wait for the consumer to make room
+            continue;
+          }
+          atomic_fetch_add_explicit(&clam_prov_ring_output->header->dropped, 1, memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&clam_prov_logger_profile_records_dropped, 1, memory_order_relaxed);
+        return 0; // No space for the record
       }
-      flock(clam_prov_logger_output_fd, LOCK_UN);
-      free_dst_buffer(dst);
+      continue;
     }
 
-    clam_prov_record_index = 0;
-    if(dst_buffer_size != written_bytes){
-      // something went wrong TODO
-      return 0;
+    struct clam_prov_record *clam_prov_record_instance;
+    clam_prov_record_instance = &buffer->records[record_index];
+    clam_prov_record_instance->pid = buffer->tid;
+    clam_prov_record_instance->call_site_id = call_site_id;
+    clam_prov_record_instance->exit = exit_value;
+    clam_prov_record_instance->weight = weight;
+    clam_prov_record_instance->size = size;
+
+    clam_prov_record_instance->function_id = function_id;
+
+    // In the memory-mapped output, a record with a time is complete
+    atomic_signal_fence(memory_order_release);
+    clam_prov_record_instance->time = clam_prov_clock_read();
+
+    // Fails only if the buffer got sealed by a flush since it was read. Then the record is written again.
+    if(atomic_compare_exchange_strong_explicit(&buffer->record_count, &record_index, record_index + 1,
+                                               memory_order_release, memory_order_relaxed)){
+      return 1;
     }
   }
+}
+
+int clam_prov_logging_get_stats(clam_prov_stats *stats){
+  if(stats == NULL){
+    return 0;
+  }
+  clam_prov_get_stats(stats);
   return 1;
 }
 
-int clam_prov_logging_check_and_flush(int force){
-  int result;
+int clam_prov_logging_get_latency(long call_site_id, clam_prov_latency *latency){
+  if(latency == NULL || (call_site_id < -1 || call_site_id >= CLAM_PROV_MAX_CALL_SITES)){
+    return 0;
+  }
+  return clam_prov_get_latency(call_site_id == -1 ? CLAM_PROV_MAX_CALL_SITES : call_site_id, latency);
+}
 
-  pthread_mutex_lock(&clam_prov_lock);
-  result = clam_prov_logging_check_and_flush_concrete(force);
-  pthread_mutex_unlock(&clam_prov_lock);
+int clam_prov_log_latency(long call_site_id, unsigned long nanoseconds){
+  clam_prov_latency_histogram *histogram;
+  long index;
+  int bucket;
 
-  return result;
+  if(atomic_load_explicit(&clam_prov_logging_is_inited, memory_order_relaxed) == 0){
+    return 0; // Failed to init, or no init
+  }
+  index = (call_site_id < 0 || call_site_id >= CLAM_PROV_MAX_CALL_SITES) ? CLAM_PROV_MAX_CALL_SITES : call_site_id;
+  histogram = atomic_load_explicit(&clam_prov_latencies[index], memory_order_acquire);
+  if(histogram == NULL){
+    histogram = clam_prov_alloc_latency(index);
+    if(histogram == NULL){
+      return 0; // Failed to allocate memory for the histogram
+    }
+  }
+  bucket = nanoseconds == 0 ? 0 : 64 - __builtin_clzl(nanoseconds);
+  bucket = bucket < CLAM_PROV_LATENCY_BUCKETS ? bucket : CLAM_PROV_LATENCY_BUCKETS - 1;
+  atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->total_nanos, nanoseconds, memory_order_relaxed);
+  return 1;
 }
 
-static int clam_prov_logging_buffer_concrete(long call_site_id, long exit_value, char *function_name){
-  if(clam_prov_logging_is_inited == 0){
-    return 0; // Failed to init or no init
-  }
+int clam_prov_logging_set_sampling(long call_site_id, int sampling, long sampling_parameter){
+  clam_prov_call_site *call_site;
 
-  if(clam_prov_thread_tid == -1){
-    clam_prov_thread_tid = (int)gettid();
+  if(atomic_load_explicit(&clam_prov_logging_is_inited, memory_order_acquire) == 0 ||
+     clam_prov_logger_sampling == CLAM_PROV_SAMPLING_NONE){
+    return 0; // Failed to init, no init, or no sampling
   }
+  if(call_site_id < 0 || call_site_id >= CLAM_PROV_MAX_CALL_SITES){
+    return 0; // Invalid call-site id
+  }
+  if((sampling != CLAM_PROV_SAMPLING_NONE && sampling != CLAM_PROV_SAMPLING_FIXED &&
+      sampling != CLAM_PROV_SAMPLING_TOKEN_BUCKET) || (sampling != CLAM_PROV_SAMPLING_NONE && sampling_parameter < 1)){
+    return 0; // Invalid sampling. The adaptive sampling is for all the call-sites
+  }
+
+  call_site = &clam_prov_call_sites[call_site_id];
+  atomic_store_explicit(&call_site->parameter, sampling_parameter, memory_order_relaxed);
+  atomic_store_explicit(&call_site->sampling, sampling + 1, memory_order_release);
+  return 1;
+}
 
-  struct clam_prov_record *clam_prov_record_instance;
-  clam_prov_record_instance = &clam_prov_records[clam_prov_record_index];
-  clam_prov_record_instance->time = get_current_milliseconds();
-  clam_prov_record_instance->pid = clam_prov_thread_tid;
-  clam_prov_record_instance->call_site_id = call_site_id;
-  clam_prov_record_instance->exit = exit_value;
+int clam_prov_logging_register_sites(clam_prov_site *sites, int total_sites){
+  int table;
 
-  if(copy_function_name(&clam_prov_record_instance->function_name[0], function_name) == NULL){
-    return 0; // Failed to allocate memory for function name
+  if(sites == NULL || total_sites < 0){
+    return 0;
   }
-
-  clam_prov_record_index++;
+  clam_prov_hold_lock();
+  table = atomic_load_explicit(&clam_prov_site_table_count, memory_order_relaxed);
+  if(table == CLAM_PROV_MAX_SITE_TABLES){
+    clam_prov_release_lock();
+    return 0; // No space for the table
+  }
+  clam_prov_site_tables[table] = sites;
+  clam_prov_site_table_sizes[table] = total_sites;
+  atomic_store_explicit(&clam_prov_site_table_count, table + 1, memory_order_release);
+  clam_prov_release_lock();
   return 1;
 }
 
+int clam_prov_logging_enable_site(long call_site_id, int enabled){
+  if(enabled != 0 && enabled != 1){
+    return 0; // Invalid switch
+  }
+  return clam_prov_switch_sites(call_site_id, 0, enabled) > 0 ? 1 : 0;
+}
+
 int clam_prov_logging_buffer(int control, ...){
   int result;
   long call_site_id, exit_value;
@@ -340,90 +4397,581 @@ int clam_prov_logging_buffer(int control, ...){
 
   va_end(args);
 
-  pthread_mutex_lock(&clam_prov_lock);
-  result = clam_prov_logging_buffer_concrete(call_site_id, exit_value, function_name);
-  pthread_mutex_unlock(&clam_prov_lock);
+  result = clam_prov_logging_buffer_concrete(call_site_id, exit_value, -1, function_name);
+
+  clam_prov_logging_check_and_flush(0);
+
+  return result;
+
+}
+
+int clam_prov_log_i64(long call_site_id, long exit_value, char *function_name){
+  int result = clam_prov_logging_buffer_concrete(call_site_id, exit_value, -1, function_name);
+  clam_prov_logging_check_and_flush(0);
+  return result;
+}
+
+int clam_prov_log_ptr(long call_site_id, void *exit_value, char *function_name){
+  int result = clam_prov_logging_buffer_concrete(call_site_id, (long)exit_value, -1, function_name);
+  clam_prov_logging_check_and_flush(0);
+  return result;
+}
+
+int clam_prov_log_void(long call_site_id, char *function_name){
+  int result = clam_prov_logging_buffer_concrete(call_site_id, 0, -1, function_name);
+  clam_prov_logging_check_and_flush(0);
+  return result;
+}
+
+int clam_prov_log_size(long call_site_id, long exit_value, long size, char *function_name){
+  int result = clam_prov_logging_buffer_concrete(call_site_id, exit_value, size, function_name);
+  clam_prov_logging_check_and_flush(0);
+  return result;
+}
 
+int clam_prov_log_slow(long call_site_id, long exit_value, long size, char *function_name, int *function_id){
+  int result = clam_prov_logging_buffer_concrete(call_site_id, exit_value, size, function_name);
   clam_prov_logging_check_and_flush(0);
+  if(result == 0){
+    return result;
+  }
 
+  // The name is interned by now
+  atomic_store_explicit((atomic_int *)function_id, clam_prov_intern_function_name(function_name) + 1,
+                        memory_order_relaxed);
+  clam_prov_set_thread_buffer(clam_prov_thread_buffer);
   return result;
+}
+
+// An argument of the initialization that can be overridden (see CLAM_PROV_ENV_CONFIG)
+typedef struct clam_prov_setting{
+  const char *key;            // As in the configuration of AddLogging
+  int *value;
+  long *long_value;           // Instead of 'value' for the 'long' arguments
+  char *text_value;           // Instead of 'value' for the paths (of CLAM_PROV_PATH_LENGTH)
+} clam_prov_setting;
+
+// Strips the white space around 'text' in place
+static char* clam_prov_trim(char *text){
+  char *end;
+
+  while(isspace((unsigned char)*text)){
+    text++;
+  }
+  end = text + strlen(text);
+  while(end > text && isspace((unsigned char)*(end - 1))){
+    end--;
+  }
+  *end = '\0';
+  return text;
+}
+
+/*
+  Sets the setting of 'key' in 'settings' to 'text'. Keys that are not in 'settings' are ignored, since the
+  configuration of AddLogging has keys that only apply when instrumenting.
+
+  Returns 0 if 'text' is not a valid value
+*/
+static int clam_prov_apply_setting(clam_prov_setting *settings, int total_settings, const char *key, const char *text){
+  char *end;
+  long value;
+  int i;
+
+  for(i = 0; i < total_settings; i++){
+    if(strcmp(settings[i].key, key) == 0){
+      break;
+    }
+  }
+  if(i == total_settings){
+    return 1;
+  }
+  if(settings[i].text_value != NULL){
+    if(strlen(text) >= CLAM_PROV_PATH_LENGTH){
+      return 0;
+    }
+    strcpy(settings[i].text_value, text);
+    return 1;
+  }
+  errno = 0;
+  value = strtol(text, &end, 10);
+  if(errno != 0 || end == text || *end != '\0'){
+    return 0;
+  }
+  if(settings[i].long_value != NULL){
+    *settings[i].long_value = value;
+  }else if(value >= INT_MIN && value <= INT_MAX){
+    *settings[i].value = (int)value;
+  }else{
+    return 0;
+  }
+  return 1;
+}
+
+/*
+  Overrides 'settings' with the file in CLAM_PROV_ENV_CONFIG, and then with the environment variables
+  CLAM_PROV_ENV_PREFIX followed by the keys in upper case.
+
+  Returns 0 if the file can't be read, or if a value is not valid
+*/
+static int clam_prov_load_settings(clam_prov_setting *settings, int total_settings){
+  char line[CLAM_PROV_PATH_LENGTH + 64];
+  char name[64];
+  char *path, *key, *value;
+  FILE *file;
+  int i, j, result;
+
+  result = 1;
+  path = secure_getenv(CLAM_PROV_ENV_CONFIG);
+  if(path != NULL && path[0] != '\0'){
+    file = fopen(path, "r");
+    if(file == NULL){
+      return 0;
+    }
+    while(result == 1 && fgets(&line[0], sizeof(line), file) != NULL){
+      key = clam_prov_trim(&line[0]);
+      value = strchr(key, '=');
+      if(key[0] == '#' || value == NULL){
+        continue; // Comments and blank lines
+      }
+      *value = '\0';
+      result = clam_prov_apply_setting(settings, total_settings, clam_prov_trim(key), clam_prov_trim(value + 1));
+    }
+    fclose(file);
+  }
 
+  for(i = 0; result == 1 && i < total_settings; i++){
+    snprintf(&name[0], sizeof(name), "%s%s", CLAM_PROV_ENV_PREFIX, settings[i].key);
+    for(j = 0; name[j] != '\0'; j++){
+      name[j] = (char)toupper((unsigned char)name[j]);
+    }
+    value = secure_getenv(&name[0]);
+    if(value != NULL){
+      result = clam_prov_apply_setting(settings, total_settings, settings[i].key, clam_prov_trim(value));
+    }
+  }
+  return result;
 }
 
-static int clam_prov_logging_init_concrete(int max_records, int output_mode){
-  int success;
-  success = 0;
+static int clam_prov_logging_init_concrete(int max_records, int output_mode, int log_format, int flush_mode,
+                                           int flush_interval_ms, int durability, int durability_interval_ms,
+                                           int io_engine, int per_process, int sampling, long sampling_parameter,
+                                           int stats_dump, int stats_signal, int pipe_policy,
+                                           int rotate_size_mb, int clock, int crash_flush, int site_signal,
+                                           int inline_clock, char *output_path){
+  struct sigaction action;
 
-  if(clam_prov_logging_is_inited == 1){
+  if(atomic_load_explicit(&clam_prov_logging_is_inited, memory_order_relaxed) == 1){
     return 0; // Already initialized
   }
 
+  if(max_records < 1){
+    return 0; // Invalid max records
+  }
+  if(log_format != CLAM_PROV_LOG_FORMAT_V1 && log_format != CLAM_PROV_LOG_FORMAT_V2 &&
+     log_format != CLAM_PROV_LOG_FORMAT_V3){
+    return 0; // Invalid log format
+  }
+  if(output_mode == CLAM_PROV_OUTPUT_SHARED && log_format == CLAM_PROV_LOG_FORMAT_V1){
+    return 0; // The shared file output is made of blocks
+  }
+  if(flush_mode != CLAM_PROV_FLUSH_SYNC && flush_mode != CLAM_PROV_FLUSH_ASYNC){
+    return 0; // Invalid flush mode
+  }
+  if(flush_interval_ms < 0){
+    return 0; // Invalid flush interval
+  }
+  if(durability < CLAM_PROV_DURABILITY_NONE || durability > CLAM_PROV_DURABILITY_GROUP){
+    return 0; // Invalid durability
+  }
+  if(durability == CLAM_PROV_DURABILITY_PERIODIC && durability_interval_ms < 1){
+    return 0; // Invalid durability interval
+  }
+  if(io_engine != CLAM_PROV_IO_ENGINE_BLOCKING && io_engine != CLAM_PROV_IO_ENGINE_URING){
+    return 0; // Invalid io engine
+  }
+  if(per_process != 0 && per_process != 1){
+    return 0; // Invalid per process
+  }
+  if(sampling < CLAM_PROV_SAMPLING_NONE || sampling > CLAM_PROV_SAMPLING_ADAPTIVE ||
+     (sampling != CLAM_PROV_SAMPLING_NONE && sampling_parameter < 1)){
+    return 0; // Invalid sampling
+  }
+  if((stats_dump != 0 && stats_dump != 1) || stats_signal < 0 || stats_signal >= NSIG || stats_signal == SIGKILL ||
+     stats_signal == SIGSTOP){
+    return 0; // Invalid stats
+  }
+  if(pipe_policy < CLAM_PROV_PIPE_BLOCK || pipe_policy > CLAM_PROV_PIPE_SPILL){
+    return 0; // Invalid pipe policy
+  }
+  if(rotate_size_mb < 0){
+    return 0; // Invalid rotate size
+  }
+  if(clock < CLAM_PROV_CLOCK_REALTIME || clock > CLAM_PROV_CLOCK_TSC){
+    return 0; // Invalid clock
+  }
+  if(crash_flush != 0 && crash_flush != 1){
+    return 0; // Invalid crash flush
+  }
+  if(site_signal < 0 || site_signal >= NSIG || site_signal == SIGKILL || site_signal == SIGSTOP ||
+     (site_signal > 0 && site_signal == stats_signal)){
+    return 0; // Invalid site signal
+  }
+  if(output_mode == CLAM_PROV_OUTPUT_MMAP || output_mode == CLAM_PROV_OUTPUT_AGGREGATE){
+    clock = CLAM_PROV_CLOCK_REALTIME; // Records are not written (and converted) after they are inserted
+  }
+  if(clock == CLAM_PROV_CLOCK_TSC && clam_prov_clock_is_invariant() == 0){
+    // The counters of the CPUs may drift apart. The records appended inline then go through the logger
+    clock = CLAM_PROV_CLOCK_COARSE;
+  }
+  if(clock == CLAM_PROV_CLOCK_TSC && clam_prov_clock_calibrate() == 0){
+    return 0; // No time-stamp counter
+  }
+  if(output_mode == CLAM_PROV_OUTPUT_MMAP &&
+     (unsigned long)max_records * sizeof(clam_prov_record) > 0xFFFFFFFFUL - (4 * CLAM_PROV_SIZE_BLOCK_HEADER)){
+    return 0; // Sizes in block headers are 32 bits
+  }
+  if(atomic_load_explicit(&clam_prov_buffers, memory_order_relaxed) != NULL &&
+     (output_mode == CLAM_PROV_OUTPUT_MMAP) != (clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP)){
+    return 0; // The records of existing buffers are either in memory or in the output
+  }
+
   clam_prov_max_records = max_records;
-  if(clam_prov_alloc_records() == 1){
-    clam_prov_logger_output_mode = output_mode;
-    if(clam_prov_open_output() == 1){
-      success = 1;
+  clam_prov_logger_log_format = log_format;
+  clam_prov_logger_flush_mode = flush_mode;
+  clam_prov_logger_flush_interval_ms = flush_interval_ms;
+  clam_prov_logger_durability = durability;
+  clam_prov_logger_durability_interval_ms = durability_interval_ms;
+  clam_prov_logger_per_process = per_process;
+  clam_prov_logger_sampling = sampling;
+  clam_prov_logger_sampling_parameter = sampling_parameter;
+  clam_prov_logger_pipe_policy = pipe_policy;
+  clam_prov_logger_rotate_size_mb = rotate_size_mb;
+  clam_prov_logger_clock = clock;
+  clam_prov_inline_clock = inline_clock;
+  clam_prov_logger_crash_flush = crash_flush;
+  strcpy(&clam_prov_logger_path_setting[0], output_path);
+  clam_prov_logger_pid = getpid();
+  atomic_store_explicit(&clam_prov_adaptive_rate, 1, memory_order_relaxed);
+  atomic_store_explicit(&clam_prov_adaptive_interval_start, get_monotonic_milliseconds(), memory_order_relaxed);
+  memset((void*)(&clam_prov_function_written[0]), 0, CLAM_PROV_MAX_FUNCTIONS); // New output
+  clam_prov_logger_output_mode = output_mode;
+  if(output_mode == CLAM_PROV_OUTPUT_MMAP){
+    // Records are written in place so there is nothing to hand off or to flush periodically
+    clam_prov_logger_flush_mode = CLAM_PROV_FLUSH_SYNC;
+    clam_prov_logger_flush_interval_ms = 0;
+  }else if(output_mode == CLAM_PROV_OUTPUT_SHM){
+    // Records go to the ring as they are inserted. Only the ones that didn't fit are left in buffers
+    clam_prov_logger_flush_mode = CLAM_PROV_FLUSH_SYNC;
+  }else if(output_mode == CLAM_PROV_OUTPUT_AGGREGATE){
+    // There are no records, and every execution is counted. The flush interval is the interval of the summaries
+    clam_prov_logger_flush_mode = CLAM_PROV_FLUSH_SYNC;
+    clam_prov_logger_sampling = CLAM_PROV_SAMPLING_NONE;
+    clam_prov_clear_histograms();
+  }
+  if(clam_prov_open_output() == 0){
+    clam_prov_close_output();
+    return 0;
+  }
+  atomic_store_explicit(&clam_prov_output_pid, (int)clam_prov_logger_pid, memory_order_relaxed);
+  if(output_mode == CLAM_PROV_OUTPUT_MMAP){
+    clam_prov_map_functions();
+  }
+  // A rotation is checked under 'flock' before each write, which the io_uring engine doesn't take
+  if(output_mode == CLAM_PROV_OUTPUT_FILE && io_engine == CLAM_PROV_IO_ENGINE_URING && rotate_size_mb == 0){
+    clam_prov_uring_output = clam_prov_uring_open(); // Writes block if io_uring is not available
+  }
+  if((clam_prov_logger_flush_mode == CLAM_PROV_FLUSH_ASYNC || clam_prov_logger_flush_interval_ms > 0 ||
+      durability == CLAM_PROV_DURABILITY_PERIODIC) && clam_prov_start_flusher() == 0){
+    clam_prov_uring_close();
+    clam_prov_close_output();
+    return 0;
+  }
+
+  clam_prov_reset_stats();
+  clam_prov_logger_profile_dump = stats_dump;
+  clam_prov_logger_profile_signal = 0;
+  if(stats_signal > 0){
+    memset((void*)(&action), 0, sizeof(action));
+    action.sa_handler = &clam_prov_stats_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(stats_signal, &action, &clam_prov_logger_profile_old_action) == 0){
+      clam_prov_logger_profile_signal = stats_signal;
     }
   }
 
-  if(success == 0){
-    clam_prov_do_cleanup();
-    clam_prov_logging_is_inited = 0;
-    return 0;
-  }else{
-    clam_prov_logging_is_inited = 1;
-    return 1;
+  if(create_home_path(&clam_prov_sites_path[0], CLAM_PROV_PATH_NAME_SITES_FILE, 0) == NULL){
+    clam_prov_sites_path[0] = '\0';
+  }
+  clam_prov_load_site_switches();
+  clam_prov_logger_site_signal = 0;
+  if(site_signal > 0){
+    memset((void*)(&action), 0, sizeof(action));
+    action.sa_handler = &clam_prov_site_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(site_signal, &action, &clam_prov_logger_site_old_action) == 0){
+      clam_prov_logger_site_signal = site_signal;
+    }
+  }
+
+  if(crash_flush == 1){
+    clam_prov_crash_install();
   }
+
+  pthread_once(&clam_prov_atfork_once, &clam_prov_register_atfork);
+
+  atomic_store_explicit(&clam_prov_logging_is_inited, 1, memory_order_release);
+  return 1;
 }
 
 int clam_prov_logging_init(int control, ...){
-  int result, max_records, output_mode;
+  int result, max_records, output_mode, log_format, flush_mode, flush_interval_ms, durability, durability_interval_ms;
+  int io_engine, per_process, sampling, stats_dump, stats_signal, pipe_policy, rotate_size_mb, clock, crash_flush;
+  int site_signal, inline_clock;
+  long sampling_parameter;
+  char output_path[CLAM_PROV_PATH_LENGTH];
+  clam_prov_setting settings[] = {
+    {"max_records", &max_records, NULL, NULL},
+    {"output_mode", &output_mode, NULL, NULL},
+    {"log_format", &log_format, NULL, NULL},
+    {"flush_mode", &flush_mode, NULL, NULL},
+    {"flush_interval_ms", &flush_interval_ms, NULL, NULL},
+    {"durability", &durability, NULL, NULL},
+    {"durability_interval_ms", &durability_interval_ms, NULL, NULL},
+    {"io_engine", &io_engine, NULL, NULL},
+    {"per_process_files", &per_process, NULL, NULL},
+    {"sampling", &sampling, NULL, NULL},
+    {"sampling_parameter", NULL, &sampling_parameter, NULL},
+    {"stats_dump", &stats_dump, NULL, NULL},
+    {"stats_signal", &stats_signal, NULL, NULL},
+    {"pipe_policy", &pipe_policy, NULL, NULL},
+    {"rotate_size_mb", &rotate_size_mb, NULL, NULL},
+    {"clock", &clock, NULL, NULL},
+    {"crash_flush", &crash_flush, NULL, NULL},
+    {"site_signal", &site_signal, NULL, NULL},
+    {"output_path", NULL, NULL, &output_path[0]}
+  };
 
   va_list args;
   va_start(args, control);
 
   max_records = va_arg(args, int);
   output_mode = va_arg(args, int);
+  log_format = CLAM_PROV_LOG_FORMAT_V1;
+  flush_mode = CLAM_PROV_FLUSH_SYNC;
+  flush_interval_ms = 0;
+  durability = CLAM_PROV_DURABILITY_FLUSH;
+  durability_interval_ms = 0;
+  io_engine = CLAM_PROV_IO_ENGINE_BLOCKING;
+  per_process = 0;
+  sampling = CLAM_PROV_SAMPLING_NONE;
+  sampling_parameter = 0;
+  stats_dump = 0;
+  stats_signal = 0;
+  pipe_policy = CLAM_PROV_PIPE_BLOCK;
+  rotate_size_mb = 0;
+  clock = CLAM_PROV_CLOCK_REALTIME;
+  crash_flush = 0;
+  site_signal = 0;
+  if(control >= 3){
+    log_format = va_arg(args, int);
+  }
+  if(control >= 4){
+    flush_mode = va_arg(args, int);
+  }
+  if(control >= 5){
+    flush_interval_ms = va_arg(args, int);
+  }
+  if(control >= 6){
+    durability = va_arg(args, int);
+  }
+  if(control >= 7){
+    durability_interval_ms = va_arg(args, int);
+  }
+  if(control >= 8){
+    io_engine = va_arg(args, int);
+  }
+  if(control >= 9){
+    per_process = va_arg(args, int);
+  }
+  if(control >= 10){
+    sampling = va_arg(args, int);
+  }
+  if(control >= 11){
+    sampling_parameter = va_arg(args, long);
+  }
+  if(control >= 12){
+    stats_dump = va_arg(args, int);
+  }
+  if(control >= 13){
+    stats_signal = va_arg(args, int);
+  }
+  if(control >= 14){
+    pipe_policy = va_arg(args, int);
+  }
+  if(control >= 15){
+    rotate_size_mb = va_arg(args, int);
+  }
+  if(control >= 16){
+    clock = va_arg(args, int);
+  }
+  if(control >= 17){
+    crash_flush = va_arg(args, int);
+  }
+  if(control >= 18){
+    site_signal = va_arg(args, int);
+  }
 
   va_end(args);
 
-  if (pthread_mutex_init(&clam_prov_lock, NULL) != 0) {
-    return 0; // Failed to init mutex
+  // The inline code of AddLogging reads the clock of the arguments (CLAM_PROV_CLOCK_REALTIME in the memory-mapped output)
+  inline_clock = output_mode == CLAM_PROV_OUTPUT_MMAP ? CLAM_PROV_CLOCK_REALTIME : clock;
+  output_path[0] = '\0';
+  if(clam_prov_load_settings(&settings[0], (int)(sizeof(settings) / sizeof(settings[0]))) == 0){
+    return 0; // Invalid override
   }
 
-  clam_prov_lock_is_inited = 1;
-
-  pthread_mutex_lock(&clam_prov_lock);
-  result = clam_prov_logging_init_concrete(max_records, output_mode);
-  pthread_mutex_unlock(&clam_prov_lock);
+  clam_prov_hold_lock();
+  result = clam_prov_logging_init_concrete(max_records, output_mode, log_format, flush_mode, flush_interval_ms,
+                                          durability, durability_interval_ms, io_engine, per_process, sampling,
+                                          sampling_parameter, stats_dump, stats_signal, pipe_policy,
+                                          rotate_size_mb, clock, crash_flush, site_signal, inline_clock,
+                                          &output_path[0]);
+  clam_prov_release_lock();
 
   return result;
 }
 
 static int clam_prov_logging_shutdown_concrete(){
-  if(clam_prov_logging_is_inited == 0){
+  int was_inited;
+
+  if(getpid() != clam_prov_logger_pid){
+    return 0; // A child of 'vfork' (or not initialized)
+  }
+
+  // Stop accepting records before the final flush
+  clam_prov_hold_lock();
+  was_inited = atomic_exchange_explicit(&clam_prov_logging_is_inited, 0, memory_order_acq_rel);
+  clam_prov_release_lock();
+
+  if(was_inited == 0){
     return 0; // Not initialized
   }
 
-  clam_prov_logging_check_and_flush(1);
+  clam_prov_stop_flusher();
+  clam_prov_flush_all_buffers();
+  clam_prov_uring_drain();
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP){
+    clam_prov_sync_segments();
+  }else if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_SHM){
+    while(clam_prov_flush_all_buffers() == 0 && clam_prov_ring_has_consumer(clam_prov_ring_output)){
+      sched_yield(); // Wait for the consumer to make room
+    }
+    clam_prov_ring_drop_buffers();
+  }else{
+    if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_AGGREGATE){
+      clam_prov_write_summary();
+    }
+    clam_prov_replay_output(CLAM_PROV_PIPE_CUT_WAIT_MS);
+    clam_prov_sync_output(atomic_load_explicit(&clam_prov_written_sequence, memory_order_relaxed));
+  }
 
-  clam_prov_do_cleanup();
+  clam_prov_hold_lock();
+  if(clam_prov_logger_output_mode == CLAM_PROV_OUTPUT_MMAP){
+    clam_prov_trim_segment();
+  }
+  clam_prov_close_spill(1);
+  clam_prov_clear_pipe_cut();
+  clam_prov_close_output();
+  clam_prov_release_lock();
 
-  clam_prov_logging_is_inited = 0;
+  if(clam_prov_logger_profile_signal > 0){
+    sigaction(clam_prov_logger_profile_signal, &clam_prov_logger_profile_old_action, NULL);
+    clam_prov_logger_profile_signal = 0;
+  }
+  if(clam_prov_logger_site_signal > 0){
+    sigaction(clam_prov_logger_site_signal, &clam_prov_logger_site_old_action, NULL);
+    clam_prov_logger_site_signal = 0;
+  }
+  if(clam_prov_logger_crash_flush == 1){
+    clam_prov_crash_uninstall();
+  }
+  if(clam_prov_logger_profile_dump == 1){
+    clam_prov_dump_stats();
+  }
   return 1;
 }
 
 int clam_prov_logging_shutdown(int control, ...){
-  int result;
+  return clam_prov_logging_shutdown_concrete();
+}
 
-  pthread_mutex_lock(&clam_prov_lock);
-  result = clam_prov_logging_shutdown_concrete();
-  pthread_mutex_unlock(&clam_prov_lock);
+// Shuts down at exit if the program didn't (or when the logger is unloaded). Destructors run after the handlers of
+// 'atexit', so the records of threads that outlive 'main' and of the handlers are written
+__attribute__((destructor)) static void clam_prov_logging_fini(){
+  clam_prov_logging_shutdown_concrete();
+}
 
-  if (clam_prov_lock_is_inited == 1) {
-    clam_prov_lock_is_inited = 0;
-    pthread_mutex_destroy(&clam_prov_lock);
+// Consumer API
+
+clam_prov_ring* clam_prov_ring_open(){
+  clam_prov_ring *ring;
+
+  ring = clam_prov_ring_attach_concrete(1);
+  if(ring != NULL){
+    atomic_store_explicit(&ring->header->consumer_pid, (int)getpid(), memory_order_relaxed);
   }
+  return ring;
+}
 
-  return result;
+const clam_prov_record* clam_prov_ring_peek(clam_prov_ring *ring){
+  clam_prov_ring_slot *slot;
+  unsigned long position;
+
+  position = atomic_load_explicit(&ring->header->head, memory_order_relaxed);
+  slot = &ring->slots[position & (CLAM_PROV_SHM_CAPACITY - 1)];
+  if(atomic_load_explicit(&slot->sequence, memory_order_acquire) != position + 1){
+    return NULL; // Empty, or the record is still being written
+  }
+  return &slot->record;
+}
+
+void clam_prov_ring_release(clam_prov_ring *ring){
+  clam_prov_ring_slot *slot;
+  unsigned long position;
+
+  position = atomic_load_explicit(&ring->header->head, memory_order_relaxed);
+  slot = &ring->slots[position & (CLAM_PROV_SHM_CAPACITY - 1)];
+  if(atomic_load_explicit(&slot->sequence, memory_order_acquire) != position + 1){
+    return; // Nothing to release
+  }
+  atomic_store_explicit(&ring->header->head, position + 1, memory_order_relaxed);
+  atomic_store_explicit(&slot->sequence, position + CLAM_PROV_SHM_CAPACITY, memory_order_release);
+}
+
+const char* clam_prov_ring_function_name(clam_prov_ring *ring, int function_id){
+  if(function_id < 0 || function_id >= CLAM_PROV_MAX_FUNCTIONS ||
+     atomic_load_explicit(&ring->functions[function_id].state, memory_order_acquire) != CLAM_PROV_SHM_FUNCTION_WRITTEN){
+    return NULL;
+  }
+  return &ring->functions[function_id].name[0];
+}
+
+unsigned long clam_prov_ring_dropped(clam_prov_ring *ring){
+  return atomic_load_explicit(&ring->header->dropped, memory_order_relaxed);
+}
+
+void clam_prov_ring_close(clam_prov_ring *ring){
+  int consumer_pid;
+
+  if(ring == NULL){
+    return;
+  }
+  consumer_pid = (int)getpid();
+  atomic_compare_exchange_strong_explicit(&ring->header->consumer_pid, &consumer_pid, 0,
+                                          memory_order_relaxed, memory_order_relaxed);
+  munmap((void*)ring->header, ring->size);
+  close(ring->fd); // Also releases the lock of the consumer
+  free(ring);
 }
@@ -12,36 +12,267 @@
 #include <time.h>
 #include <sys/mman.h>
 #include <sys/file.h>
+#include <sys/uio.h>
 #include <pwd.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdatomic.h>
 
 // Constants
 #define CLAM_PROV_OUTPUT_FILE 0
 #define CLAM_PROV_OUTPUT_PIPE 1
+#define CLAM_PROV_OUTPUT_MMAP 2
+#define CLAM_PROV_OUTPUT_SHM 3
+#define CLAM_PROV_OUTPUT_SHARED 4
+#define CLAM_PROV_OUTPUT_AGGREGATE 5
 #define CLAM_PROV_DIR_NAME ".clam-prov"
 #define CLAM_PROV_PATH_NAME_FILE "audit.log"
 #define CLAM_PROV_PATH_NAME_PIPE "audit.pipe"
+#define CLAM_PROV_PATH_NAME_PROCESS_FILE "audit.%d.log" // Formatted with the process id
+#define CLAM_PROV_PATH_NAME_SHARED_FILE "audit.shared.log"
+#define CLAM_PROV_PATH_NAME_SPILL_FILE "audit.%d.spill" // Formatted with the process id
+#define CLAM_PROV_PATH_NAME_SITES_FILE "audit.sites" // The switches of the call-sites (see 'clam_prov_site')
 #define CLAM_PROV_PATH_PERMISSIONS 0660
+#define CLAM_PROV_ENV_CONFIG "CLAM_PROV_CONFIG" // A file of settings that override the arguments of the initialization
+#define CLAM_PROV_ENV_PREFIX "CLAM_PROV_" // Followed by the key of a setting in upper case
 #define CLAM_PROV_DIR_PERMISSIONS 0700
 
+// Flush modes
+#define CLAM_PROV_FLUSH_SYNC 0 // The thread that fills a buffer writes it
+#define CLAM_PROV_FLUSH_ASYNC 1 // A background thread writes full buffers while threads fill their spare buffers
+
+// Durability of the file output
+#define CLAM_PROV_DURABILITY_NONE 0 // Never sync. Left to the kernel
+#define CLAM_PROV_DURABILITY_FLUSH 1 // Sync after every flush
+#define CLAM_PROV_DURABILITY_PERIODIC 2 // Sync once every durability interval (if anything was written)
+#define CLAM_PROV_DURABILITY_GROUP 3 // Sync after every flush, sharing one sync among the threads that flush together
+
+// Engines that write the file output
+#define CLAM_PROV_IO_ENGINE_BLOCKING 0 // The flushing thread writes (and syncs)
+#define CLAM_PROV_IO_ENGINE_URING 1 // The flushing thread submits the write (and sync) to io_uring without waiting
+
+// Backpressure of the pipe output
+#define CLAM_PROV_PIPE_BLOCK 0 // Wait for the consumer to open the pipe, and to make room in it
+#define CLAM_PROV_PIPE_DROP 1 // Drop the blocks that don't fit in the pipe
+#define CLAM_PROV_PIPE_SPILL 2 // Append the blocks that don't fit in the pipe to a spill file, replayed when they fit
+#define CLAM_PROV_PIPE_SIZE (1024 * 1024) // Size requested for the pipe when not waiting for the consumer
+
+// Sampling of the call-sites
+#define CLAM_PROV_SAMPLING_NONE 0 // Every execution of a call-site is logged
+#define CLAM_PROV_SAMPLING_FIXED 1 // One in every N executions of each call-site is logged
+#define CLAM_PROV_SAMPLING_TOKEN_BUCKET 2 // At most N records per second for each call-site, in bursts of up to N
+#define CLAM_PROV_SAMPLING_ADAPTIVE 3 // One in every M executions of each call-site, with M adapted to N records per second
+#define CLAM_PROV_SAMPLING_INTERVAL_MS 100 // How often the adaptive sampling adapts
+
+// Clocks of the records
+#define CLAM_PROV_CLOCK_REALTIME 0 // CLOCK_REALTIME in millis, read for every record
+#define CLAM_PROV_CLOCK_COARSE 1 // CLOCK_MONOTONIC_COARSE in nanos, converted to the time of day when written
+#define CLAM_PROV_CLOCK_TSC 2 // The time-stamp counter (x86 only), converted to the time of day when written
+#define CLAM_PROV_CLOCK_CALIBRATION_MS 20 // How long the rate of the time-stamp counter is measured for at init
+
+// State per call-site (sampling and aggregation). Call-sites with a bigger id are always logged, and not aggregated
+#define CLAM_PROV_MAX_CALL_SITES 65536
+
+// Log formats
+#define CLAM_PROV_LOG_FORMAT_V1 1 // Fixed size records with the function name inline
+#define CLAM_PROV_LOG_FORMAT_V2 2 // Blocks with an interned function name table, and varint encoded records
+#define CLAM_PROV_LOG_FORMAT_V3 3 // Blocks of fixed size records in the in-memory layout, written without a copy
+#define CLAM_PROV_BLOCK_SEGMENT 4 // A segment of the memory-mapped output that contains v2 and v3 blocks
+#define CLAM_PROV_BLOCK_SHARED 5 // The header of the shared file output, with the tail of the file
+#define CLAM_PROV_BLOCK_BATCH 6 // A batch of v2 and v3 blocks in the shared file output
+#define CLAM_PROV_BLOCK_SUMMARY 7 // Counters and return value histograms of the call-sites (aggregation output)
+#define CLAM_PROV_BLOCK_FOOTER 8 // The index at the end of a rotated segment of the file output
+#define CLAM_PROV_LOG_MAGIC 0x56505243 // "CRPV" in little-endian
+#define CLAM_PROV_SIZE_BLOCK_HEADER 16
+#define CLAM_PROV_BLOCK_FLAG_BIG_ENDIAN 0x01 // The records of a v3 block (or the tail of a shared header) are big-endian
+#define CLAM_PROV_BLOCK_FLAG_WEIGHTS 0x02 // The records of a v2 block have a weight
+#define CLAM_PROV_BLOCK_FLAG_NANOS 0x04 // The time of the records of a v2 or v3 block is in nanos (instead of millis)
+#define CLAM_PROV_BLOCK_FLAG_SIZES 0x08 // The records of a v2 or v3 block have a size
+
+// Memory-mapped output
+#define CLAM_PROV_MMAP_SEGMENT_SIZE (8 * 1024 * 1024) // The output file is extended by this much at a time
+#define CLAM_PROV_MMAP_ALIGNMENT 8 // Alignment of the blocks in a segment (in the output file)
+
+// Shared file output
+#define CLAM_PROV_SHARED_HEADER_SIZE 4096 // The header at the start of the file, mapped by the processes that append
+#define CLAM_PROV_SHARED_ALIGNMENT 8 // Alignment of the batches (in the output file)
+
+// Aggregation output
+// Buckets of the return values: 0 in bucket 0, 2^k to 2^(k+1) - 1 in bucket 1 + k (k < 63), and -2^(k+1) + 1 to -2^k
+// in bucket 64 + k (k < 64)
+#define CLAM_PROV_AGGREGATE_BUCKETS 128
+
+// Self-profiling of the logger
+// Buckets of the latencies in microseconds: less than 1 in bucket 0, 2^k to 2^(k+1) - 1 in bucket 1 + k, and the rest
+// in the last bucket
+#define CLAM_PROV_STATS_BUCKETS 32
+
+// Latency of the call-sites (the 'latency' key of AddLogging)
+// Buckets of the durations in nanoseconds: less than 1 in bucket 0, 2^k to 2^(k+1) - 1 in bucket 1 + k, and the rest
+// (about 4.6 minutes and more) in the last bucket
+#define CLAM_PROV_LATENCY_BUCKETS 40
+
+// Flushing from fatal signal handlers
+#define CLAM_PROV_CRASH_LOCK_MS 100 // How long the handler waits for a lock, which the interrupted code might hold
+#define CLAM_PROV_CRASH_RECORDS 1024 // The handler writes the records of a buffer this many at a time
+#define CLAM_PROV_MAX_SITE_TABLES 256 // Instrumented modules with switches (see 'clam_prov_logging_register_sites')
+
+// Shared memory output
+#define CLAM_PROV_SHM_NAME "/clam-prov.%u" // Formatted with the user id
+#define CLAM_PROV_SHM_VERSION 3
+#define CLAM_PROV_SHM_CAPACITY 65536 // Number of records in the ring. Must be a power of 2
+
 // Data structures
 #define CLAM_PROV_PATH_LENGTH 4096
 #define CLAM_PROV_FUNCTION_NAME_LENGTH 256
+#define CLAM_PROV_MAX_FUNCTIONS 4096
+// Also the layout of a record in the v3 format (48 bytes, no padding)
 typedef struct clam_prov_record{
-  unsigned long time; // The time in millis when the call-site was executed
-  int pid;            // The process which executed the call-site
-  long call_site_id;  // The id of the call-site
-  long exit;          // The return value of the call-site
-  char function_name[CLAM_PROV_FUNCTION_NAME_LENGTH]; // The name of the function at the call-site
+  unsigned long time;   // The time when the call-site was executed, in millis (or nanos, see CLAM_PROV_CLOCK_*)
+  int pid;              // The process which executed the call-site
+  int function_id;      // The interned id of the name of the function at the call-site
+  long call_site_id;    // The id of the call-site
+  long exit;            // The return value of the call-site
+  unsigned long weight; // The number of executions of the call-site that the record stands for (with sampling)
+  long size;            // The size requested from the call-site (the 'log_size' key of AddLogging), or -1 for none
 } clam_prov_record;
 
+// Sizes of the fields of a record in the v1 format
 #define CLAM_PROV_SIZE_UNSIGNED_LONG sizeof(unsigned long)
 #define CLAM_PROV_SIZE_INT sizeof(int)
 #define CLAM_PROV_SIZE_LONG sizeof(long)
 #define CLAM_PROV_SIZE_FUNCTION_NAME CLAM_PROV_FUNCTION_NAME_LENGTH
 #define CLAM_PROV_SIZE_RECORD (CLAM_PROV_SIZE_UNSIGNED_LONG + CLAM_PROV_SIZE_INT + (2 * CLAM_PROV_SIZE_LONG) + CLAM_PROV_SIZE_FUNCTION_NAME)
+// Upper bounds of a varint encoded record, and of a function table entry in the v2 format
+#define CLAM_PROV_SIZE_VARINT 10
+#define CLAM_PROV_SIZE_RECORD_V2 (7 * CLAM_PROV_SIZE_VARINT)
+#define CLAM_PROV_SIZE_FUNCTION_V2 ((2 * CLAM_PROV_SIZE_VARINT) + CLAM_PROV_FUNCTION_NAME_LENGTH)
+
+/*
+  v2 block layout. All fixed size fields are little-endian.
+
+  Header (CLAM_PROV_SIZE_BLOCK_HEADER bytes):
+    magic (4 bytes) - CLAM_PROV_LOG_MAGIC
+    version (1 byte) - CLAM_PROV_LOG_FORMAT_V2
+    flags (1 byte) - CLAM_PROV_BLOCK_FLAG_BIG_ENDIAN in v3 blocks and shared headers of a big-endian host.
+                     CLAM_PROV_BLOCK_FLAG_WEIGHTS in v2 blocks written with sampling.
+                     CLAM_PROV_BLOCK_FLAG_NANOS in v2 and v3 blocks written with a clock other than
+                     CLAM_PROV_CLOCK_REALTIME.
+                     CLAM_PROV_BLOCK_FLAG_SIZES in v2 blocks with a record that has a size, and in v3 blocks.
+                     Otherwise 0
+    reserved (2 bytes) - Always 0
+    process id (4 bytes) - Function ids are unique per process id
+    payload size (4 bytes) - Number of bytes following the header
+
+  Payload:
+    varint - Number of function table entries
+    Function table entries. Each function id appears once per process in a file:
+      varint - Function id
+      varint - Length of the function name
+      The function name (not NUL terminated)
+    varint - Number of records
+    Records. Each field is zigzag varint encoded as a delta from the same field in the previous record (starting at 0):
+      time, thread id, call site id
+    followed by:
+      zigzag varint - Return value of the call-site
+      varint - Function id
+      varint - Weight, only with CLAM_PROV_BLOCK_FLAG_WEIGHTS (otherwise the weight is 1)
+      zigzag varint - Size, only with CLAM_PROV_BLOCK_FLAG_SIZES (otherwise the size is -1)
+
+  v3 block layout. The header is the same as v2, with version CLAM_PROV_LOG_FORMAT_V3.
+  Payload:
+    Records as 'clam_prov_record' (48 bytes each, no padding) in the byte order given by the flags. A record with time
+    '0' was never written (memory-mapped output). Without CLAM_PROV_BLOCK_FLAG_SIZES (blocks written before records
+    had a size), the records are 40 bytes, without the size.
+  Function names are in v2 blocks (without records) of the same process id. In the file and pipe output, the names
+  that a v3 block uses for the first time are in the v2 block right before it. In the memory-mapped output, they can
+  be anywhere in the file.
+
+  Segment layout (memory-mapped output). The header is the same as v2, with version CLAM_PROV_BLOCK_SEGMENT. The
+  payload size is the size of the segment.
+  Payload:
+    v2 and v3 blocks, each starting at an offset in the file that is a multiple of CLAM_PROV_MMAP_ALIGNMENT.
+    Space between the blocks is zero, or a block that was not completely written (without a magic).
+
+  Shared file layout (shared file output). The file starts with a header with version CLAM_PROV_BLOCK_SHARED, and a
+  payload of CLAM_PROV_SHARED_HEADER_SIZE - CLAM_PROV_SIZE_BLOCK_HEADER bytes:
+    tail (8 bytes, in the byte order given by the flags) - Offset in the file where the next batch is reserved
+    The rest is 0
+  The header is followed by batches with version CLAM_PROV_BLOCK_BATCH, each starting at an offset in the file that is
+  a multiple of CLAM_PROV_SHARED_ALIGNMENT. The process id is the one of the writer.
+  Payload:
+    v2 and v3 blocks back to back, as in the file output.
+  The magic of a batch is written after the rest of it. Space between the batches is zero, or a batch that is not
+  completely written (without a magic). Space reserved by a process that crashed can be past the end of the file.
+
+  Summary layout (aggregation output). The header is the same as v2, with version CLAM_PROV_BLOCK_SUMMARY.
+  Payload:
+    varint - Number of function table entries
+    Function table entries, as in v2
+    varint - Start of the interval (time in millis): the end of the previous summary of the process, or its start
+    varint - End of the interval (time in millis)
+    varint - Executions in the interval of the call-sites that are not aggregated (id out of range)
+    varint - Number of call-sites
+    Call-sites, in increasing order of id. Each only counts its executions in the interval:
+      varint - Call site id, as a delta from the previous call-site (starting at 0)
+      varint - Function id
+      varint - Number of buckets
+      Buckets (only the ones that are not empty), in increasing order of index:
+        varint - Index of the bucket (see CLAM_PROV_AGGREGATE_BUCKETS)
+        varint - Number of executions that returned a value in the bucket
+
+  Rotated segments (file output with a rotate size). When the file reaches the rotate size, it is renamed to
+  '<path>.<n>' (the next free 'n', from '1') and a new file is started at the path. Each segment has the function
+  names of its records, so it can be read on its own. A rotated segment ends with a footer, with version
+  CLAM_PROV_BLOCK_FOOTER, that indexes the records of all the processes in the segment. The process id is the one of
+  the process that rotated the segment.
+  Payload:
+    varint - Number of records
+    varint - Smallest time of the records (time in millis), '0' without records
+    varint - Biggest time of the records (time in millis), '0' without records
+    varint - Number of call-site ids
+    Call-site ids of the records, each once, in increasing order:
+      zigzag varint - Call site id, as a delta from the previous call-site (starting at 0)
+    size (4 bytes) - Size of the footer including its header, so that the footer is found from the end of the segment
+*/
+
+// Counters of the logger since it was initialized (in the current process)
+typedef struct clam_prov_stats{
+  unsigned long records_buffered;   // Records inserted into the buffers (including inline logging)
+  unsigned long records_dropped;    // Records lost: no space in the buffer (or the ring), or a failed write
+  unsigned long bytes_written;      // Bytes written to the output (records and function names)
+  unsigned long flushes;            // Buffers (or summaries) written to the output
+  unsigned long flush_latency[CLAM_PROV_STATS_BUCKETS]; // Time to write a buffer (see CLAM_PROV_STATS_BUCKETS)
+  unsigned long lock_wait[CLAM_PROV_STATS_BUCKETS];     // Time waited for the lock of the output to write
+} clam_prov_stats;
+
+// Durations of the executions of a call-site, timed by the instrumented code (the 'latency' key of AddLogging)
+typedef struct clam_prov_latency{
+  unsigned long calls;              // Executions timed
+  unsigned long total_nanos;        // Sum of their durations
+  unsigned long buckets[CLAM_PROV_LATENCY_BUCKETS]; // Executions per duration (see CLAM_PROV_LATENCY_BUCKETS)
+} clam_prov_latency;
+
+/*
+  The switch of an instrumented call-site (the 'site_switches' key of AddLogging). The instrumented code tests
+  'enabled' before the call-site is logged, and skips it (without calling the logger) while it is '0'. Each instrumented
+  module registers its switches with 'clam_prov_logging_register_sites' before 'main'.
+
+  The switches are set from the file '~/.clam-prov/audit.sites' at initialization, and when the process receives the
+  site signal (see 'clam_prov_logging_init'). Each line of the file is '<call-site id> = <0|1>', or '* = <0|1>' for all
+  the call-sites, applied in order. Other lines are ignored.
+*/
+typedef struct clam_prov_site{
+  long call_site_id;
+  char *enabled;              // Accessed atomically
+} clam_prov_site;
+
+// Consumer of the shared memory output
+typedef struct clam_prov_ring clam_prov_ring;
 
 // API
 /*
@@ -63,18 +294,152 @@ extern char* clam_prov_logger_get_home_pipe(char *dst, int create);
   'control' - Unused
   Second argument - must be a 'long'. This is the call-site identifier
   Third argument - must be a 'long'. This is the return value of the call-site
-  Fourth argument - must be a 'char*'. This is the name of the function at the call-site
+  Fourth argument - must be a 'char*'. This is the name of the function at the call-site. The name is interned by
+                    its address, so the same address must always hold the same name (as the names emitted by AddLogging)
 
+  Each thread inserts into its own buffer without locking.
   Checks if the buffer is full after each insert by calling 'clam_prov_logging_check_and_flush(0)'
+  With sampling, the record is only inserted if the call-site is sampled, and its weight is the number of executions
+  of the call-site since its last record
 
-  Returns 0 on failure, and 1 on success
+  Returns 0 on failure, and 1 on success (inserted, or not sampled)
 */
 extern int clam_prov_logging_buffer(int control, ...);
+/*
+  Insert a call-site record into the buffer, like 'clam_prov_logging_buffer', without decoding variable arguments.
+  AddLogging emits these instead of 'clam_prov_logging_buffer', selected by the return type of the call-site.
+  'call_site_id' - The id of the call-site
+  'exit_value' - The return value of the call-site. Integers are sign-extended to 'long' (zero-extended if they are
+                 'bool'). '0' for 'clam_prov_log_void'
+  'function_name' - The name of the function at the call-site (interned by address as for 'clam_prov_logging_buffer')
+
+  Returns 0 on failure, and 1 on success
+*/
+extern int clam_prov_log_i64(long call_site_id, long exit_value, char *function_name);
+extern int clam_prov_log_ptr(long call_site_id, void *exit_value, char *function_name);
+extern int clam_prov_log_void(long call_site_id, char *function_name);
+/*
+  Insert a call-site record with a size, like 'clam_prov_log_i64'. AddLogging emits it instead of the others for the
+  call-sites with a 'clam-prov-size' argument when the 'log_size' key is set. Pointers are logged as integers.
+  'size' - The size requested from the call-site (its 'clam-prov-size' argument, zero-extended to 'long'), so that the
+           records tell how much was transferred against how much was requested. Not written by the v1 format.
+
+  Returns 0 on failure, and 1 on success
+*/
+extern int clam_prov_log_size(long call_site_id, long exit_value, long size, char *function_name);
+
+/*
+  Inline logging (the 'inline_logging' key of AddLogging). The instrumented code appends a record to the buffer of its
+  thread in 'clam_prov_inline_thread_buffer' without a call, if:
+    'clam_prov_logging_is_inited' is '1', 'clam_prov_inline_thread_buffer' is not NULL, the function id cached by the
+    call-site is known, and 'record_count' is in [0, 'max_records')
+  It fills in the record at 'record_count' (with a 'weight' of '1', and a 'size' of '-1' without one), with 'time'
+  last (a reading of the clock given to 'clam_prov_logging_init'), and publishes it with a compare-and-swap of
+  'record_count' from the index to the index plus one. If that fills the buffer, it calls
+  'clam_prov_logging_check_and_flush(0)'. Otherwise (or if the compare-and-swap fails) it calls 'clam_prov_log_slow',
+  which inserts the record, caches the function id plus one in 'function_id', and sets 'clam_prov_inline_thread_buffer'
+  (which stays NULL with sampling).
+*/
+typedef struct clam_prov_inline_buffer{
+  int record_count;           // Accessed atomically. Negative while the buffer is being flushed
+  int max_records;
+  clam_prov_record *records;
+  int tid;                    // The thread that owns the buffer
+} clam_prov_inline_buffer;
+extern __thread clam_prov_inline_buffer *clam_prov_inline_thread_buffer;
+extern atomic_int clam_prov_logging_is_inited;
+extern int clam_prov_log_slow(long call_site_id, long exit_value, long size, char *function_name, int *function_id);
+/*
+  Add an execution of the call-site 'call_site_id' that took 'nanoseconds' (of CLOCK_MONOTONIC) to its latency
+  histogram. Called by the instrumented code after the call-site with the 'latency' key of AddLogging. The call-sites
+  with an id out of [0, CLAM_PROV_MAX_CALL_SITES) are counted together.
+
+  Returns 0 on failure, and 1 on success
+*/
+extern int clam_prov_log_latency(long call_site_id, unsigned long nanoseconds);
 /*
   Initialize logging.
-  'control' - Unused
-  'Second argument' - must be an 'int'. This is the maximum size of the buffer
-  'Third argument' - must be an 'int'. This is the output mode. Values: '0' for file output, '1' for pipe output
+  'control' - The number of arguments that follow. '0' is the same as '2' for callers that predate it
+  'Second argument' - must be an 'int'. This is the maximum size of the buffer of each thread
+  'Third argument' - must be an 'int'. This is the output mode. Values: '0' for file output, '1' for pipe output, '2'
+                     for memory-mapped file output, '3' for shared memory output, '4' for shared file output, '5'
+                     for aggregation output (summaries of the call-sites written to the file output, instead of
+                     records)
+  'Fourth argument' - must be an 'int'. This is the log format. Values: '1' for v1, '2' for v2, '3' for v3.
+                      Default is '1'. Ignored by the memory-mapped file output, which is always v3, and by the
+                      aggregation output, which writes summary blocks. The shared file output doesn't support v1
+  'Fifth argument' - must be an 'int'. This is the flush mode. Values: '0' for sync, '1' for async. Default is '0'.
+                     Ignored by the memory-mapped file output, which has nothing to flush, by the shared memory
+                     output, which takes the records as they are inserted, and by the aggregation output
+  'Sixth argument' - must be an 'int'. This is the flush interval in milliseconds. Buffers that are not empty are
+                     flushed at least once per interval. '0' (default) to flush only full buffers. With the aggregation
+                     output, a summary is written once per interval ('0' to write it at shutdown and on forced flushes)
+  'Seventh argument' - must be an 'int'. This is the durability of the file output. Values: '0' for none, '1' for
+                       sync after every flush, '2' for periodic sync, '3' for group sync. Default is '1'
+  'Eighth argument' - must be an 'int'. This is the durability interval in milliseconds for periodic sync
+  'Ninth argument' - must be an 'int'. This is the engine that writes the file output. Values: '0' for blocking
+                     writes, '1' for io_uring (blocking writes if io_uring is not available). Default is '0'
+  'Tenth argument' - must be an 'int'. Set to '1' for the file, memory-mapped file and aggregation outputs to write to a file per
+                     process ('~/.clam-prov/audit.<pid>.log'), including the processes forked after initializing.
+                     Default is '0' ('~/.clam-prov/audit.log'). See 'output_path' below
+  'Eleventh argument' - must be an 'int'. This is the sampling of the call-sites. Values: '0' for none, '1' for fixed,
+                        '2' for token bucket, '3' for adaptive (see CLAM_PROV_SAMPLING_*). Default is '0'
+  'Twelfth argument' - must be a 'long'. This is the 'N' of the sampling (see CLAM_PROV_SAMPLING_*). Must be at least
+                       '1' with sampling. The aggregation output counts every execution, so it ignores the sampling
+  'Thirteenth argument' - must be an 'int'. Set to '1' to print the stats of the logger (see 'clam_prov_stats') to
+                          the standard error at shutdown. Default is '0'
+  'Fourteenth argument' - must be an 'int'. A signal that prints the stats of the logger to the standard error when
+                          the process receives it, or '0' (default) for none. The handler of the signal is restored at
+                          shutdown
+  'Fifteenth argument' - must be an 'int'. This is the backpressure of the pipe output (see CLAM_PROV_PIPE_*). Values:
+                         '0' to block, '1' to drop, '2' to spill. Default is '0'. With '1' and '2', initializing doesn't
+                         wait for a consumer, and the blocks written before there is one wait in the pipe. The spill
+                         file is '~/.clam-prov/audit.<pid>.spill', in the format of the pipe. It is replayed with the
+                         next write to the pipe (or within the flush interval), and what is not replayed by shutdown is
+                         left in it. Neither waits for the consumer, so a v2 or v3 block bigger than the pipe is dropped
+  'Sixteenth argument' - must be an 'int'. This is the rotate size of the file output in MiB, or '0' (default) for
+                         a single file. The file is rotated by the write that takes it to the rotate size (see the
+                         rotated segments). Rotating writes with blocking writes, so the io_uring engine is ignored
+  'Seventeenth argument' - must be an 'int'. This is the clock of the records (see CLAM_PROV_CLOCK_*). Values: '0'
+                           for CLOCK_REALTIME, '1' for CLOCK_MONOTONIC_COARSE, '2' for the time-stamp counter. Default
+                           is '0'. With '1' and '2', a record holds a reading of the clock until it is written, and the
+                           records of a write are converted to the time of day against one reading of CLOCK_REALTIME
+                           (taken with a reading of the clock), in nanos for v2 and v3, and in millis for v1 and the
+                           shared memory output. The rate of the time-stamp counter is calibrated at initialization.
+                           Without an invariant time-stamp counter (CPUID 0x80000007, EDX bit 8), '1' is used instead.
+                           Ignored by the memory-mapped file output, which writes the records in place, and by the
+                           aggregation output, which always use '0'
+  'Eighteenth argument' - must be an 'int'. Set to '1' to flush the buffers from a handler of the fatal signals
+                          (SIGHUP, SIGINT, SIGQUIT, SIGILL, SIGTRAP, SIGABRT, SIGBUS, SIGFPE, SIGSEGV, SIGTERM, SIGXCPU,
+                          SIGXFSZ and SIGSYS) that have their default action at initialization. The handler writes
+                          what it can without allocating, and without waiting more than CLAM_PROV_CRASH_LOCK_MS for a
+                          lock of another thread (then it gives up), and then lets the signal take its default action.
+                          It writes nothing if the signal interrupted the logger while it held the lock of the output.
+                          It doesn't wait for 'flock' or for the consumer of the pipe (what doesn't fit is dropped).
+                          Rotating and syncing are left out. Default is '0'. The handlers are removed at shutdown
+  'Nineteenth argument' - must be an 'int'. A signal that sets the switches of the call-sites from their file (see
+                          'clam_prov_site') when the process receives it, or '0' (default) for none. Must not be the
+                          signal of the stats. The handler of the signal is restored at shutdown
+
+  The arguments can be overridden when the process initializes, without instrumenting it again. First by the file in
+  the environment variable CLAM_PROV_CONFIG, in the format of the configuration of AddLogging ('key = value' lines,
+  and '#' for comments), then by the environment variables CLAM_PROV_<KEY> (the key in upper case, as
+  CLAM_PROV_MAX_RECORDS). The keys are the ones of AddLogging ('max_records', 'output_mode', 'log_format',
+  'flush_mode', 'flush_interval_ms', 'durability', 'durability_interval_ms', 'io_engine', 'per_process_files',
+  'sampling', 'sampling_parameter', 'stats_dump', 'stats_signal', 'pipe_policy', 'rotate_size_mb', 'clock',
+  'crash_flush' and 'site_signal'), and 'output_path'. The other keys only apply when instrumenting, so they are
+  ignored. 'output_path' is the file of the file, memory-mapped file, aggregation and shared file outputs, or the pipe
+  of the pipe output, instead of the one in '~/.clam-prov'. With a file per process, '.<pid>' is inserted before the
+  extension of its name. A value that is not a number, or a file that can't be read, fails the initialization. The
+  environment is read with 'secure_getenv', so the overrides don't apply to setuid programs. The code inlined by
+  AddLogging reads the clock of the arguments, so it calls the logger for every record when an override changes the
+  clock (or the memory-mapped output, which always uses CLAM_PROV_CLOCK_REALTIME).
+
+  The buffers are flushed at exit, after the handlers of 'atexit', as by 'clam_prov_logging_shutdown'. Records
+  inserted after that are dropped.
+
+  A process forked after initializing drops the records that it inherits (the parent writes them), and opens the output
+  again on its first record (see the tenth argument).
 
   Returns 0 on failure, and 1 on success
 */
@@ -83,14 +448,87 @@ extern int clam_prov_logging_init(int control, ...);
   Shutdown logging.
   'control' - Unused
   No other arguments used.
+  Does nothing in the child of a 'vfork', which shares the logger of its parent.
 
   Returns 0 on failure, and 1 on success
 */
 extern int clam_prov_logging_shutdown(int control, ...);
 /*
-  Check if the buffer size is larger than the maximum allowed. Flush the buffer if the size is exceeded.
-  `force` - Force flush the buffer even if the buffer size is not exceeded
+  Check if the buffer of the calling thread is full. Flush the buffer if it is full.
+  `force` - Force flush the buffers of all threads even if they are not full (or write a summary with the aggregation
+            output)
 
   Returns 0 on failure, and 1 on success
 */
 extern int clam_prov_logging_check_and_flush(int force);
+/*
+  Set the sampling of the call-site 'call_site_id', instead of the one given to 'clam_prov_logging_init'. Only
+  available if 'clam_prov_logging_init' was given a sampling.
+  'sampling' - CLAM_PROV_SAMPLING_NONE, CLAM_PROV_SAMPLING_FIXED, or CLAM_PROV_SAMPLING_TOKEN_BUCKET
+  'sampling_parameter' - The 'N' of the sampling. Ignored by CLAM_PROV_SAMPLING_NONE
+
+  Returns 0 on failure, and 1 on success
+*/
+extern int clam_prov_logging_set_sampling(long call_site_id, int sampling, long sampling_parameter);
+/*
+  Copy the latency histogram of the call-site 'call_site_id' into 'latency' ('-1' for the call-sites with an id out of
+  range). Available after shutdown as well. Counted since initializing, and printed with the stats, one line per
+  call-site.
+
+  Returns 0 if the call-site was not timed, and 1 on success
+*/
+extern int clam_prov_logging_get_latency(long call_site_id, clam_prov_latency *latency);
+/*
+  Register the switches of the call-sites of an instrumented module (see 'clam_prov_site'). Called by a constructor
+  that AddLogging adds to the module. 'sites' must stay valid until the process exits.
+
+  Returns 0 on failure (more than CLAM_PROV_MAX_SITE_TABLES modules), and 1 on success
+*/
+extern int clam_prov_logging_register_sites(clam_prov_site *sites, int total_sites);
+/*
+  Turn on ('enabled' is '1') or off ('enabled' is '0') the call-sites with the id 'call_site_id'. Can be called before
+  initializing.
+
+  Returns 0 if there is no switch for the call-site, and 1 on success
+*/
+extern int clam_prov_logging_enable_site(long call_site_id, int enabled);
+/*
+  Copy the counters of the logger into 'stats'. Available after shutdown as well. The counters are read one at a time
+  without stopping the threads that log, so they can be slightly off from each other.
+
+  Returns 0 on failure, and 1 on success
+*/
+extern int clam_prov_logging_get_stats(clam_prov_stats *stats);
+/*
+  Attach to the shared memory output of the current user as its consumer. Creates the shared memory if it doesn't exist,
+  so the consumer can start before or after the logged processes. There can be one consumer at a time.
+
+  Returns the ring on success, otherwise returns NULL
+*/
+extern clam_prov_ring* clam_prov_ring_open();
+/*
+  Get the oldest record in the ring without copying it. The record stays in the ring (and valid) until
+  'clam_prov_ring_release' is called. Its 'function_id' is resolved with 'clam_prov_ring_function_name'.
+
+  Returns the record, or NULL if the ring is empty
+*/
+extern const clam_prov_record* clam_prov_ring_peek(clam_prov_ring *ring);
+/*
+  Remove the record returned by the last 'clam_prov_ring_peek' from the ring.
+*/
+extern void clam_prov_ring_release(clam_prov_ring *ring);
+/*
+  Get the name of the function with the id 'function_id'. Function ids are the same for all processes.
+
+  Returns the name, or NULL if the id is invalid
+*/
+extern const char* clam_prov_ring_function_name(clam_prov_ring *ring, int function_id);
+/*
+  Returns the number of records that the logged processes dropped because the ring was full while no consumer was
+  attached
+*/
+extern unsigned long clam_prov_ring_dropped(clam_prov_ring *ring);
+/*
+  Detach from the shared memory output. The records in the ring stay for the next consumer.
+*/
+extern void clam_prov_ring_close(clam_prov_ring *ring);
@@ -1,3 +1,5 @@
+#include "../Logging/clam-prov-logger.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -5,35 +7,572 @@
 #include <errno.h>
 #include <string.h>
 
-int main(int argc, char *argv[]){
+// Function names of the v2 format. Function ids are unique per process id
+typedef struct function_table{
+  unsigned int pid;
+  char *names[CLAM_PROV_MAX_FUNCTIONS];
+  struct function_table *next;
+} function_table;
 
-  if(argc != 3){
-    fprintf(stderr, "Missing arguments: <log file path> <number of records to read>\n");
-    return 1;
+static function_table *function_tables = NULL;
+
+static function_table* get_function_table(unsigned int pid){
+  function_table *table;
+  for(table = function_tables; table != NULL; table = table->next){
+    if(table->pid == pid){
+      return table;
+    }
+  }
+  table = (function_table *)calloc(1, sizeof(function_table));
+  if(table == NULL){
+    return NULL;
   }
+  table->pid = pid;
+  table->next = function_tables;
+  function_tables = table;
+  return table;
+}
 
-  char *log_path = argv[1];
-  int record_count = atoi(argv[2]);
-  int fd, i;
+static int read_fully(int fd, char *dst, int size){
+  int total = 0;
+  while(total < size){
+    int bytes_read = read(fd, (void*)(&dst[total]), size - total);
+    if(bytes_read < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    if(bytes_read == 0){
+      break;
+    }
+    total += bytes_read;
+  }
+  return total;
+}
 
-  fd = open(log_path, O_RDONLY);
+static unsigned int get_u32(char *src){
+  unsigned char *bytes = (unsigned char *)src;
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+}
 
-  if(fd < 0){
-    perror("Log file open failed!");
-    return 1;
+// Returns NULL if the varint runs past 'end'
+static char* get_varint(char *src, char *end, unsigned long *value){
+  int shift = 0;
+  *value = 0;
+  while(src < end && shift < 64){
+    unsigned char byte = (unsigned char)(*src++);
+    *value |= ((unsigned long)(byte & 0x7F)) << shift;
+    if((byte & 0x80) == 0){
+      return src;
+    }
+    shift += 7;
   }
+  return NULL;
+}
+
+static char* get_zigzag(char *src, char *end, long *value){
+  unsigned long encoded;
+  src = get_varint(src, end, &encoded);
+  *value = (long)(encoded >> 1) ^ -(long)(encoded & 1);
+  return src;
+}
+
+// The size is only printed for the records that have one, and the weight for the records that stand for more than one
+// execution (sampling). The time is printed in millis, with a fraction for the blocks with a time in nanos
+static void print_record(unsigned long time, int is_nanos, int pid, long call_site_tag, long exit, long size,
+                         char *function_name, unsigned long weight){
+  char time_text[48], size_text[32], weight_text[32];
+
+  if(is_nanos){
+    snprintf(&time_text[0], sizeof(time_text), "%lu.%06lu", time / (1000 * 1000), time % (1000 * 1000));
+  }else{
+    snprintf(&time_text[0], sizeof(time_text), "%lu", time);
+  }
+  size_text[0] = weight_text[0] = '\0';
+  if(size != -1){
+    snprintf(&size_text[0], sizeof(size_text), ", size=%ld", size);
+  }
+  if(weight != 1){
+    snprintf(&weight_text[0], sizeof(weight_text), ", weight=%lu", weight);
+  }
+  printf("Record[time=%s, pid=%d, call_site_tag=%ld, exit=%ld%s, function_name=%s%s]\n",
+    &time_text[0], pid, call_site_tag, exit, &size_text[0], function_name, &weight_text[0]
+  );
+}
 
+// 'data' holds the first CLAM_PROV_SIZE_BLOCK_HEADER bytes of the record. Returns 1 on success
+static int read_record_v1(int fd, char *data, int print){
   const int sizeof_unsigned_long = sizeof(unsigned long);
   const int sizeof_int = sizeof(int);
   const int sizeof_long = sizeof(long);
-  const int sizeof_function_name = 256;
-  const int data_size = sizeof_unsigned_long + sizeof_int + (2 * sizeof_long) + sizeof_function_name;
+  const int sizeof_function_name = CLAM_PROV_FUNCTION_NAME_LENGTH;
+  const int data_size = CLAM_PROV_SIZE_RECORD;
 
-  for(i = 0; i < record_count; i++){
+  int bytes_read = read_fully(fd, &data[CLAM_PROV_SIZE_BLOCK_HEADER], data_size - CLAM_PROV_SIZE_BLOCK_HEADER);
+  if(bytes_read < 0){
+    perror("Failed to read log file");
+    return 0;
+  }
+  if(bytes_read != data_size - CLAM_PROV_SIZE_BLOCK_HEADER){
+    printf("Invalid number of bytes in log file. Must be a multiple of %d\n", data_size);
+    return 0;
+  }
+  if(print == 0){
+    return 1;
+  }
+
+  unsigned long time;
+  int pid;
+  long call_site_tag;
+  long exit;
+  char function_name[sizeof_function_name + 1];
+
+  int offset = 0;
+  memcpy((void*)(&time), (void*)(&data[offset]), sizeof_unsigned_long);
+  offset += sizeof_unsigned_long;
+  memcpy((void*)(&pid), (void*)(&data[offset]), sizeof_int);
+  offset += sizeof_int;
+  memcpy((void*)(&call_site_tag), (void*)(&data[offset]), sizeof_long);
+  offset += sizeof_long;
+  memcpy((void*)(&exit), (void*)(&data[offset]), sizeof_long);
+  offset += sizeof_long;
+  memcpy((void*)(&function_name[0]), (void*)(&data[offset]), sizeof_function_name);
+  offset += sizeof_function_name;
+  function_name[sizeof_function_name] = '\0';
+
+  print_record(time, 0, pid, call_site_tag, exit, -1, &function_name[0], 1);
+  return 1;
+}
+
+static char* get_function_name(function_table *table, unsigned long function_id){
+  char *function_name = function_id < CLAM_PROV_MAX_FUNCTIONS ? table->names[function_id] : NULL;
+  return function_name == NULL ? "?" : function_name;
+}
+
+// Returns the number of records printed, or -1 if the block is malformed
+static int parse_block_v2(unsigned int pid, int flags, char *payload, unsigned int payload_size, int max_records){
+  function_table *table;
+  char *src, *end;
+  unsigned long total_functions, total_records, i;
+  int printed = 0;
+
+  table = get_function_table(pid);
+  if(table == NULL){
+    perror("Failed to allocate memory");
+    return -1;
+  }
+  src = payload;
+  end = payload + payload_size;
+
+  src = get_varint(src, end, &total_functions);
+  for(i = 0; src != NULL && i < total_functions; i++){
+    unsigned long function_id, name_length;
+    src = get_varint(src, end, &function_id);
+    if(src != NULL){
+      src = get_varint(src, end, &name_length);
+    }
+    if(src == NULL || function_id >= CLAM_PROV_MAX_FUNCTIONS || name_length > (unsigned long)(end - src)){
+      src = NULL;
+      break;
+    }
+    free(table->names[function_id]);
+    table->names[function_id] = strndup(src, name_length);
+    src += name_length;
+  }
+
+  long time = 0, tid = 0, call_site_tag = 0;
+  if(src != NULL){
+    src = get_varint(src, end, &total_records);
+  }
+  for(i = 0; src != NULL && i < total_records && printed < max_records; i++){
+    long delta, exit, size = -1;
+    unsigned long function_id, weight = 1;
+    src = get_zigzag(src, end, &delta);
+    time += delta;
+    if(src != NULL) src = get_zigzag(src, end, &delta);
+    tid += delta;
+    if(src != NULL) src = get_zigzag(src, end, &delta);
+    call_site_tag += delta;
+    if(src != NULL) src = get_zigzag(src, end, &exit);
+    if(src != NULL) src = get_varint(src, end, &function_id);
+    if(src != NULL && (flags & CLAM_PROV_BLOCK_FLAG_WEIGHTS) != 0) src = get_varint(src, end, &weight);
+    if(src != NULL && (flags & CLAM_PROV_BLOCK_FLAG_SIZES) != 0) src = get_zigzag(src, end, &size);
+    if(src == NULL){
+      break;
+    }
+    print_record((unsigned long)time, (flags & CLAM_PROV_BLOCK_FLAG_NANOS) != 0, (int)tid, call_site_tag, exit, size,
+                 get_function_name(table, function_id), weight);
+    printed++;
+  }
+
+  if(src == NULL){
+    printf("Malformed block in log file\n");
+    return -1;
+  }
+  return printed;
+}
+
+// Prints the range of return values of a bucket of the aggregation output (see CLAM_PROV_AGGREGATE_BUCKETS)
+static void print_bucket(unsigned long bucket, unsigned long count){
+  unsigned long low, high;
+
+  if(bucket == 0){
+    printf("0:%lu", count);
+  }else if(bucket < 64){
+    low = 1UL << (bucket - 1);
+    high = low + (low - 1);
+    printf("%lu..%lu:%lu", low, high, count);
+  }else{
+    low = 1UL << (bucket - 64);
+    high = low + (low - 1);
+    printf("-%lu..-%lu:%lu", high, low, count);
+  }
+}
+
+// Each call-site counts as a record. Returns the number of call-sites printed, or -1 if the block is malformed
+static int parse_block_summary(unsigned int pid, char *payload, unsigned int payload_size, int max_records){
+  function_table *table;
+  char *src, *end;
+  unsigned long total_functions, start_time, end_time, not_aggregated, total_sites, i, j;
+  long call_site_tag = 0;
+  int printed = 0;
+
+  table = get_function_table(pid);
+  if(table == NULL){
+    perror("Failed to allocate memory");
+    return -1;
+  }
+  src = payload;
+  end = payload + payload_size;
+
+  src = get_varint(src, end, &total_functions);
+  for(i = 0; src != NULL && i < total_functions; i++){
+    unsigned long function_id, name_length;
+    src = get_varint(src, end, &function_id);
+    if(src != NULL){
+      src = get_varint(src, end, &name_length);
+    }
+    if(src == NULL || function_id >= CLAM_PROV_MAX_FUNCTIONS || name_length > (unsigned long)(end - src)){
+      src = NULL;
+      break;
+    }
+    free(table->names[function_id]);
+    table->names[function_id] = strndup(src, name_length);
+    src += name_length;
+  }
+
+  if(src != NULL) src = get_varint(src, end, &start_time);
+  if(src != NULL) src = get_varint(src, end, &end_time);
+  if(src != NULL) src = get_varint(src, end, &not_aggregated);
+  if(src != NULL) src = get_varint(src, end, &total_sites);
+  if(src != NULL && max_records > 0 && not_aggregated > 0){
+    printf("Summary[start=%lu, end=%lu, pid=%u, not_aggregated=%lu]\n", start_time, end_time, pid, not_aggregated);
+  }
+  for(i = 0; src != NULL && i < total_sites && printed < max_records; i++){
+    unsigned long delta, function_id, total_buckets, bucket, count, total_count = 0;
+    char *buckets;
+    src = get_varint(src, end, &delta);
+    call_site_tag += (long)delta;
+    if(src != NULL) src = get_varint(src, end, &function_id);
+    if(src != NULL) src = get_varint(src, end, &total_buckets);
+    buckets = src;
+    for(j = 0; src != NULL && j < total_buckets; j++){
+      src = get_varint(src, end, &bucket);
+      if(src != NULL) src = get_varint(src, end, &count);
+      total_count += count;
+    }
+    if(src == NULL){
+      break;
+    }
+    printf("Summary[start=%lu, end=%lu, pid=%u, call_site_tag=%ld, function_name=%s, count=%lu, exits={",
+      start_time, end_time, pid, call_site_tag, get_function_name(table, function_id), total_count
+    );
+    for(j = 0, src = buckets; j < total_buckets; j++){
+      src = get_varint(src, end, &bucket);
+      src = get_varint(src, end, &count);
+      if(j > 0){
+        printf(", ");
+      }
+      print_bucket(bucket, count);
+    }
+    printf("}]\n");
+    printed++;
+  }
+
+  if(src == NULL){
+    printf("Malformed block in log file\n");
+    return -1;
+  }
+  return printed;
+}
+
+// Prints the index of a rotated segment. Returns 0 (it has no records), or -1 if the block is malformed
+static int parse_block_footer(unsigned int pid, char *payload, unsigned int payload_size, int print){
+  char *src, *end;
+  unsigned long total_records, start_time, end_time, total_call_sites, i;
+  long delta, call_site_tag = 0;
+
+  src = payload;
+  end = payload + payload_size;
+  src = get_varint(src, end, &total_records);
+  if(src != NULL) src = get_varint(src, end, &start_time);
+  if(src != NULL) src = get_varint(src, end, &end_time);
+  if(src != NULL) src = get_varint(src, end, &total_call_sites);
+  if(src == NULL){
+    printf("Malformed block in log file\n");
+    return -1;
+  }
+  if(print == 0){
+    return 0;
+  }
+  printf("Footer[pid=%u, records=%lu, start=%lu, end=%lu, call_site_tags={", pid, total_records, start_time, end_time);
+  for(i = 0; i < total_call_sites; i++){
+    src = get_zigzag(src, end, &delta);
+    if(src == NULL){
+      break;
+    }
+    call_site_tag += delta;
+    printf(i == 0 ? "%ld" : ", %ld", call_site_tag);
+  }
+  printf("}]\n");
+  return 0;
+}
+
+static int is_host_big_endian(){
+  unsigned int one = 1;
+  return *((unsigned char *)&one) == 0;
+}
+
+static void swap_record(clam_prov_record *record){
+  record->time = __builtin_bswap64(record->time);
+  record->pid = (int)__builtin_bswap32((unsigned int)record->pid);
+  record->function_id = (int)__builtin_bswap32((unsigned int)record->function_id);
+  record->call_site_id = (long)__builtin_bswap64((unsigned long)record->call_site_id);
+  record->exit = (long)__builtin_bswap64((unsigned long)record->exit);
+  record->weight = __builtin_bswap64(record->weight);
+  record->size = (long)__builtin_bswap64((unsigned long)record->size);
+}
+
+// Returns the number of records printed, or -1 if the function table can't be allocated
+static int parse_block_v3(unsigned int pid, int flags, char *payload, unsigned int payload_size, int max_records){
+  function_table *table;
+  clam_prov_record record;
+  unsigned int offset, record_size;
+  int is_swapped;
+  int printed = 0;
+
+  table = get_function_table(pid);
+  if(table == NULL){
+    perror("Failed to allocate memory");
+    return -1;
+  }
+  is_swapped = ((flags & CLAM_PROV_BLOCK_FLAG_BIG_ENDIAN) != 0) != is_host_big_endian();
+  // Blocks written before the records had a size have the records without it
+  record_size = (flags & CLAM_PROV_BLOCK_FLAG_SIZES) != 0 ? sizeof(clam_prov_record) : offsetof(clam_prov_record, size);
+  record.size = -1;
+  for(offset = 0; offset + record_size <= payload_size && printed < max_records; offset += record_size){
+    memcpy((void*)(&record), (void*)(&payload[offset]), record_size);
+    if(is_swapped){
+      swap_record(&record);
+    }
+    if(record.time == 0){
+      continue; // Never written
+    }
+    print_record(record.time, (flags & CLAM_PROV_BLOCK_FLAG_NANOS) != 0, record.pid, record.call_site_id, record.exit,
+                 record.size, get_function_name(table, (unsigned int)record.function_id), record.weight);
+    printed++;
+  }
+  return printed;
+}
+
+/*
+  'payload_offset' is the offset of the payload in the log file. Blocks that are not completely written (or not at all)
+  are skipped. All the blocks are read if 'max_records' is '0' (for the function names).
+
+  Returns the number of records printed
+*/
+static int parse_segment(off_t payload_offset, char *payload, unsigned int payload_size, int max_records){
+  off_t offset;
+  int printed = 0;
+
+  offset = payload_offset + CLAM_PROV_MMAP_ALIGNMENT - 1;
+  offset -= offset % CLAM_PROV_MMAP_ALIGNMENT;
+  offset -= payload_offset;
+  while(offset + CLAM_PROV_SIZE_BLOCK_HEADER <= payload_size && (max_records == 0 || printed < max_records)){
+    char *header = &payload[offset];
+    unsigned int block_size = get_u32(&header[12]);
+    int version = (unsigned char)header[4];
+    int records_read = -1;
+
+    if(get_u32(&header[0]) == CLAM_PROV_LOG_MAGIC && block_size <= payload_size - offset - CLAM_PROV_SIZE_BLOCK_HEADER){
+      if(version == CLAM_PROV_LOG_FORMAT_V2){
+        records_read = parse_block_v2(get_u32(&header[8]), (unsigned char)header[5], &header[CLAM_PROV_SIZE_BLOCK_HEADER], block_size, max_records - printed);
+      }else if(version == CLAM_PROV_LOG_FORMAT_V3){
+        records_read = parse_block_v3(get_u32(&header[8]), (unsigned char)header[5], &header[CLAM_PROV_SIZE_BLOCK_HEADER], block_size, max_records - printed);
+      }
+    }
+    if(records_read < 0){
+      offset += CLAM_PROV_MMAP_ALIGNMENT; // Not a block
+      continue;
+    }
+    printed += records_read;
+    offset += CLAM_PROV_SIZE_BLOCK_HEADER + block_size;
+    offset += (CLAM_PROV_MMAP_ALIGNMENT - ((payload_offset + offset) % CLAM_PROV_MMAP_ALIGNMENT)) % CLAM_PROV_MMAP_ALIGNMENT;
+  }
+  return printed;
+}
+
+/*
+  The blocks of a batch are back to back.
+
+  Returns the number of records printed, or -1 if the batch is malformed
+*/
+static int parse_batch(char *payload, unsigned int payload_size, int max_records){
+  unsigned int offset = 0;
+  int printed = 0;
+
+  while(offset + CLAM_PROV_SIZE_BLOCK_HEADER <= payload_size && (max_records == 0 || printed < max_records)){
+    char *header = &payload[offset];
+    unsigned int block_size = get_u32(&header[12]);
+    int version = (unsigned char)header[4];
+    int records_read = -1;
+
+    if(get_u32(&header[0]) != CLAM_PROV_LOG_MAGIC || block_size > payload_size - offset - CLAM_PROV_SIZE_BLOCK_HEADER){
+      return -1;
+    }
+    if(version == CLAM_PROV_LOG_FORMAT_V2){
+      records_read = parse_block_v2(get_u32(&header[8]), (unsigned char)header[5], &header[CLAM_PROV_SIZE_BLOCK_HEADER], block_size, max_records - printed);
+    }else if(version == CLAM_PROV_LOG_FORMAT_V3){
+      records_read = parse_block_v3(get_u32(&header[8]), (unsigned char)header[5], &header[CLAM_PROV_SIZE_BLOCK_HEADER], block_size, max_records - printed);
+    }
+    if(records_read < 0){
+      return -1;
+    }
+    printed += records_read;
+    offset += CLAM_PROV_SIZE_BLOCK_HEADER + block_size;
+  }
+  return printed;
+}
+
+/*
+  Reads the batches of the shared file output from 'offset' up to 'tail'. Batches that are not completely written (or
+  not at all) are skipped. All the batches are read if 'max_records' is '0' (for the function names).
+
+  Returns the number of records printed
+*/
+static int read_batches(int fd, off_t offset, off_t tail, int max_records){
+  char header[CLAM_PROV_SIZE_BLOCK_HEADER];
+  char *payload;
+  unsigned int payload_size;
+  int records_read;
+  int printed = 0;
+
+  while(offset + CLAM_PROV_SIZE_BLOCK_HEADER <= tail && (max_records == 0 || printed < max_records)){
+    if(pread(fd, &header[0], CLAM_PROV_SIZE_BLOCK_HEADER, offset) != CLAM_PROV_SIZE_BLOCK_HEADER){
+      break; // Reserved, but not written up to here yet
+    }
+    payload_size = get_u32(&header[12]);
+    if(get_u32(&header[0]) != CLAM_PROV_LOG_MAGIC || (unsigned char)header[4] != CLAM_PROV_BLOCK_BATCH ||
+       payload_size > tail - offset - CLAM_PROV_SIZE_BLOCK_HEADER){
+      offset += CLAM_PROV_SHARED_ALIGNMENT; // Not a batch
+      continue;
+    }
+
+    payload = (char *)malloc(payload_size);
+    if(payload == NULL){
+      perror("Failed to allocate memory");
+      break;
+    }
+    records_read = -1;
+    if(pread(fd, payload, payload_size, offset + CLAM_PROV_SIZE_BLOCK_HEADER) == (ssize_t)payload_size){
+      records_read = parse_batch(payload, payload_size, max_records - printed);
+    }
+    free(payload);
+    if(records_read < 0){
+      offset += CLAM_PROV_SHARED_ALIGNMENT; // Not a batch
+      continue;
+    }
+    printed += records_read;
+    offset += CLAM_PROV_SIZE_BLOCK_HEADER + payload_size;
+    offset += (CLAM_PROV_SHARED_ALIGNMENT - (offset % CLAM_PROV_SHARED_ALIGNMENT)) % CLAM_PROV_SHARED_ALIGNMENT;
+  }
+  return printed;
+}
+
+/*
+  'header' holds the block header, and 'header_offset' is its offset in the log file. Reads the payload of the block.
+
+  Returns the number of records printed, or -1 on failure
+*/
+static int read_block(int fd, char *header, off_t header_offset, int max_records, off_t *block_size){
+  unsigned int pid = get_u32(&header[8]);
+  unsigned int payload_size = get_u32(&header[12]);
+  int version = (unsigned char)header[4];
+  char *payload;
+  int bytes_read, printed;
+
+  if(version != CLAM_PROV_LOG_FORMAT_V2 && version != CLAM_PROV_LOG_FORMAT_V3 && version != CLAM_PROV_BLOCK_SEGMENT &&
+     version != CLAM_PROV_BLOCK_SHARED && version != CLAM_PROV_BLOCK_SUMMARY && version != CLAM_PROV_BLOCK_FOOTER){
+    printf("Unsupported log format version %d\n", version);
+    return -1;
+  }
+
+  payload = (char *)malloc(payload_size);
+  if(payload == NULL){
+    perror("Failed to allocate memory");
+    return -1;
+  }
+  bytes_read = read_fully(fd, payload, payload_size);
+  *block_size = CLAM_PROV_SIZE_BLOCK_HEADER + (bytes_read < 0 ? 0 : bytes_read);
+  if(bytes_read != (int)payload_size && (version != CLAM_PROV_BLOCK_SEGMENT || bytes_read < 0)){
+    // A segment is cut short if its process crashed while trimming it
+    printf("Truncated block in log file\n");
+    free(payload);
+    return -1;
+  }
+
+  if(version == CLAM_PROV_LOG_FORMAT_V2){
+    printed = parse_block_v2(pid, (unsigned char)header[5], payload, payload_size, max_records);
+  }else if(version == CLAM_PROV_LOG_FORMAT_V3){
+    printed = parse_block_v3(pid, (unsigned char)header[5], payload, payload_size, max_records);
+  }else if(version == CLAM_PROV_BLOCK_SUMMARY){
+    printed = parse_block_summary(pid, payload, payload_size, max_records);
+  }else if(version == CLAM_PROV_BLOCK_FOOTER){
+    printed = parse_block_footer(pid, payload, payload_size, max_records > 0);
+  }else if(version == CLAM_PROV_BLOCK_SEGMENT){
+    printed = parse_segment(header_offset + CLAM_PROV_SIZE_BLOCK_HEADER, payload, (unsigned int)bytes_read, max_records);
+  }else{
+    unsigned long tail;
+    memcpy((void*)(&tail), (void*)payload, sizeof(tail));
+    if(((header[5] & CLAM_PROV_BLOCK_FLAG_BIG_ENDIAN) != 0) != is_host_big_endian()){
+      tail = __builtin_bswap64(tail);
+    }
+    // The batches are the rest of the file
+    printed = read_batches(fd, header_offset + CLAM_PROV_SIZE_BLOCK_HEADER + payload_size, (off_t)tail, max_records);
+    lseek(fd, 0, SEEK_END);
+  }
+  free(payload);
+  return printed;
+}
+
+/*
+  Reads up to 'record_count' records, or only the function names of all the blocks if 'print' is '0'.
+
+  Returns 1 on success, and 0 on failure
+*/
+static int read_log(int fd, int record_count, int print){
+  off_t offset;
+  int i;
+
+  // The format is detected per block. v1 records (which have no header) are at least as big as a v2 block header.
+  offset = 0;
+  i = 0;
+  while(print == 0 || i < record_count){
     int bytes_read;
-    char data[data_size];
+    char data[CLAM_PROV_SIZE_RECORD];
 
-    bytes_read = read(fd, (void*)(&data[0]), data_size);
+    bytes_read = read_fully(fd, &data[0], CLAM_PROV_SIZE_BLOCK_HEADER);
 
     if(bytes_read == 0){
       break;
@@ -41,36 +580,57 @@ int main(int argc, char *argv[]){
 
     if(bytes_read < 0){
       perror("Failed to read log file");
-      break;
+      return 0;
     }
 
-    if(bytes_read != data_size){
-      printf("Invalid number of bytes in log file. Must be a multiple of %d\n", data_size);
-      break;
+    if(bytes_read != CLAM_PROV_SIZE_BLOCK_HEADER){
+      printf("Invalid number of bytes in log file\n");
+      return 0;
     }
 
-    unsigned long time;
-    int pid;
-    long call_site_tag;
-    long exit;
-    char function_name[sizeof_function_name];
-
-    int offset = 0;
-    memcpy((void*)(&time), (void*)(&data[offset]), sizeof_unsigned_long);
-    offset += sizeof_unsigned_long;
-    memcpy((void*)(&pid), (void*)(&data[offset]), sizeof_int);
-    offset += sizeof_int;
-    memcpy((void*)(&call_site_tag), (void*)(&data[offset]), sizeof_long);
-    offset += sizeof_long;
-    memcpy((void*)(&exit), (void*)(&data[offset]), sizeof_long);
-    offset += sizeof_long;
-    memcpy((void*)(&function_name[0]), (void*)(&data[offset]), sizeof_function_name);
-    offset += sizeof_function_name;
-
-    printf("Record[time=%lu, pid=%d, call_site_tag=%ld, exit=%ld, function_name=%s]\n",
-      time, pid, call_site_tag, exit, &function_name[0]
-    );
+    if(get_u32(&data[0]) == CLAM_PROV_LOG_MAGIC){
+      off_t block_size;
+      int records_read = read_block(fd, &data[0], offset, print == 0 ? 0 : record_count - i, &block_size);
+      if(records_read < 0){
+        return 0;
+      }
+      i += records_read;
+      offset += block_size;
+    }else{
+      if(read_record_v1(fd, &data[0], print) == 0){
+        return 0;
+      }
+      i += print;
+      offset += CLAM_PROV_SIZE_RECORD;
+    }
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[]){
+
+  if(argc != 3){
+    fprintf(stderr, "Missing arguments: <log file path> <number of records to read>\n");
+    return 1;
+  }
+
+  char *log_path = argv[1];
+  int record_count = atoi(argv[2]);
+  int fd;
+
+  fd = open(log_path, O_RDONLY);
+
+  if(fd < 0){
+    perror("Log file open failed!");
+    return 1;
+  }
+
+  // Records of the memory-mapped output can be before the names of their functions, so the names are read first
+  if(lseek(fd, 0, SEEK_SET) == 0){
+    read_log(fd, record_count, 0);
+    lseek(fd, 0, SEEK_SET);
   }
+  read_log(fd, record_count, 1);
 
   close(fd);
 
@@ -0,0 +1,90 @@
+#include "../Logging/clam-prov-logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+
+#define POLL_SPINS 1000 // Polls of an empty ring before sleeping
+#define POLL_SLEEP_US 100
+
+static volatile sig_atomic_t is_running = 1;
+
+static void stop(int signal_number){
+  is_running = 0;
+}
+
+// The size is only printed for the records that have one, and the weight for the records that stand for more than one
+// execution (sampling)
+static void print_record(const clam_prov_record *record, const char *function_name){
+  char size_text[32], weight_text[32];
+
+  size_text[0] = weight_text[0] = '\0';
+  if(record->size != -1){
+    snprintf(&size_text[0], sizeof(size_text), ", size=%ld", record->size);
+  }
+  if(record->weight != 1){
+    snprintf(&weight_text[0], sizeof(weight_text), ", weight=%lu", record->weight);
+  }
+  printf("Record[time=%lu, pid=%d, call_site_tag=%ld, exit=%ld%s, function_name=%s%s]\n",
+    record->time, record->pid, record->call_site_id, record->exit, &size_text[0],
+    function_name == NULL ? "?" : function_name, &weight_text[0]
+  );
+}
+
+int main(int argc, char *argv[]){
+
+  if(argc > 2){
+    fprintf(stderr, "Arguments: [number of records to read (default: until interrupted)]\n");
+    return 1;
+  }
+
+  long record_count = argc == 2 ? atol(argv[1]) : -1;
+  long i;
+  int spins;
+  unsigned long dropped, last_dropped;
+  clam_prov_ring *ring;
+
+  ring = clam_prov_ring_open();
+
+  if(ring == NULL){
+    fprintf(stderr, "Shared memory open failed! Is another reader running?\n");
+    return 1;
+  }
+
+  signal(SIGINT, &stop);
+  signal(SIGTERM, &stop);
+
+  i = 0;
+  spins = 0;
+  last_dropped = 0;
+  while(is_running && (record_count < 0 || i < record_count)){
+    const clam_prov_record *record = clam_prov_ring_peek(ring);
+
+    if(record == NULL){
+      fflush(stdout);
+      if(++spins < POLL_SPINS){
+        sched_yield();
+      }else{
+        usleep(POLL_SLEEP_US);
+      }
+      dropped = clam_prov_ring_dropped(ring);
+      if(dropped != last_dropped){
+        fprintf(stderr, "Dropped %lu records\n", dropped - last_dropped);
+        last_dropped = dropped;
+      }
+      continue;
+    }
+    spins = 0;
+
+    print_record(record, clam_prov_ring_function_name(ring, record->function_id));
+    clam_prov_ring_release(ring);
+    i++;
+  }
+
+  fflush(stdout);
+  clam_prov_ring_close(ring);
+
+  return 0;
+}
@@ -0,0 +1,42 @@
+// RUN: %clam-prov %s --add-metadata-config=%tests/logging1/AddMetadata.config --add-logging-config=%tests/logging1/AddLogging.config -oll %T/test.out.ll
+// RUN: FileCheck %s < %T/test.out.ll
+// CHECK: @clam_prov_inline_thread_buffer = external thread_local(initialexec) global %clam_prov_inline_buffer*
+// CHECK: @clam_prov.function_id.read = internal global i32 0
+// CHECK-LABEL: define {{.*}}@main(
+// CHECK: [[READ:%[^ ]+]] = call i64 @read(
+// CHECK-NEXT: load atomic i32, i32* @clam_prov_logging_is_inited acquire
+// CHECK-NEXT: load %clam_prov_inline_buffer*, %clam_prov_inline_buffer** @clam_prov_inline_thread_buffer
+// CHECK-NEXT: load atomic i32, i32* @clam_prov.function_id.read monotonic
+// CHECK: br i1 {{.*}}, label %clam_prov.check, label %clam_prov.slow
+// CHECK: clam_prov.append:
+// CHECK: store i64 [[READ]],
+// CHECK: call i32 @clock_gettime(i32 0,
+// CHECK: cmpxchg
+// CHECK: call i32 @clam_prov_logging_check_and_flush(i32 0)
+// CHECK: clam_prov.slow:
+// CHECK-NEXT: call i32 @clam_prov_log_slow(i64 {{[0-9]+}}, i64 [[READ]], i64 -1, {{.*}}, i32* @clam_prov.function_id.read)
+// CHECK: call i64 @write(
+// CHECK: call i32 @clam_prov_log_slow({{.*}}, i32* @clam_prov.function_id.write)
+
+/*
+  With inline_logging, the record of each call-site is appended to the
+  buffer of the thread by the instructions emitted after it, and the
+  logger is only called (clam_prov_log_slow) for the first record of
+  the function name, or when the buffer is full or not available.
+*/
+
+#include <unistd.h>
+
+int main(int argc, char *argv[]){
+  char buffer[16];
+  ssize_t count;
+
+  count = read(STDIN_FILENO, &buffer[0], sizeof(buffer));
+  if(count < 0){
+    return 1;
+  }
+  if(write(STDOUT_FILENO, &buffer[0], count) != count){
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,35 @@
+// RUN: clang %s %src/Logging/clam-prov-logger.c -I%src/Logging -lpthread -lrt -o %T/test.out
+// RUN: clang %src/Util/CallSiteLogReader.c -o %T/reader
+// RUN: rm -f %T/audit.log*
+// RUN: env CLAM_PROV_OUTPUT_PATH=%T/audit.log %T/test.out
+// RUN: %T/reader %T/audit.log 100 | FileCheck %s
+// CHECK: Record[time={{[0-9]+}}, pid=[[PID:[0-9]+]], call_site_tag=0, exit=16, size=16, function_name=read]
+// CHECK-NEXT: Record[time={{[0-9]+}}, pid=[[PID]], call_site_tag=1, exit=-1, size=16, function_name=write]
+// CHECK-NEXT: Record[time={{[0-9]+}}, pid=[[PID]], call_site_tag=0, exit=16, size=16, function_name=read]
+// CHECK-NEXT: Record[time={{[0-9]+}}, pid=[[PID]], call_site_tag=1, exit=-1, size=16, function_name=write]
+// CHECK-NEXT: Record[time={{[0-9]+}}, pid=[[PID]], call_site_tag=0, exit=16, size=16, function_name=read]
+// CHECK-NEXT: Record[time={{[0-9]+}}, pid=[[PID]], call_site_tag=1, exit=-1, size=16, function_name=write]
+// CHECK-NOT: Record
+
+/*
+  The shared file output (output_mode = 4, with log_format = 2) starts
+  with a header that holds the end of the reserved space, and each write
+  reserves a batch of blocks after it. The reader prints the records
+  back from the batches.
+*/
+
+#include "clam-prov-logger.h"
+
+int main(int argc, char *argv[]){
+  int i;
+
+  if(clam_prov_logging_init(3, 4, 4, 2) == 0){
+    return 1;
+  }
+  for(i = 0; i < 3; i++){
+    clam_prov_log_size(0, 16, 16, "read");
+    clam_prov_log_size(1, -1, 16, "write");
+  }
+  clam_prov_logging_shutdown(0);
+  return 0;
+}
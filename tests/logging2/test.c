@@ -0,0 +1,37 @@
+// RUN: %clam-prov %s --add-metadata-config=%tests/logging2/AddMetadata.config --add-logging-config=%tests/logging2/AddLogging.config -oll %T/test.out.ll
+// RUN: FileCheck %s < %T/test.out.ll
+// CHECK-LABEL: define {{.*}}@main(
+// CHECK: [[READ:%[^ ]+]] = call i64 @read(
+// CHECK-NEXT: [[NEGATIVE:%[^ ]+]] = icmp slt i64 [[READ]], 0
+// CHECK-NEXT: br i1 [[NEGATIVE]], label %[[READ_LOG:clam_prov.condition.enabled[0-9]*]], label %{{.*}}, !prof [[WEIGHTS:![0-9]+]]
+// CHECK: [[READ_LOG]]:
+// CHECK-NEXT: call i32 @clam_prov_log_i64(i64 {{[0-9]+}}, i64 [[READ]],
+// CHECK: [[WRITE:%[^ ]+]] = call i64 @write(i32 {{.*}}, i8* {{.*}}, i64 [[SIZE:[^ )]+]])
+// CHECK-NEXT: [[SHORT:%[^ ]+]] = icmp ne i64 [[WRITE]], [[SIZE]]
+// CHECK-NEXT: br i1 [[SHORT]], label %[[WRITE_LOG:clam_prov.condition.enabled[0-9]*]], label %{{.*}}, !prof [[WEIGHTS]]
+// CHECK: [[WRITE_LOG]]:
+// CHECK-NEXT: call i32 @clam_prov_log_i64(i64 {{[0-9]+}}, i64 [[WRITE]],
+// CHECK: [[WEIGHTS]] = !{!"branch_weights",
+
+/*
+  With log_if, a read is only logged if it fails (negative) and a
+  write if it is short (not_size, against the count given by its
+  clam-prov-size label). The check is emitted right after the call,
+  and the call to the logger is moved to a block of its own.
+*/
+
+#include <unistd.h>
+
+int main(int argc, char *argv[]){
+  char buffer[16];
+  ssize_t count;
+
+  count = read(STDIN_FILENO, &buffer[0], sizeof(buffer));
+  if(count < 0){
+    return 1;
+  }
+  if(write(STDOUT_FILENO, &buffer[0], count) != count){
+    return 1;
+  }
+  return 0;
+}
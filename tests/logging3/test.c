@@ -0,0 +1,36 @@
+// RUN: %clam-prov %s --add-metadata-config=%tests/logging3/AddMetadata.config --add-logging-config=%tests/logging3/AddLogging.config -oll %T/test.out.ll
+// RUN: FileCheck %s < %T/test.out.ll
+// CHECK: @clam_prov.site.{{[0-9]+}} = internal global i8 0
+// CHECK: @clam_prov.sites = internal constant [2 x %clam_prov_site]
+// CHECK: @llvm.global_ctors = appending global {{.*}} { i32 101, void ()* @clam_prov.register_sites, i8* null }
+// CHECK-LABEL: define {{.*}}@main(
+// CHECK: [[SWITCH:%[^ ]+]] = load atomic i8, i8* @clam_prov.site.{{[0-9]+}} monotonic
+// CHECK-NEXT: [[ENABLED:%[^ ]+]] = icmp ne i8 [[SWITCH]], 0
+// CHECK-NEXT: call i64 @read(
+// CHECK-NEXT: br i1 [[ENABLED]], label %[[LOG:clam_prov.condition.enabled[0-9]*]], label
+// CHECK: [[LOG]]:
+// CHECK-NEXT: call i32 @clam_prov_log_i64(
+// CHECK-LABEL: define internal void @clam_prov.register_sites()
+// CHECK: call i32 @clam_prov_logging_register_sites({{.*}}@clam_prov.sites{{.*}}, i32 2)
+
+/*
+  With site_switches = 2, each call-site has a switch (a byte that
+  starts turned off), loaded before the call and tested after it, and
+  the switches are registered with the logger by a constructor.
+*/
+
+#include <unistd.h>
+
+int main(int argc, char *argv[]){
+  char buffer[16];
+  ssize_t count;
+
+  count = read(STDIN_FILENO, &buffer[0], sizeof(buffer));
+  if(count < 0){
+    return 1;
+  }
+  if(write(STDOUT_FILENO, &buffer[0], count) != count){
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,40 @@
+// RUN: %clam-prov %s --add-metadata-config=%tests/logging4/AddMetadata.config --add-logging-config=%tests/logging4/AddLogging.config -oll %T/test.out.ll
+// RUN: FileCheck %s < %T/test.out.ll
+// CHECK-LABEL: define {{.*}}@main(
+// CHECK: [[TIME:%[^ ]+]] = alloca %clam_prov_timespec
+// CHECK: [[SWITCH:%[^ ]+]] = load atomic i8, i8* @clam_prov.site.{{[0-9]+}} monotonic
+// CHECK-NEXT: [[ENABLED:%[^ ]+]] = icmp ne i8 [[SWITCH]], 0
+// CHECK-NEXT: br i1 [[ENABLED]], label %[[BEFORE:clam_prov.condition.enabled[0-9]*]], label
+// CHECK: [[BEFORE]]:
+// CHECK-NEXT: call i32 @clock_gettime(i32 1, %clam_prov_timespec* [[TIME]])
+// CHECK: [[START:%[^ ]+]] = phi i64 [ {{.*}} ], [ 0, {{.*}} ]
+// CHECK-NEXT: [[READ:%[^ ]+]] = call i64 @read(
+// CHECK-NEXT: br i1 [[ENABLED]], label %[[AFTER:clam_prov.condition.enabled[0-9]*]], label
+// CHECK-NOT: clock_gettime
+// CHECK: [[AFTER]]:
+// CHECK-NEXT: call i32 @clock_gettime(i32 1, %clam_prov_timespec* [[TIME]])
+// CHECK: [[LATENCY:%[^ ]+]] = sub i64 {{.*}}, [[START]]
+// CHECK-NEXT: call i32 @clam_prov_log_latency(i64 {{[0-9]+}}, i64 [[LATENCY]])
+// CHECK-NEXT: call i32 @clam_prov_log_i64(i64 {{[0-9]+}}, i64 [[READ]],
+
+/*
+  With latency, the time is read right before and right after each
+  call. With site_switches, both reads are behind the switch of the
+  call-site, so a call-site that is turned off doesn't read the clock.
+*/
+
+#include <unistd.h>
+
+int main(int argc, char *argv[]){
+  char buffer[16];
+  ssize_t count;
+
+  count = read(STDIN_FILENO, &buffer[0], sizeof(buffer));
+  if(count < 0){
+    return 1;
+  }
+  if(write(STDOUT_FILENO, &buffer[0], count) != count){
+    return 1;
+  }
+  return 0;
+}
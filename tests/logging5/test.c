@@ -0,0 +1,29 @@
+// RUN: %clam-prov %s --add-metadata-config=%tests/logging5/AddMetadata.config --add-logging-config=%tests/logging5/AddLogging.config -oll %T/test.out.ll
+// RUN: FileCheck %s < %T/test.out.ll
+// CHECK-LABEL: define {{.*}}@main(
+// CHECK: call i32 (i64, ...) @clam_prov_logging_init(i64 {{[0-9]+}}, i64 100, i64 0, i64 2,
+// CHECK: [[READ:%[^ ]+]] = call i64 @read(i32 {{.*}}, i8* {{.*}}, i64 [[READ_SIZE:[^ )]+]])
+// CHECK-NEXT: call i32 @clam_prov_log_size(i64 {{[0-9]+}}, i64 [[READ]], i64 [[READ_SIZE]], i8* {{.*}}@read
+// CHECK: [[WRITE:%[^ ]+]] = call i64 @write(i32 {{.*}}, i8* {{.*}}, i64 [[WRITE_SIZE:[^ )]+]])
+// CHECK-NEXT: call i32 @clam_prov_log_size(i64 {{[0-9]+}}, i64 [[WRITE]], i64 [[WRITE_SIZE]], i8* {{.*}}@write
+
+/*
+  With log_size, each call-site is logged with the count given by its
+  clam-prov-size label next to its return value.
+*/
+
+#include <unistd.h>
+
+int main(int argc, char *argv[]){
+  char buffer[16];
+  ssize_t count;
+
+  count = read(STDIN_FILENO, &buffer[0], sizeof(buffer));
+  if(count < 0){
+    return 1;
+  }
+  if(write(STDOUT_FILENO, &buffer[0], count) != count){
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,30 @@
+// RUN: clang %s %src/Logging/clam-prov-logger.c -I%src/Logging -lpthread -lrt -o %T/test.out
+// RUN: clang %src/Util/CallSiteLogReader.c -o %T/reader
+// RUN: rm -f %T/audit.log*
+// RUN: env CLAM_PROV_OUTPUT_PATH=%T/audit.log %T/test.out
+// RUN: %T/reader %T/audit.log 100 | FileCheck %s
+// CHECK: Summary[start={{[0-9]+}}, end={{[0-9]+}}, pid=[[PID:[0-9]+]], call_site_tag=0, function_name=read, count=3, exits={16..31:3}]
+// CHECK-NEXT: Summary[start={{[0-9]+}}, end={{[0-9]+}}, pid=[[PID]], call_site_tag=1, function_name=write, count=3, exits={-1..-1:3}]
+// CHECK-NOT: Summary
+
+/*
+  The aggregation output (output_mode = 5) writes a summary of the
+  call-sites at shutdown, with the number of calls of each call-site in
+  each bucket of exit values.
+*/
+
+#include "clam-prov-logger.h"
+
+int main(int argc, char *argv[]){
+  int i;
+
+  if(clam_prov_logging_init(2, 4, 5) == 0){
+    return 1;
+  }
+  for(i = 0; i < 3; i++){
+    clam_prov_log_size(0, 16, 16, "read");
+    clam_prov_log_size(1, -1, 16, "write");
+  }
+  clam_prov_logging_shutdown(0);
+  return 0;
+}
@@ -0,0 +1,34 @@
+// RUN: clang %s %src/Logging/clam-prov-logger.c -I%src/Logging -lpthread -lrt -o %T/test.out
+// RUN: clang %src/Util/CallSiteLogReader.c -o %T/reader
+// RUN: rm -f %T/audit.log*
+// RUN: env CLAM_PROV_OUTPUT_PATH=%T/audit.log %T/test.out
+// RUN: %T/reader %T/audit.log.1 100000 | FileCheck %s
+// RUN: %T/reader %T/audit.log 100000 | FileCheck %s --check-prefix=LAST
+// CHECK: Record[time={{[0-9]+}}, pid=[[PID:[0-9]+]], call_site_tag=0, exit=16, function_name=read]
+// CHECK: Footer[pid=[[PID]], records={{[0-9]+}}, start={{[0-9]+}}, end={{[0-9]+}}, call_site_tags={0, 1}]
+// CHECK-NOT: Record
+// LAST: Record[time={{[0-9]+}}, pid={{[0-9]+}}, call_site_tag=1, exit=16, function_name=write]
+// LAST-NOT: Footer
+
+/*
+  With rotate_size_mb = 1, the file is closed by the write that takes
+  it to 1 MiB: a footer that indexes its records is appended as its last
+  block, and it is renamed to audit.log.1. The file that is still open
+  has no footer.
+*/
+
+#include "clam-prov-logger.h"
+
+int main(int argc, char *argv[]){
+  int i;
+
+  if(clam_prov_logging_init(15, 1000, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0L, 0, 0, 0, 1) == 0){
+    return 1;
+  }
+  for(i = 0; i < 20000; i++){
+    clam_prov_log_i64(0, 16, "read");
+    clam_prov_log_i64(1, 16, "write");
+  }
+  clam_prov_logging_shutdown(0);
+  return 0;
+}